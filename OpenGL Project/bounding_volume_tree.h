@@ -0,0 +1,303 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "frustum_culler.h"
+
+#define BVH_NULL_NODE -1
+#define BVH_MARGIN 0.1f		// leaves are enlarged by this part of their size on every side
+
+struct BoundingBox
+{
+	glm::vec3 min, max;
+};
+
+// Smallest world space box around a transformed model space box
+BoundingBox transformBox(const BoundingBox &box, const glm::mat4 &transform)
+{
+	glm::vec3 center = glm::vec3(transform * glm::vec4((box.min + box.max) * 0.5f, 1.0f));
+	glm::mat3 absolute(transform);
+	for (int i = 0; i < 3; ++i)
+		absolute[i] = glm::abs(absolute[i]);
+	glm::vec3 extent = absolute * ((box.max - box.min) * 0.5f);
+	BoundingBox result = { center - extent, center + extent };
+	return result;
+}
+
+struct BoundingVolumeTreeStats
+{
+	GLuint queries, nodes_visited;
+	GLuint moves, reinsertions;
+};
+
+// Dynamic AABB tree. Leaves hold enlarged boxes, so an object that moves a
+// little stays inside its leaf and nothing changes; once it leaves the box the
+// leaf is taken out and reinserted where it grows the tree's surface area the
+// least. Ancestors are refit on the way up and rotated when one side gets two
+// levels taller than the other, which keeps queries logarithmic
+class BoundingVolumeTree
+{
+	struct Node
+	{
+		BoundingBox box;
+		GLint parent;		// next free node while on the free list
+		GLint left, right;
+		GLint height;		// 0 for leaves, -1 for free nodes
+		GLuint object;
+		bool isLeaf() const { return left == BVH_NULL_NODE; }
+	};
+	std::vector <Node> nodes;
+	GLint root, free_list;
+	GLuint leaf_count;
+	BoundingVolumeTreeStats stats;
+	std::vector <std::pair <GLint, GLuint>> stack;		// node and the planes it still has to be tested against
+	static GLfloat getArea(const BoundingBox &box);
+	static BoundingBox combine(const BoundingBox &a, const BoundingBox &b);
+	static bool contains(const BoundingBox &outer, const BoundingBox &inner);
+	GLint allocateNode();
+	void freeNode(GLint node);
+	void insertLeaf(GLint leaf);
+	void removeLeaf(GLint leaf);
+	void refit(GLint node);
+	GLint balance(GLint node);
+public:
+	BoundingVolumeTree();
+	GLint insert(const BoundingBox &box, GLuint object);
+	void remove(GLint proxy);
+	bool move(GLint proxy, const BoundingBox &box);
+	void query(const Frustum &frustum, std::vector <GLuint> &objects);
+	GLint getHeight() const;
+	GLuint getLeafCount() const;
+	const BoundingVolumeTreeStats &getStats() const;
+};
+
+BoundingVolumeTree::BoundingVolumeTree() : root(BVH_NULL_NODE), free_list(BVH_NULL_NODE), leaf_count(0), stats() {}
+// Half the surface area, only compared against each other
+GLfloat BoundingVolumeTree::getArea(const BoundingBox &box)
+{
+	glm::vec3 size = box.max - box.min;
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+BoundingBox BoundingVolumeTree::combine(const BoundingBox &a, const BoundingBox &b)
+{
+	BoundingBox box = { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+	return box;
+}
+bool BoundingVolumeTree::contains(const BoundingBox &outer, const BoundingBox &inner)
+{
+	return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+}
+GLint BoundingVolumeTree::allocateNode()
+{
+	GLint node;
+	if (free_list != BVH_NULL_NODE)
+	{
+		node = free_list;
+		free_list = nodes[node].parent;
+	}
+	else
+	{
+		node = (GLint)nodes.size();
+		nodes.push_back(Node());
+	}
+	nodes[node].parent = nodes[node].left = nodes[node].right = BVH_NULL_NODE;
+	nodes[node].height = 0;
+	nodes[node].object = 0;
+	return node;
+}
+void BoundingVolumeTree::freeNode(GLint node)
+{
+	nodes[node].parent = free_list;
+	nodes[node].height = -1;
+	free_list = node;
+}
+// Walks down towards the sibling that is cheapest to pair the leaf with. The cost
+// of a choice is the area of the new parent plus the growth of every ancestor,
+// the descent stops when no child can beat pairing with the current node
+void BoundingVolumeTree::insertLeaf(GLint leaf)
+{
+	if (root == BVH_NULL_NODE)
+	{
+		root = leaf;
+		nodes[root].parent = BVH_NULL_NODE;
+		return;
+	}
+
+	BoundingBox leaf_box = nodes[leaf].box;
+	GLint index = root;
+	while (!nodes[index].isLeaf())
+	{
+		GLfloat area = getArea(nodes[index].box);
+		GLfloat combined_area = getArea(combine(nodes[index].box, leaf_box));
+		GLfloat cost = 2.0f * combined_area;
+		GLfloat inheritance = 2.0f * (combined_area - area);
+
+		GLfloat child_costs[2];
+		GLint children[2] = { nodes[index].left, nodes[index].right };
+		for (int i = 0; i < 2; ++i)
+		{
+			const Node &child = nodes[children[i]];
+			GLfloat child_area = getArea(combine(leaf_box, child.box));
+			child_costs[i] = (child.isLeaf() ? child_area : child_area - getArea(child.box)) + inheritance;
+		}
+		if (cost < child_costs[0] && cost < child_costs[1])
+			break;
+		index = child_costs[0] < child_costs[1] ? children[0] : children[1];
+	}
+
+	GLint sibling = index;
+	GLint old_parent = nodes[sibling].parent;
+	GLint new_parent = allocateNode();
+	nodes[new_parent].parent = old_parent;
+	nodes[new_parent].box = combine(leaf_box, nodes[sibling].box);
+	nodes[new_parent].height = nodes[sibling].height + 1;
+	nodes[new_parent].left = sibling;
+	nodes[new_parent].right = leaf;
+	nodes[sibling].parent = nodes[leaf].parent = new_parent;
+	if (old_parent == BVH_NULL_NODE)
+		root = new_parent;
+	else if (nodes[old_parent].left == sibling)
+		nodes[old_parent].left = new_parent;
+	else
+		nodes[old_parent].right = new_parent;
+
+	refit(nodes[leaf].parent);
+}
+// The sibling takes the parent's place
+void BoundingVolumeTree::removeLeaf(GLint leaf)
+{
+	if (leaf == root)
+	{
+		root = BVH_NULL_NODE;
+		return;
+	}
+	GLint parent = nodes[leaf].parent;
+	GLint grandparent = nodes[parent].parent;
+	GLint sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+	nodes[sibling].parent = grandparent;
+	freeNode(parent);
+	if (grandparent == BVH_NULL_NODE)
+	{
+		root = sibling;
+		return;
+	}
+	if (nodes[grandparent].left == parent)
+		nodes[grandparent].left = sibling;
+	else
+		nodes[grandparent].right = sibling;
+	refit(grandparent);
+}
+void BoundingVolumeTree::refit(GLint node)
+{
+	while (node != BVH_NULL_NODE)
+	{
+		node = balance(node);
+		Node &current = nodes[node];
+		current.height = 1 + std::max(nodes[current.left].height, nodes[current.right].height);
+		current.box = combine(nodes[current.left].box, nodes[current.right].box);
+		node = current.parent;
+	}
+}
+// Rotates the taller child up when the heights differ by more than one, its
+// taller child stays with it and the shorter one moves under the old node.
+// Returns the node now at this place in the tree
+GLint BoundingVolumeTree::balance(GLint a)
+{
+	if (nodes[a].isLeaf() || nodes[a].height < 2)
+		return a;
+	GLint b = nodes[a].left, c = nodes[a].right;
+	GLint difference = nodes[c].height - nodes[b].height;
+	if (difference >= -1 && difference <= 1)
+		return a;
+
+	// up is the child rotated up, other the one staying under a
+	bool right_up = difference > 1;
+	GLint up = right_up ? c : b, other = right_up ? b : c;
+	GLint f = nodes[up].left, g = nodes[up].right;
+	GLint taller = nodes[f].height > nodes[g].height ? f : g, shorter = taller == f ? g : f;
+
+	nodes[up].left = a;
+	nodes[up].parent = nodes[a].parent;
+	nodes[a].parent = up;
+	if (nodes[up].parent == BVH_NULL_NODE)
+		root = up;
+	else if (nodes[nodes[up].parent].left == a)
+		nodes[nodes[up].parent].left = up;
+	else
+		nodes[nodes[up].parent].right = up;
+
+	nodes[up].right = taller;
+	if (right_up)
+		nodes[a].right = shorter;
+	else
+		nodes[a].left = shorter;
+	nodes[shorter].parent = a;
+	nodes[a].box = combine(nodes[other].box, nodes[shorter].box);
+	nodes[a].height = 1 + std::max(nodes[other].height, nodes[shorter].height);
+	nodes[up].box = combine(nodes[a].box, nodes[taller].box);
+	nodes[up].height = 1 + std::max(nodes[a].height, nodes[taller].height);
+	return up;
+}
+GLint BoundingVolumeTree::insert(const BoundingBox &box, GLuint object)
+{
+	GLint leaf = allocateNode();
+	glm::vec3 margin = (box.max - box.min) * BVH_MARGIN;
+	nodes[leaf].box.min = box.min - margin;
+	nodes[leaf].box.max = box.max + margin;
+	nodes[leaf].object = object;
+	insertLeaf(leaf);
+	++leaf_count;
+	return leaf;
+}
+void BoundingVolumeTree::remove(GLint proxy)
+{
+	removeLeaf(proxy);
+	freeNode(proxy);
+	--leaf_count;
+}
+// Returns whether the tree changed
+bool BoundingVolumeTree::move(GLint proxy, const BoundingBox &box)
+{
+	++stats.moves;
+	if (contains(nodes[proxy].box, box))
+		return false;
+	++stats.reinsertions;
+	removeLeaf(proxy);
+	glm::vec3 margin = (box.max - box.min) * BVH_MARGIN;
+	nodes[proxy].box.min = box.min - margin;
+	nodes[proxy].box.max = box.max + margin;
+	insertLeaf(proxy);
+	return true;
+}
+// Subtrees entirely inside a plane don't test it again, and subtrees inside all
+// of them are collected without any tests
+void BoundingVolumeTree::query(const Frustum &frustum, std::vector <GLuint> &objects)
+{
+	++stats.queries;
+	if (root == BVH_NULL_NODE)
+		return;
+	stack.clear();
+	stack.push_back(std::make_pair(root, (GLuint)FRUSTUM_ALL_PLANES));
+	while (!stack.empty())
+	{
+		GLint node = stack.back().first;
+		GLuint plane_mask = stack.back().second;
+		stack.pop_back();
+		++stats.nodes_visited;
+		if (plane_mask && !intersectsFrustum(frustum, nodes[node].box.min, nodes[node].box.max, plane_mask))
+			continue;
+		if (nodes[node].isLeaf())
+			objects.push_back(nodes[node].object);
+		else
+		{
+			stack.push_back(std::make_pair(nodes[node].left, plane_mask));
+			stack.push_back(std::make_pair(nodes[node].right, plane_mask));
+		}
+	}
+}
+GLint BoundingVolumeTree::getHeight() const { return root == BVH_NULL_NODE ? 0 : nodes[root].height; }
+GLuint BoundingVolumeTree::getLeafCount() const { return leaf_count; }
+const BoundingVolumeTreeStats &BoundingVolumeTree::getStats() const { return stats; }
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// AVX tests eight boxes per instruction, SSE four. x64 always has SSE, other
+// targets without it fall back to the scalar loop
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULLER_LANES 8
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLER_LANES 4
+#else
+#define FRUSTUM_CULLER_LANES 1
+#endif
+
+#define FRUSTUM_ALL_PLANES 0x3f
+
+// Planes face inwards: a point p is inside when dot(plane.xyz, p) + plane.w >= 0
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+struct CullingStats
+{
+	GLuint visible, culled;
+};
+
+// Gribb-Hartmann: each clip plane is the sum or difference of the last row of
+// the matrix and one of the others. Works for perspective and ortho alike
+Frustum extractFrustum(const glm::mat4 &view_projection)
+{
+	Frustum frustum;
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+	for (int i = 0; i < 3; ++i)
+	{
+		frustum.planes[i * 2] = rows[3] + rows[i];
+		frustum.planes[i * 2 + 1] = rows[3] - rows[i];
+	}
+	for (int i = 0; i < 6; ++i)
+		frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+	return frustum;
+}
+// Tests only the planes set in plane_mask and clears the ones the box is
+// completely inside of, so boxes nested in it can skip them
+bool intersectsFrustum(const Frustum &frustum, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, GLuint &plane_mask)
+{
+	glm::vec3 center = (bounds_min + bounds_max) * 0.5f, extent = (bounds_max - bounds_min) * 0.5f;
+	for (int i = 0; i < 6; ++i)
+		if (plane_mask & 1 << i)
+		{
+			const glm::vec4 &plane = frustum.planes[i];
+			GLfloat distance = glm::dot(glm::vec3(plane), center) + plane.w;
+			GLfloat radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+			if (distance + radius < 0.0f)
+				return false;
+			if (distance - radius >= 0.0f)
+				plane_mask &= ~(1u << i);
+		}
+	return true;
+}
+
+// Tests world space bounding boxes against a frustum in batches. Boxes are kept
+// as center and half extent with one array per component, so a plane is checked
+// against a whole register of boxes: the box is outside when its center lies
+// further behind the plane than the extent projected on the plane normal
+class FrustumCuller
+{
+	std::vector <GLfloat> center_x, center_y, center_z, extent_x, extent_y, extent_z;
+	std::vector <GLubyte> visible;
+	GLuint count;
+	CullingStats stats;
+	void resize(size_t size);
+	void cullScalar(const Frustum &frustum, GLuint first);
+public:
+	FrustumCuller();
+	void clear();
+	GLuint add(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, const glm::mat4 &transform);
+	void cull(const Frustum &frustum);
+	bool isVisible(GLuint box) const;
+	GLuint getCount() const;
+	const CullingStats &getStats() const;
+};
+
+FrustumCuller::FrustumCuller() : count(0), stats() {}
+void FrustumCuller::resize(size_t size)
+{
+	center_x.resize(size);
+	center_y.resize(size);
+	center_z.resize(size);
+	extent_x.resize(size);
+	extent_y.resize(size);
+	extent_z.resize(size);
+}
+void FrustumCuller::clear() { count = 0; }
+// The transformed box is the smallest world space box around the rotated one:
+// its half extent is the local one multiplied by the absolute matrix
+GLuint FrustumCuller::add(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, const glm::mat4 &transform)
+{
+	if (count == center_x.size())
+		resize(count ? count * 2 : 64);
+	glm::vec3 center = glm::vec3(transform * glm::vec4((bounds_min + bounds_max) * 0.5f, 1.0f));
+	glm::vec3 extent = (bounds_max - bounds_min) * 0.5f;
+	glm::mat3 absolute(transform);
+	for (int i = 0; i < 3; ++i)
+		absolute[i] = glm::abs(absolute[i]);
+	extent = absolute * extent;
+
+	center_x[count] = center.x;
+	center_y[count] = center.y;
+	center_z[count] = center.z;
+	extent_x[count] = extent.x;
+	extent_y[count] = extent.y;
+	extent_z[count] = extent.z;
+	return count++;
+}
+void FrustumCuller::cullScalar(const Frustum &frustum, GLuint first)
+{
+	for (GLuint i = first; i < count; ++i)
+	{
+		bool outside = false;
+		for (int j = 0; j < 6 && !outside; ++j)
+		{
+			const glm::vec4 &plane = frustum.planes[j];
+			GLfloat distance = plane.x * center_x[i] + plane.y * center_y[i] + plane.z * center_z[i] + plane.w;
+			GLfloat radius = fabs(plane.x) * extent_x[i] + fabs(plane.y) * extent_y[i] + fabs(plane.z) * extent_z[i];
+			outside = distance + radius < 0.0f;
+		}
+		visible[i] = !outside;
+	}
+}
+void FrustumCuller::cull(const Frustum &frustum)
+{
+	visible.resize(count);
+	GLuint simd_count = count / FRUSTUM_CULLER_LANES * FRUSTUM_CULLER_LANES;
+#if FRUSTUM_CULLER_LANES == 8
+	for (GLuint i = 0; i < simd_count; i += 8)
+	{
+		__m256 cx = _mm256_loadu_ps(&center_x[i]), cy = _mm256_loadu_ps(&center_y[i]), cz = _mm256_loadu_ps(&center_z[i]);
+		__m256 ex = _mm256_loadu_ps(&extent_x[i]), ey = _mm256_loadu_ps(&extent_y[i]), ez = _mm256_loadu_ps(&extent_z[i]);
+		__m256 outside = _mm256_setzero_ps();
+		for (int j = 0; j < 6; ++j)
+		{
+			const glm::vec4 &plane = frustum.planes[j];
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, _mm256_set1_ps(plane.x)), _mm256_mul_ps(cy, _mm256_set1_ps(plane.y))),
+				_mm256_add_ps(_mm256_mul_ps(cz, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, _mm256_set1_ps(fabs(plane.x))), _mm256_mul_ps(ey, _mm256_set1_ps(fabs(plane.y)))),
+				_mm256_mul_ps(ez, _mm256_set1_ps(fabs(plane.z))));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_LT_OQ));
+		}
+		int mask = _mm256_movemask_ps(outside);
+		for (int lane = 0; lane < 8; ++lane)
+			visible[i + lane] = !(mask >> lane & 1);
+	}
+#elif FRUSTUM_CULLER_LANES == 4
+	for (GLuint i = 0; i < simd_count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&center_x[i]), cy = _mm_loadu_ps(&center_y[i]), cz = _mm_loadu_ps(&center_z[i]);
+		__m128 ex = _mm_loadu_ps(&extent_x[i]), ey = _mm_loadu_ps(&extent_y[i]), ez = _mm_loadu_ps(&extent_z[i]);
+		__m128 outside = _mm_setzero_ps();
+		for (int j = 0; j < 6; ++j)
+		{
+			const glm::vec4 &plane = frustum.planes[j];
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(fabs(plane.x))), _mm_mul_ps(ey, _mm_set1_ps(fabs(plane.y)))),
+				_mm_mul_ps(ez, _mm_set1_ps(fabs(plane.z))));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int lane = 0; lane < 4; ++lane)
+			visible[i + lane] = !(mask >> lane & 1);
+	}
+#endif
+	cullScalar(frustum, simd_count);
+
+	stats = CullingStats();
+	for (GLuint i = 0; i < count; ++i)
+		++(visible[i] ? stats.visible : stats.culled);
+}
+bool FrustumCuller::isVisible(GLuint box) const { return box < visible.size() && visible[box]; }
+GLuint FrustumCuller::getCount() const { return count; }
+const CullingStats &FrustumCuller::getStats() const { return stats; }
+
+// Culls the transforms of one instanced model, the visible ones keep their order
+CullingStats cullInstances(FrustumCuller &culler, const Frustum &frustum, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max,
+	const std::vector <glm::mat4> &transforms, std::vector <glm::mat4> &visible_transforms)
+{
+	culler.clear();
+	for (size_t i = 0; i < transforms.size(); ++i)
+		culler.add(bounds_min, bounds_max, transforms[i]);
+	culler.cull(frustum);
+	visible_transforms.clear();
+	for (GLuint i = 0; i < culler.getCount(); ++i)
+		if (culler.isVisible(i))
+			visible_transforms.push_back(transforms[i]);
+	return culler.getStats();
+}
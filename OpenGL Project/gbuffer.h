@@ -0,0 +1,108 @@
+#pragma once
+
+#include <iostream>
+#include <glad/glad.h>
+#include "gl_state.h"
+
+#define GBUFFER_TEXTURE_UNIT 20		// targets on 20-22, depth on 23
+
+enum GBufferTarget
+{
+	GBUFFER_ALBEDO_SPECULAR,	// RGBA8, specular strength in alpha
+	GBUFFER_NORMAL,				// RG16, octahedral view space normal
+	GBUFFER_EMISSION,			// R11F_G11F_B10F
+	GBUFFER_TARGET_COUNT
+};
+
+// Render targets of the deferred path, 12 bytes of color and 4 of depth per
+// pixel. There is no position target: the lighting pass rebuilds the view space
+// position from depth and the inverse projection
+class GBuffer
+{
+	GLuint framebuffer, targets[GBUFFER_TARGET_COUNT], depth, vertex_array;
+	GLuint width, height;
+public:
+	GBuffer(GLuint width, GLuint height);
+	GBuffer(const GBuffer &) = delete;
+	GBuffer &operator=(const GBuffer &) = delete;
+	void bind();
+	void bindTextures();
+	void drawFullscreen();
+	void copyDepth(GLuint target);
+	void printStats() const;
+	void release();
+};
+
+GBuffer::GBuffer(GLuint width, GLuint height) : width(width), height(height)
+{
+	GLenum internal_formats[GBUFFER_TARGET_COUNT] = { GL_RGBA8, GL_RG16, GL_R11F_G11F_B10F };
+	GLenum formats[GBUFFER_TARGET_COUNT] = { GL_RGBA, GL_RG, GL_RGB };
+	glGenFramebuffers(1, &framebuffer);
+	glGenTextures(GBUFFER_TARGET_COUNT, targets);
+	glGenTextures(1, &depth);
+	GLState::instance().bindFramebuffer(framebuffer);
+	for (int i = 0; i < GBUFFER_TARGET_COUNT; ++i)
+	{
+		GLState::instance().bindTexture(GL_TEXTURE_2D, targets[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[i], width, height, 0, formats[i], GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, targets[i], 0);
+	}
+	// Same format as the default depth buffer, copyDepth() blits between them
+	GLState::instance().bindTexture(GL_TEXTURE_2D, depth);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+
+	GLenum draw_buffers[GBUFFER_TARGET_COUNT] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+	glDrawBuffers(GBUFFER_TARGET_COUNT, draw_buffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "G-buffer is incomplete\n";
+	GLState::instance().bindFramebuffer(0);
+
+	// The full screen triangle has no attributes, but core profile draws need a vertex array
+	glGenVertexArrays(1, &vertex_array);
+}
+void GBuffer::bind()
+{
+	GLState::instance().bindFramebuffer(framebuffer);
+	glViewport(0, 0, width, height);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+void GBuffer::bindTextures()
+{
+	for (int i = 0; i < GBUFFER_TARGET_COUNT; ++i)
+		GLState::instance().bindTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + i, GL_TEXTURE_2D, targets[i]);
+	GLState::instance().bindTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + GBUFFER_TARGET_COUNT, GL_TEXTURE_2D, depth);
+}
+void GBuffer::drawFullscreen()
+{
+	GLState::instance().bindVertexArray(vertex_array);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+// Gives the passes after lighting the scene's depth. The target must not be
+// multisampled, blits can't change the sample count
+void GBuffer::copyDepth(GLuint target)
+{
+	GLState::instance().bindFramebuffer(target);
+	GLState::instance().bindReadFramebuffer(framebuffer);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+}
+void GBuffer::printStats() const
+{
+	std::cout << "G-buffer: " << width << "x" << height << ", 16 bytes per pixel, " << width * height * 16 / 1024 << " KB\n";
+}
+void GBuffer::release()
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	GLState::instance().forgetFramebuffer(framebuffer);
+	glDeleteTextures(GBUFFER_TARGET_COUNT, targets);
+	glDeleteTextures(1, &depth);
+	for (int i = 0; i < GBUFFER_TARGET_COUNT; ++i)
+		GLState::instance().forgetTexture(targets[i]);
+	GLState::instance().forgetTexture(depth);
+	glDeleteVertexArrays(1, &vertex_array);
+	GLState::instance().forgetVertexArray(vertex_array);
+}
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <iostream>
+#include <glad/glad.h>
+#include "vertex_format.h"
+#include "gl_state.h"
+
+#define ARENA_MIN_VERTEX_CAPACITY (1 << 16)
+#define ARENA_MIN_INDEX_CAPACITY (1 << 20)
+
+// First-fit allocator over [0, capacity), free ranges are kept coalesced
+class RangeAllocator
+{
+	std::map <GLuint, GLuint> free_ranges;
+	GLuint capacity;
+public:
+	RangeAllocator();
+	bool allocate(GLuint size, GLuint &offset);
+	void free(GLuint offset, GLuint size);
+	void grow(GLuint new_capacity);
+	void reset(GLuint used, GLuint new_capacity);
+	GLuint getCapacity() const;
+	GLuint getFreeSize() const;
+	GLuint getLargestFree() const;
+	GLuint getFreeRangeCount() const;
+};
+
+RangeAllocator::RangeAllocator() : capacity(0) {}
+bool RangeAllocator::allocate(GLuint size, GLuint &offset)
+{
+	for (std::map <GLuint, GLuint>::iterator it = free_ranges.begin(); it != free_ranges.end(); ++it)
+	{
+		if (it->second < size)
+			continue;
+		offset = it->first;
+		GLuint remaining = it->second - size;
+		free_ranges.erase(it);
+		if (remaining)
+			free_ranges[offset + size] = remaining;
+		return true;
+	}
+	return false;
+}
+void RangeAllocator::free(GLuint offset, GLuint size)
+{
+	if (size == 0)
+		return;
+	std::map <GLuint, GLuint>::iterator next = free_ranges.lower_bound(offset);
+	if (next != free_ranges.begin())
+	{
+		std::map <GLuint, GLuint>::iterator previous = std::prev(next);
+		if (previous->first + previous->second == offset)
+		{
+			offset = previous->first;
+			size += previous->second;
+			free_ranges.erase(previous);
+		}
+	}
+	if (next != free_ranges.end() && offset + size == next->first)
+	{
+		size += next->second;
+		free_ranges.erase(next);
+	}
+	free_ranges[offset] = size;
+}
+void RangeAllocator::grow(GLuint new_capacity)
+{
+	GLuint old_capacity = capacity;
+	capacity = new_capacity;
+	free(old_capacity, new_capacity - old_capacity);
+}
+void RangeAllocator::reset(GLuint used, GLuint new_capacity)
+{
+	capacity = new_capacity;
+	free_ranges.clear();
+	if (used < capacity)
+		free_ranges[used] = capacity - used;
+}
+GLuint RangeAllocator::getCapacity() const { return capacity; }
+GLuint RangeAllocator::getFreeSize() const
+{
+	GLuint size = 0;
+	for (std::map <GLuint, GLuint>::const_iterator it = free_ranges.begin(); it != free_ranges.end(); ++it)
+		size += it->second;
+	return size;
+}
+GLuint RangeAllocator::getLargestFree() const
+{
+	GLuint size = 0;
+	for (std::map <GLuint, GLuint>::const_iterator it = free_ranges.begin(); it != free_ranges.end(); ++it)
+		size = std::max(size, it->second);
+	return size;
+}
+GLuint RangeAllocator::getFreeRangeCount() const { return (GLuint)free_ranges.size(); }
+
+
+struct GeometryAllocation
+{
+	VertexFormat format;
+	GLuint vertex_offset, vertex_count;
+	GLuint index_offset, index_count;
+	bool live;
+};
+
+struct GeometryArenaStats
+{
+	size_t vertex_capacity, vertex_used;	// bytes, all formats
+	size_t index_capacity, index_used;		// bytes
+	GLuint allocations;
+	GLuint free_ranges;
+	GLuint draws, instances;				// since the last printStats()
+};
+
+// All mesh geometry lives in one vertex buffer per vertex format and one shared
+// index buffer. Meshes hold a handle, draws use base vertex so moving a mesh
+// never touches its indexes, and consecutive draws of one format share a VAO
+class GeometryArena
+{
+	struct VertexPool
+	{
+		GLuint vertex_array, buffer;
+		GLuint instance_buffer;		// attached to attributes 5-8 of the VAO
+		RangeAllocator ranges;
+	};
+	VertexPool pools[VERTEX_FORMAT_COUNT];
+	GLuint index_buffer;
+	RangeAllocator index_ranges;
+	std::vector <GeometryAllocation> allocations;
+	std::vector <GLuint> free_handles;
+	GLuint draws, instances;
+	GeometryArena();
+	static GLuint replaceBuffer(GLuint old_buffer, GLsizeiptr size, const std::vector <GLintptr> &from, const std::vector <GLintptr> &to, const std::vector <GLsizeiptr> &sizes);
+	void attachBuffers(VertexFormat format);
+	void growVertices(VertexFormat format, GLuint min_capacity);
+	void growIndexes(GLuint min_capacity);
+	void defragmentVertices(VertexFormat format);
+	void defragmentIndexes();
+public:
+	static GeometryArena &instance();
+	GLuint allocate(VertexFormat format, const void *vertices, GLuint vertex_count, const GLuint *indexes, GLuint index_count);
+	void free(GLuint handle);
+	void bind(VertexFormat format);
+	void draw(GLuint handle, GLuint first_index, GLuint index_count);
+	void drawInstanced(GLuint handle, GLuint first_index, GLuint index_count, GLuint instance_buffer, GLuint instance_count);
+	void forgetInstanceBuffer(GLuint instance_buffer);
+	void defragment();
+	const GeometryAllocation &getAllocation(GLuint handle) const;
+	GLuint getVertexBuffer(VertexFormat format) const;
+	GLuint getIndexBuffer() const;
+	GeometryArenaStats getStats() const;
+	void printStats();
+	void release();
+};
+
+GeometryArena::GeometryArena() : index_buffer(0), draws(0), instances(0)
+{
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		pools[i].vertex_array = pools[i].buffer = pools[i].instance_buffer = 0;
+}
+GeometryArena &GeometryArena::instance()
+{
+	static GeometryArena arena;
+	return arena;
+}
+GLuint GeometryArena::replaceBuffer(GLuint old_buffer, GLsizeiptr size, const std::vector <GLintptr> &from, const std::vector <GLintptr> &to, const std::vector <GLsizeiptr> &sizes)
+{
+	// Copy targets keep the bound VAO's element buffer untouched
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	if (old_buffer)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, old_buffer);
+		for (size_t i = 0; i < sizes.size(); ++i)
+			if (sizes[i])
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, from[i], to[i], sizes[i]);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &old_buffer);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	return buffer;
+}
+void GeometryArena::attachBuffers(VertexFormat format)
+{
+	VertexPool &pool = pools[format];
+	if (!pool.vertex_array)
+		glGenVertexArrays(1, &pool.vertex_array);
+	GLState::instance().bindVertexArray(pool.vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, pool.buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	setVertexAttributes(format);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+void GeometryArena::growVertices(VertexFormat format, GLuint min_capacity)
+{
+	VertexPool &pool = pools[format];
+	GLuint stride = getVertexStride(format), old_capacity = pool.ranges.getCapacity();
+	GLuint capacity = std::max(std::max(old_capacity * 2, min_capacity), (GLuint)ARENA_MIN_VERTEX_CAPACITY);
+	pool.buffer = replaceBuffer(pool.buffer, (GLsizeiptr)capacity * stride, { 0 }, { 0 }, { (GLsizeiptr)old_capacity * (GLsizeiptr)stride });
+	pool.ranges.grow(capacity);
+	attachBuffers(format);
+}
+void GeometryArena::growIndexes(GLuint min_capacity)
+{
+	GLuint old_capacity = index_ranges.getCapacity();
+	GLuint capacity = std::max(std::max(old_capacity * 2, min_capacity), (GLuint)ARENA_MIN_INDEX_CAPACITY);
+	index_buffer = replaceBuffer(index_buffer, (GLsizeiptr)capacity * sizeof(GLuint), { 0 }, { 0 }, { (GLsizeiptr)(old_capacity * sizeof(GLuint)) });
+	index_ranges.grow(capacity);
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		if (pools[i].vertex_array)
+			attachBuffers((VertexFormat)i);
+}
+void GeometryArena::defragmentVertices(VertexFormat format)
+{
+	VertexPool &pool = pools[format];
+	if (!pool.buffer)
+		return;
+	std::vector <GeometryAllocation *> live;
+	for (size_t i = 0; i < allocations.size(); ++i)
+		if (allocations[i].live && allocations[i].format == format)
+			live.push_back(&allocations[i]);
+	std::sort(live.begin(), live.end(), [](const GeometryAllocation *a, const GeometryAllocation *b) { return a->vertex_offset < b->vertex_offset; });
+
+	GLuint stride = getVertexStride(format), used = 0;
+	std::vector <GLintptr> from, to;
+	std::vector <GLsizeiptr> sizes;
+	for (size_t i = 0; i < live.size(); ++i)
+	{
+		from.push_back((GLintptr)live[i]->vertex_offset * stride);
+		to.push_back((GLintptr)used * stride);
+		sizes.push_back((GLsizeiptr)live[i]->vertex_count * stride);
+		live[i]->vertex_offset = used;
+		used += live[i]->vertex_count;
+	}
+	pool.buffer = replaceBuffer(pool.buffer, (GLsizeiptr)pool.ranges.getCapacity() * stride, from, to, sizes);
+	pool.ranges.reset(used, pool.ranges.getCapacity());
+	attachBuffers(format);
+}
+void GeometryArena::defragmentIndexes()
+{
+	if (!index_buffer)
+		return;
+	std::vector <GeometryAllocation *> live;
+	for (size_t i = 0; i < allocations.size(); ++i)
+		if (allocations[i].live)
+			live.push_back(&allocations[i]);
+	std::sort(live.begin(), live.end(), [](const GeometryAllocation *a, const GeometryAllocation *b) { return a->index_offset < b->index_offset; });
+
+	GLuint used = 0;
+	std::vector <GLintptr> from, to;
+	std::vector <GLsizeiptr> sizes;
+	for (size_t i = 0; i < live.size(); ++i)
+	{
+		from.push_back((GLintptr)live[i]->index_offset * sizeof(GLuint));
+		to.push_back((GLintptr)used * sizeof(GLuint));
+		sizes.push_back((GLsizeiptr)live[i]->index_count * sizeof(GLuint));
+		live[i]->index_offset = used;
+		used += live[i]->index_count;
+	}
+	index_buffer = replaceBuffer(index_buffer, (GLsizeiptr)index_ranges.getCapacity() * sizeof(GLuint), from, to, sizes);
+	index_ranges.reset(used, index_ranges.getCapacity());
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		if (pools[i].vertex_array)
+			attachBuffers((VertexFormat)i);
+}
+GLuint GeometryArena::allocate(VertexFormat format, const void *vertices, GLuint vertex_count, const GLuint *indexes, GLuint index_count)
+{
+	GeometryAllocation allocation = { format, 0, vertex_count, 0, index_count, true };
+	VertexPool &pool = pools[format];
+
+	// Compacting is cheaper than growing when the free space is there but scattered
+	if (!pool.ranges.allocate(vertex_count, allocation.vertex_offset))
+	{
+		if (pool.ranges.getFreeSize() >= vertex_count)
+			defragmentVertices(format);
+		if (!pool.ranges.allocate(vertex_count, allocation.vertex_offset))
+		{
+			growVertices(format, pool.ranges.getCapacity() + vertex_count);
+			pool.ranges.allocate(vertex_count, allocation.vertex_offset);
+		}
+	}
+	if (!index_ranges.allocate(index_count, allocation.index_offset))
+	{
+		if (index_ranges.getFreeSize() >= index_count)
+			defragmentIndexes();
+		if (!index_ranges.allocate(index_count, allocation.index_offset))
+		{
+			growIndexes(index_ranges.getCapacity() + index_count);
+			index_ranges.allocate(index_count, allocation.index_offset);
+		}
+	}
+
+	GLuint stride = getVertexStride(format);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, pool.buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)allocation.vertex_offset * stride, (GLsizeiptr)vertex_count * stride, vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, index_buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)allocation.index_offset * sizeof(GLuint), (GLsizeiptr)index_count * sizeof(GLuint), indexes);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	GLuint handle;
+	if (!free_handles.empty())
+	{
+		handle = free_handles.back();
+		free_handles.pop_back();
+		allocations[handle] = allocation;
+	}
+	else
+	{
+		handle = (GLuint)allocations.size();
+		allocations.push_back(allocation);
+	}
+	return handle;
+}
+void GeometryArena::free(GLuint handle)
+{
+	// Bookkeeping only, safe after the context is gone
+	if (handle >= allocations.size() || !allocations[handle].live)
+		return;
+	GeometryAllocation &allocation = allocations[handle];
+	pools[allocation.format].ranges.free(allocation.vertex_offset, allocation.vertex_count);
+	index_ranges.free(allocation.index_offset, allocation.index_count);
+	allocation.live = false;
+	free_handles.push_back(handle);
+}
+void GeometryArena::bind(VertexFormat format)
+{
+	GLState::instance().bindVertexArray(pools[format].vertex_array);
+}
+void GeometryArena::draw(GLuint handle, GLuint first_index, GLuint index_count)
+{
+	const GeometryAllocation &allocation = allocations[handle];
+	bind(allocation.format);
+	glDrawElementsBaseVertex(GL_TRIANGLES, index_count, GL_UNSIGNED_INT,
+		(void*)((size_t)(allocation.index_offset + first_index) * sizeof(GLuint)), allocation.vertex_offset);
+	++draws;
+}
+// Without base instance in GL 3.3 the instance attributes always start at the
+// beginning of the buffer, they are only re-pointed when the buffer changes
+void GeometryArena::drawInstanced(GLuint handle, GLuint first_index, GLuint index_count, GLuint instance_buffer, GLuint instance_count)
+{
+	const GeometryAllocation &allocation = allocations[handle];
+	VertexPool &pool = pools[allocation.format];
+	bind(allocation.format);
+	if (pool.instance_buffer != instance_buffer)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		setInstanceAttributes();
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		pool.instance_buffer = instance_buffer;
+	}
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, index_count, GL_UNSIGNED_INT,
+		(void*)((size_t)(allocation.index_offset + first_index) * sizeof(GLuint)), instance_count, allocation.vertex_offset);
+	++draws;
+	instances += instance_count;
+}
+// A deleted buffer stays attached to the VAOs, its name may come back for another one
+void GeometryArena::forgetInstanceBuffer(GLuint instance_buffer)
+{
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		if (pools[i].instance_buffer == instance_buffer)
+			pools[i].instance_buffer = 0;
+}
+void GeometryArena::defragment()
+{
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		defragmentVertices((VertexFormat)i);
+	defragmentIndexes();
+}
+// Buffers are replaced when they grow or get compacted, offsets and names are only valid until the next allocate()
+const GeometryAllocation &GeometryArena::getAllocation(GLuint handle) const { return allocations[handle]; }
+GLuint GeometryArena::getVertexBuffer(VertexFormat format) const { return pools[format].buffer; }
+GLuint GeometryArena::getIndexBuffer() const { return index_buffer; }
+GeometryArenaStats GeometryArena::getStats() const
+{
+	GeometryArenaStats stats = {};
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+	{
+		GLuint stride = getVertexStride((VertexFormat)i);
+		stats.vertex_capacity += (size_t)pools[i].ranges.getCapacity() * stride;
+		stats.vertex_used += (size_t)(pools[i].ranges.getCapacity() - pools[i].ranges.getFreeSize()) * stride;
+		stats.free_ranges += pools[i].ranges.getFreeRangeCount();
+	}
+	stats.index_capacity = (size_t)index_ranges.getCapacity() * sizeof(GLuint);
+	stats.index_used = (size_t)(index_ranges.getCapacity() - index_ranges.getFreeSize()) * sizeof(GLuint);
+	stats.free_ranges += index_ranges.getFreeRangeCount();
+	stats.allocations = (GLuint)(allocations.size() - free_handles.size());
+	stats.draws = draws;
+	stats.instances = instances;
+	return stats;
+}
+void GeometryArena::printStats()
+{
+	GeometryArenaStats stats = getStats();
+	std::cout << "Geometry arena: " << stats.allocations << " meshes, vertices " << stats.vertex_used / 1024 << "/" << stats.vertex_capacity / 1024
+		<< " KB, indexes " << stats.index_used / 1024 << "/" << stats.index_capacity / 1024 << " KB, " << stats.free_ranges << " free ranges, "
+		<< stats.draws << " draws, " << stats.instances << " instances\n";
+	draws = instances = 0;
+}
+void GeometryArena::release()
+{
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+	{
+		glDeleteVertexArrays(1, &pools[i].vertex_array);
+		GLState::instance().forgetVertexArray(pools[i].vertex_array);
+		glDeleteBuffers(1, &pools[i].buffer);
+		pools[i].vertex_array = pools[i].buffer = pools[i].instance_buffer = 0;
+		pools[i].ranges.reset(0, 0);
+	}
+	glDeleteBuffers(1, &index_buffer);
+	index_buffer = 0;
+	index_ranges.reset(0, 0);
+	allocations.clear();
+	free_handles.clear();
+}
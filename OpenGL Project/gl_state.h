@@ -0,0 +1,232 @@
+#pragma once
+
+#include <iostream>
+#include <glad/glad.h>
+
+#define GL_STATE_TEXTURE_UNITS 32
+
+enum GLStateCall
+{
+	GL_STATE_PROGRAM,
+	GL_STATE_VERTEX_ARRAY,
+	GL_STATE_ACTIVE_TEXTURE,
+	GL_STATE_TEXTURE,
+	GL_STATE_CULL_FACE,
+	GL_STATE_DEPTH_FUNC,
+	GL_STATE_FRAMEBUFFER,
+	GL_STATE_READ_FRAMEBUFFER,
+	GL_STATE_CALL_COUNT
+};
+
+struct GLStateCounters
+{
+	GLuint issued[GL_STATE_CALL_COUNT];
+	GLuint skipped[GL_STATE_CALL_COUNT];
+};
+
+// Shadow copy of the binding state the renderer changes every frame. Calls that
+// would set what is already current are dropped. Everything that binds these
+// objects has to go through here, or the copy goes stale and a needed call is
+// skipped; invalidate() resets it after foreign code touched the context
+class GLState
+{
+	// Texture units track each target separately, as GL does
+	enum TextureTarget { TARGET_2D, TARGET_CUBE_MAP, TARGET_2D_ARRAY, TARGET_BUFFER, TARGET_COUNT };
+	GLuint program, vertex_array, draw_framebuffer, read_framebuffer;
+	GLenum active_texture, cull_face, depth_func;
+	GLuint textures[GL_STATE_TEXTURE_UNITS][TARGET_COUNT];
+	GLStateCounters counters, frame_counters;
+	GLState();
+	static int getTargetIndex(GLenum target);
+	bool change(GLStateCall call, bool changed);
+public:
+	static GLState &instance();
+	static const char *getCallName(GLStateCall call);
+	void useProgram(GLuint id);
+	void bindVertexArray(GLuint id);
+	void activeTexture(GLenum unit);
+	void bindTexture(GLenum target, GLuint id);
+	void bindTexture(GLenum unit, GLenum target, GLuint id);
+	void cullFace(GLenum face);
+	void depthFunc(GLenum func);
+	void bindFramebuffer(GLuint id);
+	void bindReadFramebuffer(GLuint id);
+	void forgetTexture(GLuint id);
+	void forgetVertexArray(GLuint id);
+	void forgetFramebuffer(GLuint id);
+	void invalidate();
+	void endFrame();
+	const GLStateCounters &getFrameCounters() const;
+	void printStats() const;
+};
+
+GLState::GLState() : counters(), frame_counters() { invalidate(); }
+GLState &GLState::instance()
+{
+	static GLState state;
+	return state;
+}
+const char *GLState::getCallName(GLStateCall call)
+{
+	switch (call)
+	{
+	case GL_STATE_PROGRAM: return "program";
+	case GL_STATE_VERTEX_ARRAY: return "vertex array";
+	case GL_STATE_ACTIVE_TEXTURE: return "active texture";
+	case GL_STATE_TEXTURE: return "texture";
+	case GL_STATE_CULL_FACE: return "cull face";
+	case GL_STATE_DEPTH_FUNC: return "depth func";
+	case GL_STATE_FRAMEBUFFER: return "framebuffer";
+	default: return "read framebuffer";
+	}
+}
+int GLState::getTargetIndex(GLenum target)
+{
+	switch (target)
+	{
+	case GL_TEXTURE_2D: return TARGET_2D;
+	case GL_TEXTURE_CUBE_MAP: return TARGET_CUBE_MAP;
+	case GL_TEXTURE_2D_ARRAY: return TARGET_2D_ARRAY;
+	case GL_TEXTURE_BUFFER: return TARGET_BUFFER;
+	default: return -1;
+	}
+}
+bool GLState::change(GLStateCall call, bool changed)
+{
+	if (changed)
+		++counters.issued[call];
+	else
+		++counters.skipped[call];
+	return changed;
+}
+void GLState::useProgram(GLuint id)
+{
+	if (change(GL_STATE_PROGRAM, program != id))
+	{
+		glUseProgram(id);
+		program = id;
+	}
+}
+void GLState::bindVertexArray(GLuint id)
+{
+	if (change(GL_STATE_VERTEX_ARRAY, vertex_array != id))
+	{
+		glBindVertexArray(id);
+		vertex_array = id;
+	}
+}
+void GLState::activeTexture(GLenum unit)
+{
+	if (change(GL_STATE_ACTIVE_TEXTURE, active_texture != unit))
+	{
+		glActiveTexture(unit);
+		active_texture = unit;
+	}
+}
+// Binds to the active unit, used when a texture is bound for uploading
+void GLState::bindTexture(GLenum target, GLuint id)
+{
+	GLuint unit = active_texture - GL_TEXTURE0;
+	int index = getTargetIndex(target);
+	if (unit >= GL_STATE_TEXTURE_UNITS || index < 0)
+	{
+		change(GL_STATE_TEXTURE, true);
+		glBindTexture(target, id);
+		return;
+	}
+	if (change(GL_STATE_TEXTURE, textures[unit][index] != id))
+	{
+		glBindTexture(target, id);
+		textures[unit][index] = id;
+	}
+}
+// Only switches the active unit when the binding actually changes
+void GLState::bindTexture(GLenum unit, GLenum target, GLuint id)
+{
+	GLuint unit_index = unit - GL_TEXTURE0;
+	int index = getTargetIndex(target);
+	if (unit_index < GL_STATE_TEXTURE_UNITS && index >= 0 && textures[unit_index][index] == id)
+	{
+		change(GL_STATE_TEXTURE, false);
+		return;
+	}
+	activeTexture(unit);
+	bindTexture(target, id);
+}
+void GLState::cullFace(GLenum face)
+{
+	if (change(GL_STATE_CULL_FACE, cull_face != face))
+	{
+		glCullFace(face);
+		cull_face = face;
+	}
+}
+void GLState::depthFunc(GLenum func)
+{
+	if (change(GL_STATE_DEPTH_FUNC, depth_func != func))
+	{
+		glDepthFunc(func);
+		depth_func = func;
+	}
+}
+// Binds for drawing and reading, so a read binding left by a blit is replaced too
+void GLState::bindFramebuffer(GLuint id)
+{
+	if (change(GL_STATE_FRAMEBUFFER, draw_framebuffer != id || read_framebuffer != id))
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, id);
+		draw_framebuffer = read_framebuffer = id;
+	}
+}
+// Source of a blit, the draw binding stays
+void GLState::bindReadFramebuffer(GLuint id)
+{
+	if (change(GL_STATE_READ_FRAMEBUFFER, read_framebuffer != id))
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, id);
+		read_framebuffer = id;
+	}
+}
+// Deleting an object unbinds it and frees its name for reuse, so a new object
+// with the same id must not look bound already
+void GLState::forgetTexture(GLuint id)
+{
+	for (int i = 0; i < GL_STATE_TEXTURE_UNITS; ++i)
+		for (int j = 0; j < TARGET_COUNT; ++j)
+			if (textures[i][j] == id)
+				textures[i][j] = 0;
+}
+void GLState::forgetVertexArray(GLuint id)
+{
+	if (vertex_array == id)
+		vertex_array = 0;
+}
+void GLState::forgetFramebuffer(GLuint id)
+{
+	if (draw_framebuffer == id)
+		draw_framebuffer = 0;
+	if (read_framebuffer == id)
+		read_framebuffer = 0;
+}
+void GLState::invalidate()
+{
+	// Values no call would set, so the next call of each kind is always issued
+	program = vertex_array = draw_framebuffer = read_framebuffer = (GLuint)-1;
+	active_texture = cull_face = depth_func = GL_NONE;
+	for (int i = 0; i < GL_STATE_TEXTURE_UNITS; ++i)
+		for (int j = 0; j < TARGET_COUNT; ++j)
+			textures[i][j] = (GLuint)-1;
+}
+void GLState::endFrame()
+{
+	frame_counters = counters;
+	counters = GLStateCounters();
+}
+const GLStateCounters &GLState::getFrameCounters() const { return frame_counters; }
+void GLState::printStats() const
+{
+	std::cout << "GL state, last frame (issued/skipped):";
+	for (int i = 0; i < GL_STATE_CALL_COUNT; ++i)
+		std::cout << (i ? ", " : " ") << getCallName((GLStateCall)i) << " " << frame_counters.issued[i] << "/" << frame_counters.skipped[i];
+	std::cout << "\n";
+}
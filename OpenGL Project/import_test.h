@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <glad/glad.h>
+#include "mesh_optimizer.h"
+#include "model.h"
+
+// The import passes reorder triangles but must never drop any. The first
+// triangle is degenerate, so it misses the vertex cache fewer than 3 times
+bool testImport(const std::string &path = "import_test.obj")
+{
+	bool passed = true;
+
+	// Overdraw pass alone, on the order exactly as given
+	std::vector <Vertex> vertices(4, Vertex());
+	vertices[1].position = glm::vec3(1.0f, 0.0f, 0.0f);
+	vertices[2].position = glm::vec3(0.0f, 1.0f, 0.0f);
+	vertices[3].position = glm::vec3(1.0f, 1.0f, 0.0f);
+	GLuint triangles[] = { 0, 0, 1, 0, 1, 2, 1, 3, 2 };
+	std::vector <GLuint> indexes(triangles, triangles + 9);
+	optimizeOverdraw(indexes, vertices);
+	if (indexes.size() != 9)
+	{
+		std::cout << "Import test: overdraw pass kept " << indexes.size() << " of 9 indexes" << std::endl;
+		passed = false;
+	}
+
+	// Same triangles through the importer, the optimizer and the mesh cache
+	{
+		std::ofstream source(path);
+		source << "v 0 0 0\nv 1 0 0\nv 0 1 0\nv 1 1 0\n"
+			"vt 0 0\nvt 1 0\nvt 0 1\nvt 1 1\n"
+			"f 1/1 1/1 2/2\nf 1/1 2/2 3/3\nf 2/2 4/4 3/3\n";
+	}
+	for (int i = 0; i < 2; ++i)
+	{
+		// Second round reads the cache written by the first
+		try
+		{
+			Model model(path);
+			if (model.getIndexCount() != 9)
+			{
+				std::cout << "Import test: " << (i ? "cached" : "imported") << " model has " << model.getIndexCount() << " of 9 indexes" << std::endl;
+				passed = false;
+			}
+		}
+		catch (...)
+		{
+			std::cout << "Import test: unable to load " << path << std::endl;
+			passed = false;
+		}
+	}
+	remove(path.c_str());
+	remove((path + ".meshcache").c_str());
+
+	std::cout << "Import test " << (passed ? "passed" : "failed") << std::endl;
+	return passed;
+}
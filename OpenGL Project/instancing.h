@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cfloat>
+#include <vector>
+#include <iostream>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "geometry_arena.h"
+#include "uniform_buffers.h"
+
+// Model matrices for one instanced draw, read through attributes 5-8
+class InstanceBuffer
+{
+	GLuint buffer;
+	GLuint count, capacity;
+public:
+	InstanceBuffer();
+	InstanceBuffer(const InstanceBuffer &) = delete;
+	InstanceBuffer &operator=(const InstanceBuffer &) = delete;
+	void update(const std::vector <glm::mat4> &transforms);
+	GLuint getBuffer() const;
+	GLuint getCount() const;
+	void release();
+};
+
+InstanceBuffer::InstanceBuffer() : count(0), capacity(0) { glGenBuffers(1, &buffer); }
+void InstanceBuffer::update(const std::vector <glm::mat4> &transforms)
+{
+	// Orphaned like the uniform buffers, the previous frame's draws keep their copy
+	count = (GLuint)transforms.size();
+	if (count > capacity)
+		capacity = count;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)capacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+	if (count)
+		glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr)count * sizeof(glm::mat4), transforms.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+GLuint InstanceBuffer::getBuffer() const { return buffer; }
+GLuint InstanceBuffer::getCount() const { return count; }
+void InstanceBuffer::release()
+{
+	GeometryArena::instance().forgetInstanceBuffer(buffer);
+	glDeleteBuffers(1, &buffer);
+	buffer = 0;
+	count = capacity = 0;
+}
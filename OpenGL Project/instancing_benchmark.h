@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "shader.h"
+#include "shader_permutations.h"
+#include "uniform_buffers.h"
+#include "instancing.h"
+#include "model.h"
+
+// Average CPU submission time and GPU time (GL_TIME_ELAPSED) of a draw callback, in ms
+void timeDraws(const std::function<void()> &draw, GLuint frames, double &cpu_time, double &gpu_time)
+{
+	GLuint query;
+	glGenQueries(1, &query);
+	draw();		// Warm-up, the first frame pays for shader and buffer setup
+	glFinish();
+
+	cpu_time = gpu_time = 0.0;
+	for (GLuint i = 0; i < frames; ++i)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		double start = glfwGetTime();
+		draw();
+		cpu_time += (glfwGetTime() - start) * 1000.0;
+		glEndQuery(GL_TIME_ELAPSED);
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+		gpu_time += elapsed / 1000000.0;
+	}
+	cpu_time /= frames;
+	gpu_time /= frames;
+	glDeleteQueries(1, &query);
+}
+
+// Draws a grid of copies of one model once per draw call and once instanced,
+// both at the coarsest level so the numbers show submission cost rather than
+// vertex throughput. Started with --benchmark-instancing
+void benchmarkInstancing(const std::string &path, GLuint count, GLuint frames = 20)
+{
+	Model model(path, false, VERTEX_FORMAT_QUANTIZED);
+	Shader shader("vertex_depth.vsh", "fragment_depth.fsh");
+	Shader instanced_shader("vertex_depth.vsh", "fragment_depth.fsh", getShaderDefines(SHADER_INSTANCED));
+
+	// The depth shaders only use the first shadow cascade, it serves as the camera here
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, 80.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(60.0f), 1.0f, 0.1f, 200.0f);
+	UniformBuffer shadow_buffer(SHADOW_UNIFORMS_BINDING, sizeof(ShadowUniforms));
+	ShadowUniforms shadows = {};
+	shadows.cascade_space[0] = shadows.view_to_cascade[0] = projection * view;
+	shadows.cascade_count = 1;
+	shadow_buffer.update(shadows);
+
+	std::vector <glm::mat4> transforms(count);
+	GLuint side = (GLuint)ceil(sqrt((double)count));
+	for (GLuint i = 0; i < count; ++i)
+	{
+		glm::vec3 position(((GLfloat)(i % side) / side - 0.5f) * 80.0f, ((GLfloat)(i / side) / side - 0.5f) * 80.0f, 0.0f);
+		transforms[i] = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.2f));
+	}
+	InstanceBuffer instances;
+	instances.update(transforms);
+	LodSelector coarsest = { glm::mat4(1.0f), view, projection, 1.0f, FLT_MAX };
+
+	double draw_cpu, draw_gpu, instanced_cpu, instanced_gpu;
+	GLuint draws = GeometryArena::instance().getStats().draws;
+	timeDraws([&]()
+	{
+		shader.use();
+		for (GLuint i = 0; i < count; ++i)
+		{
+			shader.setUniform("model"_uniform, transforms[i]);
+			model.render(shader, &coarsest);
+		}
+	}, frames, draw_cpu, draw_gpu);
+	GLuint per_draw_calls = (GeometryArena::instance().getStats().draws - draws) / (frames + 1);
+
+	draws = GeometryArena::instance().getStats().draws;
+	timeDraws([&]()
+	{
+		instanced_shader.use();
+		model.renderInstanced(instanced_shader, instances, UINT_MAX);
+	}, frames, instanced_cpu, instanced_gpu);
+	GLuint instanced_calls = (GeometryArena::instance().getStats().draws - draws) / (frames + 1);
+
+	std::cout << "Instancing benchmark: " << count << " copies of " << path << "\n"
+		<< "  per draw:  " << per_draw_calls << " draw calls, CPU " << draw_cpu << " ms, GPU " << draw_gpu << " ms\n"
+		<< "  instanced: " << instanced_calls << " draw calls, CPU " << instanced_cpu << " ms, GPU " << instanced_gpu << " ms\n";
+
+	instances.release();
+	shadow_buffer.release();
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cmath>
+#include <cfloat>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <condition_variable>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include "gl_state.h"
+#include "uniform_buffers.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LIGHT_CLUSTER_LANES 8
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define LIGHT_CLUSTER_LANES 4
+#else
+#define LIGHT_CLUSTER_LANES 1
+#endif
+
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define CLUSTER_LIGHT_THRESHOLD (1.0f / 256.0f)	// a light ends where it adds less than one step of an 8-bit channel
+#define CLUSTER_TEXTURE_UNIT 17						// grid, light indices and light data on 17-19
+
+struct LightClusterStats
+{
+	GLuint lights, references, max_cluster_lights;
+	double binning_time;		// ms
+};
+
+// Distance at which the attenuated light drops below the threshold
+GLfloat getLightRadius(const PointLightUniforms &light)
+{
+	glm::vec3 intensity = glm::max(light.ambient_intensity, glm::max(light.diffuse_intensity, light.specular_intensity));
+	GLfloat brightest = std::max(intensity.x, std::max(intensity.y, intensity.z));
+	GLfloat c = light.constant - brightest / CLUSTER_LIGHT_THRESHOLD;
+	if (c >= 0.0f)
+		return 0.0f;
+	if (light.quadratic > 0.0f)
+		return (-light.linear + sqrt(light.linear * light.linear - 4.0f * light.quadratic * c)) / (2.0f * light.quadratic);
+	if (light.linear > 0.0f)
+		return -c / light.linear;
+	return FLT_MAX;
+}
+
+// Clustered forward shading. The view frustum is cut into screen tiles and
+// exponential depth slices, each point light is listed in every cluster its
+// sphere of influence touches, and the fragment shader only loops over the list
+// of its own cluster. Depth slices are binned in parallel, the caller's thread
+// and a few persistent workers take them one by one; within a slice a cluster
+// box is tested against several light spheres per instruction. The results go
+// to the GPU through texture buffers
+class LightClusterGrid
+{
+	struct SliceBins
+	{
+		std::vector <GLuint> candidates;						// lights overlapping the slice's depth range
+		std::vector <GLfloat> x, y, z, radius;					// their view space spheres
+		std::vector <GLuint> indices;							// light lists of the slice's clusters back to back
+		GLuint offsets[CLUSTER_GRID_X * CLUSTER_GRID_Y], counts[CLUSTER_GRID_X * CLUSTER_GRID_Y];
+	};
+	// Cluster boxes in view space, computed when the projection changes
+	glm::vec3 cluster_min[CLUSTER_GRID_Z][CLUSTER_GRID_X * CLUSTER_GRID_Y], cluster_max[CLUSTER_GRID_Z][CLUSTER_GRID_X * CLUSTER_GRID_Y];
+	GLfloat slice_depths[CLUSTER_GRID_Z + 1];
+	glm::vec4 params;
+	std::vector <glm::vec4> view_lights;		// position and radius
+	SliceBins slices[CLUSTER_GRID_Z];
+
+	std::vector <GLuint> grid, indices;
+	std::vector <glm::vec4> light_data;
+	GLuint buffers[3], textures[3];
+	GLsizeiptr buffer_sizes[3];
+	LightClusterStats stats;
+
+	std::vector <std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start_condition, done_condition;
+	GLuint generation, busy_workers;
+	bool stopping;
+	std::atomic <GLint> next_slice;
+
+	void workerLoop();
+	void binSlices();
+	void binSlice(GLint slice);
+	void upload(GLuint buffer, GLenum format, const void *data, GLsizeiptr size);
+public:
+	LightClusterGrid();
+	LightClusterGrid(const LightClusterGrid &) = delete;
+	LightClusterGrid &operator=(const LightClusterGrid &) = delete;
+	~LightClusterGrid();
+	void setProjection(const glm::mat4 &projection, GLfloat near_plane, GLfloat far_plane, GLint width, GLint height);
+	void update(const std::vector <PointLightUniforms> &lights, const glm::mat4 &view);
+	void fillUniforms(LightUniforms &uniforms) const;
+	void bind() const;
+	const LightClusterStats &getStats() const;
+	void printStats() const;
+	void release();
+};
+
+LightClusterGrid::LightClusterGrid() : stats(), generation(0), busy_workers(0), stopping(false), next_slice(0)
+{
+	glGenBuffers(3, buffers);
+	glGenTextures(3, textures);
+	GLenum formats[3] = { GL_RG32UI, GL_R32UI, GL_RGBA32F };
+	for (int i = 0; i < 3; ++i)
+	{
+		buffer_sizes[i] = 0;
+		upload(i, formats[i], nullptr, 16);
+	}
+
+	// The calling thread bins as well, one core stays free for the rest
+	GLuint thread_count = std::thread::hardware_concurrency();
+	GLuint worker_count = thread_count > 2 ? std::min(thread_count - 2, (GLuint)CLUSTER_GRID_Z - 1) : 0;
+	for (GLuint i = 0; i < worker_count; ++i)
+		workers.push_back(std::thread(&LightClusterGrid::workerLoop, this));
+}
+LightClusterGrid::~LightClusterGrid()
+{
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		stopping = true;
+	}
+	start_condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+void LightClusterGrid::workerLoop()
+{
+	GLuint seen = 0;
+	while (true)
+	{
+		{
+			std::unique_lock <std::mutex> lock(mutex);
+			start_condition.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+		binSlices();
+		std::lock_guard <std::mutex> lock(mutex);
+		if (--busy_workers == 0)
+			done_condition.notify_one();
+	}
+}
+void LightClusterGrid::binSlices()
+{
+	for (GLint slice = next_slice++; slice < CLUSTER_GRID_Z; slice = next_slice++)
+		binSlice(slice);
+}
+// Sphere against box: squared distance from the center to the box, per axis the
+// part of the offset that sticks out past the box
+void LightClusterGrid::binSlice(GLint slice)
+{
+	SliceBins &bins = slices[slice];
+	bins.candidates.clear();
+	bins.x.clear();
+	bins.y.clear();
+	bins.z.clear();
+	bins.radius.clear();
+	bins.indices.clear();
+	for (GLuint i = 0; i < view_lights.size(); ++i)
+	{
+		const glm::vec4 &light = view_lights[i];
+		if (-light.z + light.w < slice_depths[slice] || -light.z - light.w > slice_depths[slice + 1])
+			continue;
+		bins.candidates.push_back(i);
+		bins.x.push_back(light.x);
+		bins.y.push_back(light.y);
+		bins.z.push_back(light.z);
+		bins.radius.push_back(light.w);
+	}
+
+	GLuint count = (GLuint)bins.candidates.size();
+	GLuint simd_count = count / LIGHT_CLUSTER_LANES * LIGHT_CLUSTER_LANES;
+	for (GLuint cluster = 0; cluster < CLUSTER_GRID_X * CLUSTER_GRID_Y; ++cluster)
+	{
+		const glm::vec3 &box_min = cluster_min[slice][cluster], &box_max = cluster_max[slice][cluster];
+		bins.offsets[cluster] = (GLuint)bins.indices.size();
+#if LIGHT_CLUSTER_LANES == 8
+		for (GLuint i = 0; i < simd_count; i += 8)
+		{
+			__m256 dx = _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(box_min.x), _mm256_loadu_ps(&bins.x[i])), _mm256_sub_ps(_mm256_loadu_ps(&bins.x[i]), _mm256_set1_ps(box_max.x)));
+			__m256 dy = _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(box_min.y), _mm256_loadu_ps(&bins.y[i])), _mm256_sub_ps(_mm256_loadu_ps(&bins.y[i]), _mm256_set1_ps(box_max.y)));
+			__m256 dz = _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(box_min.z), _mm256_loadu_ps(&bins.z[i])), _mm256_sub_ps(_mm256_loadu_ps(&bins.z[i]), _mm256_set1_ps(box_max.z)));
+			dx = _mm256_max_ps(dx, _mm256_setzero_ps());
+			dy = _mm256_max_ps(dy, _mm256_setzero_ps());
+			dz = _mm256_max_ps(dz, _mm256_setzero_ps());
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			__m256 radius = _mm256_loadu_ps(&bins.radius[i]);
+			int mask = _mm256_movemask_ps(_mm256_cmp_ps(distance, _mm256_mul_ps(radius, radius), _CMP_LE_OQ));
+			for (int lane = 0; lane < 8; ++lane)
+				if (mask >> lane & 1)
+					bins.indices.push_back(bins.candidates[i + lane]);
+		}
+#elif LIGHT_CLUSTER_LANES == 4
+		for (GLuint i = 0; i < simd_count; i += 4)
+		{
+			__m128 dx = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(box_min.x), _mm_loadu_ps(&bins.x[i])), _mm_sub_ps(_mm_loadu_ps(&bins.x[i]), _mm_set1_ps(box_max.x)));
+			__m128 dy = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(box_min.y), _mm_loadu_ps(&bins.y[i])), _mm_sub_ps(_mm_loadu_ps(&bins.y[i]), _mm_set1_ps(box_max.y)));
+			__m128 dz = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(box_min.z), _mm_loadu_ps(&bins.z[i])), _mm_sub_ps(_mm_loadu_ps(&bins.z[i]), _mm_set1_ps(box_max.z)));
+			dx = _mm_max_ps(dx, _mm_setzero_ps());
+			dy = _mm_max_ps(dy, _mm_setzero_ps());
+			dz = _mm_max_ps(dz, _mm_setzero_ps());
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			__m128 radius = _mm_loadu_ps(&bins.radius[i]);
+			int mask = _mm_movemask_ps(_mm_cmple_ps(distance, _mm_mul_ps(radius, radius)));
+			for (int lane = 0; lane < 4; ++lane)
+				if (mask >> lane & 1)
+					bins.indices.push_back(bins.candidates[i + lane]);
+		}
+#endif
+		for (GLuint i = simd_count; i < count; ++i)
+		{
+			glm::vec3 offset = glm::max(glm::max(box_min - glm::vec3(bins.x[i], bins.y[i], bins.z[i]), glm::vec3(bins.x[i], bins.y[i], bins.z[i]) - box_max), glm::vec3(0.0f));
+			if (glm::dot(offset, offset) <= bins.radius[i] * bins.radius[i])
+				bins.indices.push_back(bins.candidates[i]);
+		}
+		bins.counts[cluster] = (GLuint)bins.indices.size() - bins.offsets[cluster];
+	}
+}
+// Buffers are orphaned on every upload, like the uniform buffers
+void LightClusterGrid::upload(GLuint buffer, GLenum format, const void *data, GLsizeiptr size)
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[buffer]);
+	if (size > buffer_sizes[buffer])
+		buffer_sizes[buffer] = size;
+	glBufferData(GL_TEXTURE_BUFFER, buffer_sizes[buffer], nullptr, GL_STREAM_DRAW);
+	if (data)
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	if (format != GL_NONE)
+	{
+		GLState::instance().bindTexture(GL_TEXTURE_BUFFER, textures[buffer]);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, buffers[buffer]);
+		GLState::instance().bindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+}
+// Slices split the depth range exponentially, so clusters stay roughly cube
+// shaped and the shader finds its slice with one log
+void LightClusterGrid::setProjection(const glm::mat4 &projection, GLfloat near_plane, GLfloat far_plane, GLint width, GLint height)
+{
+	for (int z = 0; z <= CLUSTER_GRID_Z; ++z)
+		slice_depths[z] = near_plane * pow(far_plane / near_plane, (GLfloat)z / CLUSTER_GRID_Z);
+	GLfloat log_ratio = log(far_plane / near_plane);
+	params = glm::vec4(CLUSTER_GRID_Z / log_ratio, -CLUSTER_GRID_Z * log(near_plane) / log_ratio,
+		(GLfloat)width / CLUSTER_GRID_X, (GLfloat)height / CLUSTER_GRID_Y);
+
+	// Tile corners as view space directions with z = -1, scaled to the slice depths
+	glm::mat4 inverse_projection = glm::inverse(projection);
+	glm::vec3 corners[CLUSTER_GRID_X + 1][CLUSTER_GRID_Y + 1];
+	for (int x = 0; x <= CLUSTER_GRID_X; ++x)
+		for (int y = 0; y <= CLUSTER_GRID_Y; ++y)
+		{
+			glm::vec4 point = inverse_projection * glm::vec4(2.0f * x / CLUSTER_GRID_X - 1.0f, 2.0f * y / CLUSTER_GRID_Y - 1.0f, -1.0f, 1.0f);
+			corners[x][y] = glm::vec3(point) / -point.z;
+		}
+	for (int z = 0; z < CLUSTER_GRID_Z; ++z)
+		for (int y = 0; y < CLUSTER_GRID_Y; ++y)
+			for (int x = 0; x < CLUSTER_GRID_X; ++x)
+			{
+				glm::vec3 &box_min = cluster_min[z][y * CLUSTER_GRID_X + x], &box_max = cluster_max[z][y * CLUSTER_GRID_X + x];
+				for (int i = 0; i < 8; ++i)
+				{
+					glm::vec3 point = corners[x + (i & 1)][y + (i >> 1 & 1)] * slice_depths[z + (i >> 2)];
+					box_min = i ? glm::min(box_min, point) : point;
+					box_max = i ? glm::max(box_max, point) : point;
+				}
+			}
+}
+void LightClusterGrid::update(const std::vector <PointLightUniforms> &lights, const glm::mat4 &view)
+{
+	double start = glfwGetTime();
+	view_lights.resize(lights.size());
+	light_data.resize(lights.size() * 4);
+	for (size_t i = 0; i < lights.size(); ++i)
+	{
+		const PointLightUniforms &light = lights[i];
+		GLfloat radius = getLightRadius(light);
+		view_lights[i] = glm::vec4(glm::vec3(view * glm::vec4(light.pos, 1.0f)), radius);
+		light_data[i * 4] = view_lights[i];
+		light_data[i * 4 + 1] = glm::vec4(light.ambient_intensity, light.constant);
+		light_data[i * 4 + 2] = glm::vec4(light.diffuse_intensity, light.linear);
+		light_data[i * 4 + 3] = glm::vec4(light.specular_intensity, light.quadratic);
+	}
+
+	next_slice = 0;
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		++generation;
+		busy_workers = (GLuint)workers.size();
+	}
+	start_condition.notify_all();
+	binSlices();
+	{
+		std::unique_lock <std::mutex> lock(mutex);
+		done_condition.wait(lock, [this] { return busy_workers == 0; });
+	}
+
+	// Slice lists are joined into one index buffer, the grid holds offset and count per cluster
+	grid.resize(CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z * 2);
+	indices.clear();
+	stats.max_cluster_lights = 0;
+	for (int z = 0; z < CLUSTER_GRID_Z; ++z)
+	{
+		GLuint base = (GLuint)indices.size();
+		indices.insert(indices.end(), slices[z].indices.begin(), slices[z].indices.end());
+		for (int cluster = 0; cluster < CLUSTER_GRID_X * CLUSTER_GRID_Y; ++cluster)
+		{
+			GLuint index = (z * CLUSTER_GRID_X * CLUSTER_GRID_Y + cluster) * 2;
+			grid[index] = base + slices[z].offsets[cluster];
+			grid[index + 1] = slices[z].counts[cluster];
+			stats.max_cluster_lights = std::max(stats.max_cluster_lights, slices[z].counts[cluster]);
+		}
+	}
+	stats.lights = (GLuint)lights.size();
+	stats.references = (GLuint)indices.size();
+	stats.binning_time = (glfwGetTime() - start) * 1000.0;
+
+	upload(0, GL_NONE, grid.data(), (GLsizeiptr)grid.size() * sizeof(GLuint));
+	if (!indices.empty())
+		upload(1, GL_NONE, indices.data(), (GLsizeiptr)indices.size() * sizeof(GLuint));
+	if (!light_data.empty())
+		upload(2, GL_NONE, light_data.data(), (GLsizeiptr)light_data.size() * sizeof(glm::vec4));
+}
+void LightClusterGrid::fillUniforms(LightUniforms &uniforms) const
+{
+	uniforms.cluster_params = params;
+	uniforms.cluster_count = glm::ivec4(CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, 0);
+}
+void LightClusterGrid::bind() const
+{
+	for (int i = 0; i < 3; ++i)
+		GLState::instance().bindTexture(GL_TEXTURE0 + CLUSTER_TEXTURE_UNIT + i, GL_TEXTURE_BUFFER, textures[i]);
+}
+const LightClusterStats &LightClusterGrid::getStats() const { return stats; }
+void LightClusterGrid::printStats() const
+{
+	std::cout << "Light clusters: " << stats.lights << " lights, " << stats.references << " references, at most " << stats.max_cluster_lights
+		<< " per cluster, binned in " << stats.binning_time << " ms on " << workers.size() + 1 << " threads\n";
+}
+void LightClusterGrid::release()
+{
+	glDeleteTextures(3, textures);
+	for (int i = 0; i < 3; ++i)
+		GLState::instance().forgetTexture(textures[i]);
+	glDeleteBuffers(3, buffers);
+}
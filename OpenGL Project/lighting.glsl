@@ -0,0 +1,198 @@
+// Light model shared by the forward, deferred and visibility resolve passes,
+// inserted after the variant defines (HAS_SHADOWS, HAS_POINT_SHADOWS,
+// CLUSTERED_LIGHTS, NUM_POINT_LIGHTS) and point_shadow_faces.glsl. The pass
+// fills a Surface and calls calculateLights
+#define LGT_NUM 5
+#define CSM_NUM 4
+
+#ifndef NUM_POINT_LIGHTS
+#define NUM_POINT_LIGHTS LGT_NUM
+#endif
+
+struct DirectedLight 
+{
+	vec3 dir;
+	vec3 ambient_intensity;
+	vec3 diffuse_intensity;
+	vec3 specular_intensity;
+}; 
+struct PointLight 
+{
+	vec3 pos;
+	vec3 ambient_intensity;
+	vec3 diffuse_intensity;
+	vec3 specular_intensity;
+
+	float constant;
+	float linear;
+	float quadratic;
+}; 
+struct Surface
+{
+	vec3 albedo;
+	vec3 specular;
+	vec3 normal;
+	vec3 emission;
+	float shininess;
+};
+
+#ifdef HAS_SHADOWS
+uniform sampler2DArray shadow_map;
+#endif
+#if defined(HAS_SHADOWS) || defined(HAS_POINT_SHADOWS)
+layout (std140) uniform Shadows
+{
+	mat4 cascade_space[CSM_NUM];
+	mat4 view_to_cascade[CSM_NUM];
+	int cascade_count;
+	mat4 view_to_world;
+};
+#endif
+
+// Directions and positions are already in view space
+layout (std140) uniform Lights
+{
+	DirectedLight dir_light;
+	PointLight point_light[LGT_NUM];
+	int point_light_count;
+	vec4 cluster_params;		// depth slice scale and bias, tile size in pixels
+	ivec4 cluster_count;
+};
+
+#ifdef CLUSTERED_LIGHTS
+uniform usamplerBuffer cluster_grid;	// offset and count of each cluster's list in cluster_lights
+uniform usamplerBuffer cluster_lights;
+uniform samplerBuffer light_data;		// per light: position and radius, ambient and constant, diffuse and linear, specular and quadratic
+
+PointLight fetchLight(int index)
+{
+	vec4 position = texelFetch(light_data, index * 4);
+	vec4 ambient = texelFetch(light_data, index * 4 + 1);
+	vec4 diffuse = texelFetch(light_data, index * 4 + 2);
+	vec4 specular = texelFetch(light_data, index * 4 + 3);
+	return PointLight(position.xyz, ambient.rgb, diffuse.rgb, specular.rgb, ambient.a, diffuse.a, specular.a);
+}
+
+int getCluster(vec3 frag_pos)
+{
+	int slice = clamp(int(log(-frag_pos.z) * cluster_params.x + cluster_params.y), 0, cluster_count.z - 1);
+	ivec2 tile = clamp(ivec2(gl_FragCoord.xy / cluster_params.zw), ivec2(0), cluster_count.xy - 1);
+	return (slice * cluster_count.y + tile.y) * cluster_count.x + tile.x;
+}
+#endif
+
+// The first cascade that contains the point has the finest texels. Cascades
+// are orthographic, w stays 1
+float calculateShadow(vec3 frag_pos, vec3 normal, vec3 light_dir) 
+{
+#ifndef HAS_SHADOWS
+	return 0.0;
+#else
+	for (int i = 0; i < cascade_count; ++i)
+	{
+		vec3 projection_coords = (view_to_cascade[i] * vec4(frag_pos, 1.0)).xyz * 0.5 + 0.5;
+		if (any(lessThan(projection_coords, vec3(0.0))) || any(greaterThan(projection_coords, vec3(1.0))))
+			continue;
+		float closest = texture(shadow_map, vec3(projection_coords.xy, i)).r;
+		float current = projection_coords.z;
+
+		float offset = max(0.1 * (1.0 - dot(normal, light_dir)), 0.01);
+		return current - offset > closest ? 1.0 : 0.0;
+	}
+	return 0.0;
+#endif
+}
+
+#ifdef HAS_POINT_SHADOWS
+uniform sampler2D point_shadow_atlas;
+uniform samplerBuffer point_shadow_tiles;	// per light: tile origin in texels, face size (0 without a tile) and range; position it was rendered from and near plane
+#endif
+
+// The face is the axis the point is furthest along, its depth the distance
+// along that axis. Compared from where the tile was rendered, which may lag
+// behind the light by a few frames
+float calculatePointShadow(int light, vec3 frag_pos, vec3 normal, vec3 light_dir)
+{
+#ifndef HAS_POINT_SHADOWS
+	return 0.0;
+#else
+	if (light < 0)
+		return 0.0;
+	vec4 tile = texelFetch(point_shadow_tiles, light * 2);
+	if (tile.z == 0.0)
+		return 0.0;
+	vec4 origin = texelFetch(point_shadow_tiles, light * 2 + 1);
+	vec3 v = vec3(view_to_world * vec4(frag_pos, 1.0)) - origin.xyz;
+	vec3 a = abs(v);
+	int face = a.x >= a.y && a.x >= a.z ? (v.x > 0.0 ? 0 : 1) : a.y >= a.z ? (v.y > 0.0 ? 2 : 3) : (v.z > 0.0 ? 4 : 5);
+	float current = max(a.x, max(a.y, a.z));
+	if (current >= tile.w)
+		return 0.0;
+	vec2 face_coords = vec2(dot(v, face_right[face]), dot(v, face_up[face])) / current * 0.5 + 0.5;
+	ivec2 texel = ivec2(tile.xy) + ivec2(face % 3, face / 3) * int(tile.z) + clamp(ivec2(face_coords * tile.z), ivec2(0), ivec2(int(tile.z) - 1));
+	float stored = texelFetch(point_shadow_atlas, texel, 0).r;
+	float near_plane = origin.w, far_plane = tile.w;
+	float closest = 2.0 * near_plane * far_plane / (far_plane + near_plane - (2.0 * stored - 1.0) * (far_plane - near_plane));
+
+	float offset = max(0.05 * (1.0 - dot(normal, light_dir)), 0.01) * current;
+	return current - offset > closest ? 1.0 : 0.0;
+#endif
+}
+
+vec3 calculateDirLight(DirectedLight light, Surface surface, vec3 frag_pos) 
+{
+	vec3 light_dir = light.dir;
+	vec3 ambient_light = light.ambient_intensity * surface.albedo;
+	vec3 emission_light = max(dot(light_dir, surface.normal), 0.0) * surface.emission;
+
+	float diffuse = max(dot(-light_dir, surface.normal), 0.0);
+	vec3 diffuse_light = diffuse * light.diffuse_intensity * surface.albedo;
+
+	vec3 view_dir = -normalize(frag_pos);
+	vec3 half_dir = normalize(-light_dir + view_dir);
+	float specular = pow(max(dot(half_dir, surface.normal), 0.0), surface.shininess);
+	vec3 specular_light = specular * light.specular_intensity * surface.specular;
+
+	float shadow = calculateShadow(frag_pos, surface.normal, -light_dir);
+	return ambient_light + emission_light + (1.0 - shadow) * (diffuse_light + specular_light);
+}
+
+#if NUM_POINT_LIGHTS > 0 || defined(CLUSTERED_LIGHTS)
+vec3 calculatePointLight(PointLight light, int shadow_tile, Surface surface, vec3 frag_pos) 
+{
+	float distance = length(light.pos - frag_pos);
+	float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+	vec3 ambient_light = attenuation * light.ambient_intensity * surface.albedo;
+
+	vec3 light_dir = normalize(light.pos - frag_pos);
+	float diffuse = max(dot(light_dir, surface.normal), 0.0);
+	vec3 diffuse_light = attenuation * diffuse * light.diffuse_intensity * surface.albedo;
+
+	vec3 view_dir = -normalize(frag_pos);
+	vec3 half_dir = normalize(light_dir + view_dir);
+	float specular = pow(max(dot(half_dir, surface.normal), 0.0), surface.shininess);
+	vec3 specular_light = attenuation * specular * light.specular_intensity * surface.specular;
+
+	float shadow = calculatePointShadow(shadow_tile, frag_pos, surface.normal, light_dir);
+	return ambient_light + (1.0 - shadow) * (diffuse_light + specular_light);
+}
+#endif
+
+// Directed light plus the point lights of the fragment's cluster, or the
+// first NUM_POINT_LIGHTS of the Lights block
+vec3 calculateLights(Surface surface, vec3 frag_pos)
+{
+	vec3 result = calculateDirLight(dir_light, surface, frag_pos);
+#if defined(CLUSTERED_LIGHTS)
+	uvec2 range = texelFetch(cluster_grid, getCluster(frag_pos)).rg;
+	for (uint i = 0u; i < range.y; ++i)
+	{
+		int light = int(texelFetch(cluster_lights, int(range.x + i)).r);
+		result += calculatePointLight(fetchLight(light), light, surface, frag_pos);
+	}
+#elif NUM_POINT_LIGHTS > 0
+	for (int i = 0; i < min(point_light_count, NUM_POINT_LIGHTS); ++i)
+		result += calculatePointLight(point_light[i], -1, surface, frag_pos);
+#endif
+	return result;
+}
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <vector>
+#include <cstdlib>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -10,15 +11,37 @@
 #include "shader.h"
 #include "camera.h"
 #include "texture.h"
+#include "texture_compression.h"
 #include "model.h"
+#include "shader_permutations.h"
+#include "render_queue.h"
+#include "frustum_culler.h"
+#include "scene.h"
+#include "light_clusters.h"
+#include "gbuffer.h"
+#include "visibility_buffer.h"
+#include "shadow_cascades.h"
+#include "point_shadow_atlas.h"
+#include "instancing.h"
+#include "instancing_benchmark.h"
+#include "shading_benchmark.h"
+#include "import_test.h"
 
 #define SCR_WIDTH 800
 #define SCR_HEIGHT 800
 
-#define SHDW_MAP_WIDTH 2048
-#define SHDW_MAP_HEIGHT 2048
+#define SHDW_MAP_SIZE 2048
+#define SHDW_CASCADES 4
+#define SHDW_DISTANCE 40.0f
+#define PNT_SHDW_ATLAS_SIZE 4096
+
+#define BELT_SIZE 2000
+#define POINT_LIGHT_COUNT 256
 
 GLfloat current_time = 0.0f, last_time = 0.0f, frame_time, time_scale = 1.0f;
+//   ,      ( P)
+GLfloat animation_time = 0.0f;
+bool animation_paused = false, pause_key_down = false;
 
 struct DirectedLight 
 {
@@ -73,30 +96,32 @@ void processInputEvents(GLFWwindow *window)
 		glfwSetWindowShouldClose(window, true);
 	
 	camera.processKeyboard(window, time_scale * frame_time);
+
+	//          
+	bool pause_key = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (pause_key && !pause_key_down)
+		animation_paused = !animation_paused;
+	pause_key_down = pause_key;
 }
 
 GLuint loadSkyBox(std::vector <string> textures) 
 {
 	GLuint id;
-	GLubyte *data;
 	glGenTextures(1, &id);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, id);
-
-	GLint width, height, nr_channels;
-	for (int i = 0; i < textures.size(); ++i)
-	{
-		data = stbi_load(textures[i].c_str(), &width, &height, &nr_channels, 0);
-		if (data)
-			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		else
-			std::cout << "Error while loading skybox!\n";
-		stbi_image_free(data);
-	}
+	GLState::instance().bindTexture(GL_TEXTURE_CUBE_MAP, id);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	GLState::instance().bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	for (int i = 0; i < textures.size(); ++i)
+		TextureLoader::instance().request(textures[i], false, id, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, false, [](bool success, const TextureImage &image)
+		{
+			if (!success)
+				std::cout << "Error while loading skybox!\n";
+		});
 
 	return id;
 }
@@ -130,7 +155,7 @@ GLFWwindow *initGLFWWindow(GLuint width, GLuint height)
 	return window;
 }
 
-int main() 
+int main(int argc, char **argv) 
 {
 	//  
 	GLFWwindow* window = initGLFWWindow(SCR_WIDTH, SCR_HEIGHT);
@@ -140,6 +165,14 @@ int main()
 		return -1;
 	}
 
+	//   : --compress-textures
+	if (argc > 1 && std::string(argv[1]) == "--compress-textures")
+	{
+		compressTextures({ "Models", "Textures" });
+		glfwTerminate();
+		return 0;
+	}
+
 	//  
 	glfwWindowHint(GLFW_SAMPLES, 8);
 	glEnable(GL_MULTISAMPLE);
@@ -147,30 +180,80 @@ int main()
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	//    
-	GLuint depth_map_buffer;
-	glGenFramebuffers(1, &depth_map_buffer);
-
-	GLuint depth_map;
-	glGenTextures(1, &depth_map);
-	glBindTexture(GL_TEXTURE_2D, depth_map);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHDW_MAP_WIDTH, SHDW_MAP_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	GLfloat border_color[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border_color);
-
-	glBindFramebuffer(GL_FRAMEBUFFER, depth_map_buffer);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_map, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	//       : --benchmark-instancing [ ]
+	if (argc > 1 && std::string(argv[1]) == "--benchmark-instancing")
+	{
+		benchmarkInstancing("Models/moon.obj", argc > 2 ? atoi(argv[2]) : 10000);
+		GeometryArena::instance().release();
+		glfwTerminate();
+		return 0;
+	}
+
+	//  :      : --test-import
+	if (argc > 1 && std::string(argv[1]) == "--test-import")
+	{
+		bool passed = testImport();
+		GeometryArena::instance().release();
+		glfwTerminate();
+		return passed ? 0 : 1;
+	}
+
+	//  ,         : --benchmark-shading [ ]
+	if (argc > 1 && std::string(argv[1]) == "--benchmark-shading")
+	{
+		benchmarkShading("Models/moon.obj", SCR_WIDTH, SCR_HEIGHT, argc > 2 ? atoi(argv[2]) : 2000);
+		TextureArrayRegistry::instance().release();
+		TextureLoader::instance().shutdown();
+		GeometryArena::instance().release();
+		glfwTerminate();
+		return 0;
+	}
+
+	//    : --deferred
+	bool deferred = argc > 1 && std::string(argv[1]) == "--deferred";
+	//  : --visibility
+	bool visibility = argc > 1 && std::string(argv[1]) == "--visibility";
+
+	//   :           SHDW_DISTANCE,
+	//     ,      4 
+	ShadowCascades shadow_cascades(SHDW_MAP_SIZE, SHDW_CASCADES, 0.75f, SHDW_DISTANCE, 4);
 
 	//  
-	Shader shader("vertex.vsh", "fragment.fsh"), light_shader("vertex_light.vsh", "fragment_light.fsh"), depth_shader("vertex_depth.vsh", "fragment_depth.fsh");
+	Shader light_shader("vertex_light.vsh", "fragment_light.fsh"), depth_shader("vertex_depth.vsh", "fragment_depth.fsh");
+	Shader depth_instanced_shader("vertex_depth.vsh", "fragment_depth.fsh", getShaderDefines(SHADER_INSTANCED));
+	//   :           
+	Shader point_shadow_shader("vertex_point_shadow.vsh", "fragment_depth.fsh", "", "geometry_point_shadow.gsh", { "point_shadow_faces.glsl" });
+	Shader point_shadow_instanced_shader("vertex_point_shadow.vsh", "fragment_depth.fsh", getShaderDefines(SHADER_INSTANCED), "geometry_point_shadow.gsh", { "point_shadow_faces.glsl" });
 	Shader sky_shader("vertex_sky.vsh", "fragment_sky.fsh");
+	//          
+	ShaderVariants shader("vertex.vsh", "fragment.fsh", [](Shader &variant)
+	{
+		variant.setUniform("material.shininess", 64.0f);
+		variant.setUniform("shadow_map", 15);
+		variant.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+		variant.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+		variant.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+		variant.setUniform("point_shadow_atlas", POINT_SHADOW_TEXTURE_UNIT);
+		variant.setUniform("point_shadow_tiles", POINT_SHADOW_TEXTURE_UNIT + 1);
+	}, getLightingLibraries());
+	//  :    G-,     
+	ShaderVariants gbuffer_shader("vertex.vsh", "fragment_gbuffer.fsh");
+	Shader deferred_shader("vertex_fullscreen.vsh", "fragment_deferred.fsh", getShaderDefines(SHADER_SHADOWS | SHADER_CLUSTERED_LIGHTS | SHADER_POINT_SHADOWS), "", getLightingLibraries());
+	//  :       ,         
+	Shader visibility_shader("vertex_visibility.vsh", "fragment_visibility.fsh");
+	Shader visibility_instanced_shader("vertex_visibility.vsh", "fragment_visibility.fsh", getShaderDefines(SHADER_INSTANCED));
+	Shader material_depth_shader("vertex_fullscreen.vsh", "fragment_material_depth.fsh");
+	ShaderVariants visibility_resolve_shader("vertex_fullscreen.vsh", "fragment_visibility_resolve.fsh", [](Shader &variant)
+	{
+		VisibilityBuffer::setSamplers(variant);
+		variant.setUniform("material.shininess", 64.0f);
+		variant.setUniform("shadow_map", 15);
+		variant.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+		variant.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+		variant.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+		variant.setUniform("point_shadow_atlas", POINT_SHADOW_TEXTURE_UNIT);
+		variant.setUniform("point_shadow_tiles", POINT_SHADOW_TEXTURE_UNIT + 1);
+	}, getLightingLibraries());
 
 	//  
 	std::vector <string> textures = {
@@ -181,7 +264,10 @@ int main()
 	GLuint skybox = loadSkyBox(textures);
 
 	//  
-	Model myearth("Models/earth.obj"), moon("Models/moon.obj"), box("Models/wall.obj"), skycube("Models/cube.obj");
+	//         
+	Model myearth("Models/earth.obj", true, VERTEX_FORMAT_QUANTIZED, true), moon("Models/moon.obj", true, VERTEX_FORMAT_QUANTIZED, true);
+	Model skycube("Models/cube.obj", true, VERTEX_FORMAT_QUANTIZED);
+	bool textures_loaded = false;
 
 	//   
 	DirectedLight dir_light = {
@@ -198,42 +284,198 @@ int main()
 		1.0f, 0.14f, 0.07f
 	};
 
+	//      ,     
+	std::vector <glm::mat4> belt_base(BELT_SIZE), belt_transforms(BELT_SIZE);
+	srand(1);
+	for (int i = 0; i < BELT_SIZE; ++i)
+	{
+		GLfloat angle = glm::radians(360.0f * rand() / RAND_MAX), radius = 7.0f + 2.0f * rand() / RAND_MAX;
+		GLfloat height = 0.4f * rand() / RAND_MAX - 0.2f, scale = 0.03f + 0.05f * rand() / RAND_MAX;
+		belt_base[i] = glm::translate(glm::mat4(1.0f), glm::vec3(radius * sin(angle), height, radius * cos(angle)));
+		belt_base[i] = glm::rotate(belt_base[i], angle * 7.0f, glm::vec3(0.3f, 1.0f, 0.1f));
+		belt_base[i] = glm::scale(belt_base[i], glm::vec3(scale));
+	}
+	//         ,     
+	std::vector <glm::mat4> belt_visible;
+	InstanceBuffer belt_instances, belt_shadow_instances[SHADOW_MAX_CASCADES], belt_point_shadow_instances[RENDER_POINT_SHADOW_PASSES];
+	FrustumCuller belt_culler;
+	glm::vec3 moon_min, moon_max;
+	glm::mat4 belt_last_rotation(0.0f);
+	GLuint belt_still_frames = 0;
+
+	//  ,        
+	Scene scene;
+	GLuint earth_object = scene.add(myearth, glm::mat4(1.0f)), moon_object = scene.add(moon, glm::mat4(1.0f));
+	std::vector <GLuint> visible_objects;
+	std::vector <BoundingBox> static_changes;
+
 	GLfloat T;
 
 	//  
-	glm::mat4 projection, light_projection, view, light_view, light_space, model, moon_model;
+	glm::mat4 projection, view, model, moon_model;
 	projection = glm::perspective(glm::radians(50.0f), (GLfloat)SCR_WIDTH / (GLfloat)SCR_HEIGHT, 0.1f, 100.0f);
-	light_projection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, 1.0f, 20.0f);
-	light_view = glm::lookAt(-dir_light.dir * glm::vec3(10.0f, 10.0f, 10.0f), glm::vec3(0.0f), global_up);
-	light_space = light_projection * light_view;
 
 	//  
-	depth_shader.use();
-	depth_shader.setUniform("light_space", light_space);
-
-	shader.use();
-	shader.setUniform("projection", projection);
-	shader.setUniform("light_space", light_space);
-	shader.setUniform("material.shininess", 64.0f);
-	shader.setUniform("dir_light.dir", dir_light.dir);
-	shader.setUniform("dir_light.ambient_intensity", dir_light.ambient_intensity);
-	shader.setUniform("dir_light.diffuse_intensity", dir_light.diffuse_intensity);
-	shader.setUniform("dir_light.specular_intensity", dir_light.specular_intensity);
-	/*shader.setUniform("point_light[0].ambient_intensity", point_light.ambient_intensity);
-	shader.setUniform("point_light[0].diffuse_intensity", point_light.diffuse_intensity);
-	shader.setUniform("point_light[0].specular_intensity", point_light.specular_intensity);
-	shader.setUniform("point_light[0].constant", point_light.constant);
-	shader.setUniform("point_light[0].linear", point_light.linear);
-	shader.setUniform("point_light[0].quadratic", point_light.quadratic);*/
-
 	light_shader.use();
-	light_shader.setUniform("projection", projection);
 	light_shader.setUniform("light_color", point_light.specular_intensity);
 
 	sky_shader.use();
-	sky_shader.setUniform("projection", projection);
 	sky_shader.setUniform("skybox", 16);
 
+	deferred_shader.use();
+	deferred_shader.setUniform("albedo_specular", GBUFFER_TEXTURE_UNIT + GBUFFER_ALBEDO_SPECULAR);
+	deferred_shader.setUniform("octahedral_normal", GBUFFER_TEXTURE_UNIT + GBUFFER_NORMAL);
+	deferred_shader.setUniform("emission", GBUFFER_TEXTURE_UNIT + GBUFFER_EMISSION);
+	deferred_shader.setUniform("depth", GBUFFER_TEXTURE_UNIT + GBUFFER_TARGET_COUNT);
+	deferred_shader.setUniform("shadow_map", 15);
+	deferred_shader.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+	deferred_shader.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+	deferred_shader.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+	deferred_shader.setUniform("point_shadow_atlas", POINT_SHADOW_TEXTURE_UNIT);
+	deferred_shader.setUniform("point_shadow_tiles", POINT_SHADOW_TEXTURE_UNIT + 1);
+	deferred_shader.setUniform("shininess", 64.0f);
+
+	material_depth_shader.use();
+	VisibilityBuffer::setSamplers(material_depth_shader);
+
+	//      ,      ( Frame, Lights  Shadows)
+	UniformBuffer frame_buffer(FRAME_UNIFORMS_BINDING, sizeof(FrameUniforms)), light_buffer(LIGHT_UNIFORMS_BINDING, sizeof(LightUniforms));
+	UniformBuffer shadow_buffer(SHADOW_UNIFORMS_BINDING, sizeof(ShadowUniforms));
+	FrameUniforms frame_uniforms;
+	ShadowUniforms shadow_uniforms = {};
+	LightUniforms light_uniforms = {};
+	light_uniforms.dir_light.ambient_intensity = dir_light.ambient_intensity;
+	light_uniforms.dir_light.diffuse_intensity = dir_light.diffuse_intensity;
+	light_uniforms.dir_light.specular_intensity = dir_light.specular_intensity;
+	light_uniforms.point_light[0].ambient_intensity = point_light.ambient_intensity;
+	light_uniforms.point_light[0].diffuse_intensity = point_light.diffuse_intensity;
+	light_uniforms.point_light[0].specular_intensity = point_light.specular_intensity;
+	light_uniforms.point_light[0].constant = point_light.constant;
+	light_uniforms.point_light[0].linear = point_light.linear;
+	light_uniforms.point_light[0].quadratic = point_light.quadratic;
+	light_uniforms.point_light_count = 0;
+
+	//  :    ,    .      
+	std::vector <PointLightUniforms> point_lights(POINT_LIGHT_COUNT), point_lights_base(POINT_LIGHT_COUNT);
+	point_lights_base[0] = light_uniforms.point_light[0];
+	point_lights_base[0].pos = point_light.pos;
+	for (int i = 1; i < POINT_LIGHT_COUNT; ++i)
+	{
+		GLfloat angle = glm::radians(360.0f * rand() / RAND_MAX), radius = 6.0f + 4.0f * rand() / RAND_MAX;
+		glm::vec3 color = glm::vec3((GLfloat)rand() / RAND_MAX, (GLfloat)rand() / RAND_MAX, (GLfloat)rand() / RAND_MAX) * 0.6f;
+		point_lights_base[i] = PointLightUniforms();
+		point_lights_base[i].pos = glm::vec3(radius * sin(angle), 0.6f * rand() / RAND_MAX - 0.3f, radius * cos(angle));
+		point_lights_base[i].diffuse_intensity = point_lights_base[i].specular_intensity = color;
+		point_lights_base[i].constant = 1.0f;
+		point_lights_base[i].linear = 3.0f;
+		point_lights_base[i].quadratic = 30.0f;
+	}
+	LightClusterGrid light_clusters;
+	light_clusters.setProjection(projection, 0.1f, 100.0f, SCR_WIDTH, SCR_HEIGHT);
+	light_clusters.fillUniforms(light_uniforms);
+	//     :       ,      RENDER_POINT_SHADOW_PASSES 
+	PointShadowAtlas point_shadows(PNT_SHDW_ATLAS_SIZE, RENDER_POINT_SHADOW_PASSES);
+	std::vector <BoundingBox> moving_boxes;
+
+	GBuffer gbuffer(SCR_WIDTH, SCR_HEIGHT);
+	VisibilityBuffer visibility_buffer(SCR_WIDTH, SCR_HEIGHT);
+
+	//  :         , ,   
+	RenderQueue render_queue;
+	//      :       ,
+	//  -      .     
+	auto use_cascade = [&](GLuint cascade)
+	{
+		GLState::instance().cullFace(GL_FRONT);
+		depth_shader.use();
+		depth_shader.setUniform("cascade", (GLint)cascade);
+		depth_instanced_shader.use();
+		depth_instanced_shader.setUniform("cascade", (GLint)cascade);
+	};
+	for (GLuint i = 0; i < SHADOW_MAX_CASCADES; ++i)
+	{
+		render_queue.setPass((RenderPass)(RENDER_PASS_SHADOW_STATIC + i), [&, i]()
+		{
+			if (!shadow_cascades.needsStatic(i))
+				return;
+			shadow_cascades.bindStaticLayer(i);
+			use_cascade(i);
+		});
+		render_queue.setPass((RenderPass)(RENDER_PASS_SHADOW + i), [&, i]()
+		{
+			if (!shadow_cascades.needsRefresh(i))
+				return;
+			shadow_cascades.bindLayer(i);
+			use_cascade(i);
+		});
+	}
+	for (GLuint i = 0; i < RENDER_POINT_SHADOW_PASSES; ++i)
+		render_queue.setPass((RenderPass)(RENDER_PASS_POINT_SHADOW + i), [&, i]()
+		{
+			if (i >= point_shadows.getScheduledCount())
+				return;
+			point_shadows.bindTile(i);
+			GLState::instance().cullFace(GL_FRONT);
+			point_shadow_shader.use();
+			point_shadows.setUniforms(point_shadow_shader, i);
+			point_shadow_instanced_shader.use();
+			point_shadows.setUniforms(point_shadow_instanced_shader, i);
+		});
+	render_queue.setPass(RENDER_PASS_OPAQUE, [&]()
+	{
+		point_shadows.finishTiles();
+		GLState::instance().cullFace(GL_BACK);
+		GLState::instance().depthFunc(GL_LESS);
+		if (deferred)
+		{
+			//      - 
+			glDisable(GL_BLEND);
+			gbuffer.bind();
+			return;
+		}
+		if (visibility)
+		{
+			visibility_buffer.renderGeometry(visibility_shader, visibility_instanced_shader);
+			return;
+		}
+		GLState::instance().bindFramebuffer(0);
+		glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		shadow_cascades.bind();
+		point_shadows.bind();
+		light_clusters.bind();
+	});
+	render_queue.setPass(RENDER_PASS_LIGHTING, [&]()
+	{
+		if (!deferred && !visibility)
+			return;
+		GLState::instance().bindFramebuffer(0);
+		glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		shadow_cascades.bind();
+		point_shadows.bind();
+		light_clusters.bind();
+		if (visibility)
+		{
+			visibility_buffer.resolve(material_depth_shader, visibility_resolve_shader, SHADER_SHADOWS | SHADER_CLUSTERED_LIGHTS | SHADER_POINT_SHADOWS, 0);
+			return;
+		}
+		glEnable(GL_BLEND);
+		glDisable(GL_DEPTH_TEST);
+		deferred_shader.use();
+		deferred_shader.setUniform("inverse_projection", glm::inverse(projection));
+		gbuffer.bindTextures();
+		gbuffer.drawFullscreen();
+		glEnable(GL_DEPTH_TEST);
+		//       
+		gbuffer.copyDepth(0);
+	});
+	render_queue.setPass(RENDER_PASS_SKY, [&]()
+	{
+		GLState::instance().depthFunc(GL_LEQUAL);
+		GLState::instance().bindTexture(GL_TEXTURE16, GL_TEXTURE_CUBE_MAP, skybox);
+	});
+
 	//   
 	while (!glfwWindowShouldClose(window))
 	{
@@ -243,68 +485,208 @@ int main()
 		
 		processInputEvents(window);
 
+		TextureLoader::instance().update();
+		//  ,      
+		if (!textures_loaded && myearth.isLoaded() && moon.isLoaded() && skycube.isLoaded() && TextureLoader::instance().isIdle())
+		{
+			TextureRegistry::instance().printStats();
+			TextureArrayRegistry::instance().printStats();
+			GeometryArena::instance().printStats();
+			ProgramBinaryCache::instance().printStats();
+			GLState::instance().printStats();
+			render_queue.printStats();
+			if (deferred)
+				gbuffer.printStats();
+			if (visibility)
+				visibility_buffer.printStats();
+			scene.printStats();
+			light_clusters.printStats();
+			std::cout << "Shader variants: " << shader.getVariantCount() << "\n";
+			textures_loaded = true;
+		}
+
 		glClearColor(0.0f, 0.01f, 0.03f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		//point_light.pos = glm::vec3(2.5f, 1.0f * sin(T / 2), 1.0f * cos(T / 2));
-		T = time_scale * current_time;
+		if (!animation_paused)
+			animation_time += frame_time;
+		T = time_scale * animation_time;
 
 		view = camera.getLookAt();
 		
 		model = glm::mat4(1.0f);
 		model = glm::rotate(model, glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
 		model = glm::scale(model, glm::vec3(0.01f, 0.01f, 0.01f));
-		model = glm::rotate(model, time_scale * current_time / 2, glm::vec3(0.0f, 1.0f, 0.0f));
+		model = glm::rotate(model, time_scale * animation_time / 2, glm::vec3(0.0f, 1.0f, 0.0f));
 		moon_model = glm::mat4(1.0f);
 		moon_model = glm::translate(moon_model, glm::vec3(3.0 * sin(T), 0.0f, 5.0 * cos(T)));
 		moon_model = glm::scale(moon_model, glm::vec3(1.0f, 1.0f, 1.0f));
-
-		//    
-		glCullFace(GL_FRONT);
-		glViewport(0, 0, SHDW_MAP_WIDTH, SHDW_MAP_HEIGHT);
-		glBindFramebuffer(GL_FRAMEBUFFER, depth_map_buffer);
-		glClear(GL_DEPTH_BUFFER_BIT);
-		depth_shader.use();
-		depth_shader.setUniform("model", model);
-		depth_shader.setUniform("view", view);
-
-		myearth.render(depth_shader);
-		depth_shader.setUniform("model", moon_model);
-		moon.render(depth_shader);
-		glCullFace(GL_BACK);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		
-		//    
-		glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		
-		glActiveTexture(GL_TEXTURE15);
-		glBindTexture(GL_TEXTURE_2D, depth_map);
-		shader.use();
-		shader.setUniform("view", view);
-		shader.setUniform("model", model);
-		shader.setUniform("shadow_map", 15);
-
-		myearth.render(shader);
-		shader.setUniform("model", moon_model);
-		moon.render(shader);
+		scene.setTransform(earth_object, model);
+		scene.setTransform(moon_object, moon_model);
+		Frustum camera_frustum = extractFrustum(projection * view);
+
+		frame_uniforms.view = view;
+		frame_uniforms.projection = projection;
+		frame_uniforms.view_projection = projection * view;
+		frame_uniforms.camera_pos = glm::vec4(camera.getPos(), 1.0f);
+		frame_buffer.update(frame_uniforms);
+		light_uniforms.dir_light.dir = glm::mat3(view) * dir_light.dir;
+		light_uniforms.point_light[0].pos = glm::vec3(view * glm::vec4(point_light.pos, 1.0f));
+		light_buffer.update(light_uniforms);
+		glm::mat4 lights_rotation = glm::rotate(glm::mat4(1.0f), -T / 10.0f, glm::vec3(0.0f, 1.0f, 0.0f));
+		for (int i = 0; i < POINT_LIGHT_COUNT; ++i)
+		{
+			point_lights[i] = point_lights_base[i];
+			if (i)
+				point_lights[i].pos = glm::vec3(lights_rotation * glm::vec4(point_lights_base[i].pos, 1.0f));
+		}
+		light_clusters.update(point_lights, view);
+
+		render_queue.setView(view);
+		render_queue.setFrustum(RENDER_PASS_OPAQUE, projection * view);
+		glm::mat4 belt_rotation = glm::rotate(glm::mat4(1.0f), T / 20.0f, glm::vec3(0.0f, 1.0f, 0.0f));
+		for (int i = 0; i < BELT_SIZE; ++i)
+			belt_transforms[i] = belt_rotation * belt_base[i];
+		bool belt_bounds = moon.getBounds(moon_min, moon_max);
+
+		//  : ,       ,   
+		//  .          ,  
+		scene.updateMotion(static_changes, moving_boxes);
+		for (int i = 0; i < static_changes.size(); ++i)
+			shadow_cascades.invalidate(static_changes[i]);
+		//   ,     - .       
+		for (int i = 0; i < moving_boxes.size(); ++i)
+			point_shadows.invalidate(moving_boxes[i]);
+		bool belt_was_static = belt_still_frames >= SCENE_STATIC_FRAMES;
+		belt_still_frames = belt_rotation == belt_last_rotation && belt_bounds ? glm::min(belt_still_frames + 1, (GLuint)SCENE_STATIC_FRAMES) : 0;
+		belt_last_rotation = belt_rotation;
+		bool belt_static = belt_still_frames >= SCENE_STATIC_FRAMES;
+		if (belt_static != belt_was_static)
+			shadow_cascades.invalidate();
+		if (belt_bounds && !belt_static)
+			point_shadows.invalidate();
+		shadow_cascades.update(view, projection, 0.1f, dir_light.dir);
+		shadow_cascades.fillUniforms(shadow_uniforms, view);
+		point_shadows.update(point_lights, view, projection, SCR_HEIGHT);
+		point_shadows.fillUniforms(shadow_uniforms, view);
+		shadow_buffer.update(shadow_uniforms);
+
+		//     ,    
+		//       ,     
+		for (GLuint cascade = 0; cascade < shadow_cascades.getCascadeCount(); ++cascade)
+		{
+			if (!shadow_cascades.isDue(cascade))
+				continue;
+			RenderPass static_pass = (RenderPass)(RENDER_PASS_SHADOW_STATIC + cascade), shadow_pass = (RenderPass)(RENDER_PASS_SHADOW + cascade);
+			bool rebuild_static = shadow_cascades.needsStatic(cascade);
+			GLuint dynamic_casters = 0;
+			Frustum light_frustum = extractFrustum(shadow_cascades.getLightSpace(cascade));
+			render_queue.setFrustum(static_pass, shadow_cascades.getLightSpace(cascade));
+			render_queue.setFrustum(shadow_pass, shadow_cascades.getLightSpace(cascade));
+			if (belt_bounds && (rebuild_static || !belt_static))
+			{
+				render_queue.addCullingStats(belt_static ? static_pass : shadow_pass,
+					cullInstances(belt_culler, light_frustum, moon_min, moon_max, belt_transforms, belt_visible));
+				belt_shadow_instances[cascade].update(belt_visible);
+				moon.renderInstanced(render_queue, belt_static ? static_pass : shadow_pass, depth_instanced_shader, belt_shadow_instances[cascade], MESH_MAX_LODS);
+				if (!belt_static)
+					dynamic_casters += (GLuint)belt_visible.size();
+			}
+			scene.query(light_frustum, visible_objects);
+			for (int i = 0; i < visible_objects.size(); ++i)
+			{
+				GLuint object = visible_objects[i];
+				bool object_static = scene.isStatic(object);
+				if (object_static && !rebuild_static)
+					continue;
+				dynamic_casters += !object_static;
+				LodSelector lod = { scene.getTransform(object), view, projection, SCR_HEIGHT, 1.0f };
+				scene.getModel(object).render(render_queue, object_static ? static_pass : shadow_pass, depth_shader, scene.getTransform(object), &lod);
+			}
+			shadow_cascades.setDynamicCasters(cascade, dynamic_casters > 0);
+		}
+
+		//  ,  ,     .      
+		for (GLuint slot = 0; slot < point_shadows.getScheduledCount(); ++slot)
+		{
+			RenderPass point_pass = (RenderPass)(RENDER_PASS_POINT_SHADOW + slot);
+			glm::mat4 light_box = point_shadows.getCullingSpace(slot);
+			Frustum light_frustum = extractFrustum(light_box);
+			render_queue.setFrustum(point_pass, light_box);
+			if (belt_bounds)
+			{
+				render_queue.addCullingStats(point_pass,
+					cullInstances(belt_culler, light_frustum, moon_min, moon_max, belt_transforms, belt_visible));
+				belt_point_shadow_instances[slot].update(belt_visible);
+				moon.renderInstanced(render_queue, point_pass, point_shadow_instanced_shader, belt_point_shadow_instances[slot], MESH_MAX_LODS);
+			}
+			scene.query(light_frustum, visible_objects);
+			for (int i = 0; i < visible_objects.size(); ++i)
+			{
+				GLuint object = visible_objects[i];
+				LodSelector lod = { scene.getTransform(object), view, projection, SCR_HEIGHT, 1.0f };
+				scene.getModel(object).render(render_queue, point_pass, point_shadow_shader, scene.getTransform(object), &lod);
+			}
+		}
+		if (belt_bounds)
+		{
+			render_queue.addCullingStats(RENDER_PASS_OPAQUE,
+				cullInstances(belt_culler, camera_frustum, moon_min, moon_max, belt_transforms, belt_visible));
+			belt_instances.update(belt_visible);
+		}
+
+		//    ,  G-    
+		ShaderVariants &opaque_shader = deferred ? gbuffer_shader : shader;
+		ShaderFeatures scene_features = deferred ? 0 : SHADER_SHADOWS | SHADER_CLUSTERED_LIGHTS | SHADER_POINT_SHADOWS;
+		scene.query(camera_frustum, visible_objects);
+		for (int i = 0; i < visible_objects.size(); ++i)
+		{
+			GLuint object = visible_objects[i];
+			LodSelector lod = { scene.getTransform(object), view, projection, SCR_HEIGHT, 1.0f };
+			if (visibility)
+				scene.getModel(object).render(visibility_buffer, scene.getTransform(object), &lod);
+			else
+				scene.getModel(object).render(render_queue, RENDER_PASS_OPAQUE, opaque_shader, scene_features, scene.getTransform(object), &lod);
+		}
+		if (visibility)
+			moon.renderInstanced(visibility_buffer, belt_instances, belt_visible, MESH_MAX_LODS);
+		else
+			moon.renderInstanced(render_queue, RENDER_PASS_OPAQUE, opaque_shader, scene_features, belt_instances, MESH_MAX_LODS);
 
 		//  
-		glDepthFunc(GL_LEQUAL);
-		glm::mat4 sky_view = glm::mat4(glm::mat3(view));
-		sky_shader.use();
-		sky_shader.setUniform("view", sky_view);
-		sky_shader.setUniform("projection", projection);
+		skycube.render(render_queue, RENDER_PASS_SKY, sky_shader, glm::mat4(1.0f));
 
-		glActiveTexture(GL_TEXTURE16);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, skybox);
-		skycube.render(sky_shader);
-		glDepthFunc(GL_LESS);
+		render_queue.submit();
 
+		GLState::instance().endFrame();
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
+	//     ,     
+	std::cout << "Renderer: " << (visibility ? "visibility buffer" : deferred ? "deferred" : "forward") << "\n";
+	render_queue.printStats();
+	shadow_cascades.printStats();
+	point_shadows.printStats();
+
+	belt_instances.release();
+	for (int i = 0; i < SHADOW_MAX_CASCADES; ++i)
+		belt_shadow_instances[i].release();
+	for (int i = 0; i < RENDER_POINT_SHADOW_PASSES; ++i)
+		belt_point_shadow_instances[i].release();
+	frame_buffer.release();
+	light_buffer.release();
+	shadow_buffer.release();
+	shadow_cascades.release();
+	point_shadows.release();
+	light_clusters.release();
+	gbuffer.release();
+	visibility_buffer.release();
+	render_queue.release();
+	TextureArrayRegistry::instance().release();
+	TextureLoader::instance().shutdown();
+	GeometryArena::instance().release();
 	glfwTerminate();
 	return 0;
 }
\ No newline at end of file
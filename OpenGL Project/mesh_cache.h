@@ -0,0 +1,432 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <glad/glad.h>
+#include "vertex_format.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MESH_CACHE_VERSION 5
+#define MESH_CACHE_ALIGNMENT 16
+#define MESH_MAX_LODS 5
+
+// Read-only view of a whole file, mapped into memory
+class MappedFile
+{
+	const GLubyte *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#else
+	int file;
+#endif
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	bool open(const std::string &path);
+	void close();
+	const GLubyte *getData() const;
+	size_t getSize() const;
+};
+
+MappedFile::MappedFile() : data(nullptr), size(0)
+{
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#else
+	file = -1;
+#endif
+}
+MappedFile::~MappedFile() { close(); }
+bool MappedFile::open(const std::string &path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+	{
+		close();
+		return false;
+	}
+	data = (const GLubyte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	size = (size_t)file_stat.st_size;
+	void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	data = view == MAP_FAILED ? nullptr : (const GLubyte *)view;
+#endif
+	if (data == nullptr)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr)
+		munmap((void *)data, size);
+	if (file >= 0)
+		::close(file);
+	file = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+const GLubyte *MappedFile::getData() const { return data; }
+size_t MappedFile::getSize() const { return size; }
+
+
+struct MeshTextureRef
+{
+	std::string type;
+	std::string filename;
+};
+
+// Range of the index buffer holding one level of detail. Error is the
+// simplification error in object space units
+struct MeshLod
+{
+	GLuint index_offset;
+	GLuint index_count;
+	GLfloat error;
+};
+
+// Mesh as stored in the cache. Vertex and index pointers point either into
+// the mapped cache file or into the importer's own arrays
+struct CachedMesh
+{
+	const void *vertices;
+	GLuint vertex_count;
+	GLuint vertex_stride;
+	VertexFormat vertex_format;
+	VertexQuantization quantization;
+	const GLuint *indexes;
+	GLuint index_count;
+	std::vector <MeshLod> lods;
+	glm::vec3 bounds_min, bounds_max;
+	glm::vec3 bounds_center;
+	GLfloat bounds_radius;
+	std::vector <MeshTextureRef> textures;
+};
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t import_flags;
+	uint64_t source_hash;
+	uint32_t mesh_count;
+	uint32_t vertex_format;
+};
+struct MeshCacheEntry
+{
+	uint32_t vertex_count;
+	uint32_t vertex_stride;
+	uint32_t index_count;
+	uint32_t texture_count;
+	uint32_t vertex_format;
+	float position_offset[3];
+	float position_scale[3];
+	uint32_t lod_count;
+	uint64_t vertex_offset;
+	uint64_t index_offset;
+	uint64_t texture_offset;
+	float bounds_min[3];
+	float bounds_max[3];
+	float bounds_center[3];
+	float bounds_radius;
+	MeshLod lods[MESH_MAX_LODS];
+};
+
+class MeshCache
+{
+	MappedFile file;
+	std::vector <CachedMesh> meshes;
+	static const char magic[8];
+	static uint64_t align(uint64_t offset);
+	static uint64_t hashData(const GLubyte *data, size_t size, uint64_t hash);
+	bool readString(uint64_t &offset, std::string &str) const;
+public:
+	static uint64_t hashSource(const std::string &path, bool &success);
+	static bool write(const std::string &cache_path, uint64_t source_hash, GLuint import_flags, VertexFormat vertex_format, const std::vector <CachedMesh> &meshes);
+	bool open(const std::string &cache_path, uint64_t source_hash, GLuint import_flags, VertexFormat vertex_format);
+	void close();
+	const std::vector <CachedMesh> &getMeshes() const;
+};
+
+const char MeshCache::magic[8] = { 'M', 'E', 'S', 'H', 'C', 'C', 'H', '\0' };
+
+uint64_t MeshCache::align(uint64_t offset) { return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1); }
+uint64_t MeshCache::hashData(const GLubyte *data, size_t size, uint64_t hash)
+{
+	// FNV-1a
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+uint64_t MeshCache::hashSource(const std::string &path, bool &success)
+{
+	MappedFile source;
+	success = source.open(path);
+	if (!success)
+		return 0;
+	const GLubyte *data = source.getData();
+	size_t size = source.getSize();
+	uint64_t hash = hashData(data, size, 14695981039346656037ull);
+
+	// Texture references come from the material libraries, so an edited .mtl must miss the cache too.
+	// Names are taken the way the OBJ importer does: the rest of the line, relative to the .obj
+	std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+	for (size_t line = 0; line < size; )
+	{
+		size_t end = line;
+		while (end < size && data[end] != '\n')
+			++end;
+		if (end - line > 7 && memcmp(data + line, "mtllib", 6) == 0 && (data[line + 6] == ' ' || data[line + 6] == '\t'))
+		{
+			size_t first = line + 7, last = end;
+			while (first < last && isspace(data[first]))
+				++first;
+			while (last > first && isspace(data[last - 1]))
+				--last;
+			MappedFile library;
+			if (last > first && library.open(directory + std::string((const char *)data + first, last - first)))
+				hash = hashData(library.getData(), library.getSize(), hash);
+		}
+		line = end + 1;
+	}
+	return hash;
+}
+bool MeshCache::write(const std::string &cache_path, uint64_t source_hash, GLuint import_flags, VertexFormat vertex_format, const std::vector <CachedMesh> &meshes)
+{
+	MeshCacheHeader header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = MESH_CACHE_VERSION;
+	header.import_flags = import_flags;
+	header.source_hash = source_hash;
+	header.mesh_count = (uint32_t)meshes.size();
+	header.vertex_format = vertex_format;
+
+	std::vector <MeshCacheEntry> entries(meshes.size());
+	uint64_t offset = sizeof(MeshCacheHeader) + meshes.size() * sizeof(MeshCacheEntry);
+	for (int i = 0; i < meshes.size(); ++i)
+	{
+		entries[i].vertex_count = meshes[i].vertex_count;
+		entries[i].vertex_stride = meshes[i].vertex_stride;
+		entries[i].index_count = meshes[i].index_count;
+		entries[i].texture_count = (uint32_t)meshes[i].textures.size();
+		entries[i].vertex_format = meshes[i].vertex_format;
+		for (int j = 0; j < 3; ++j)
+		{
+			entries[i].position_offset[j] = meshes[i].quantization.offset[j];
+			entries[i].position_scale[j] = meshes[i].quantization.scale[j];
+		}
+		entries[i].lod_count = (uint32_t)std::min(meshes[i].lods.size(), (size_t)MESH_MAX_LODS);
+		memset(entries[i].lods, 0, sizeof(entries[i].lods));
+		for (int j = 0; j < entries[i].lod_count; ++j)
+			entries[i].lods[j] = meshes[i].lods[j];
+		for (int j = 0; j < 3; ++j)
+		{
+			entries[i].bounds_min[j] = meshes[i].bounds_min[j];
+			entries[i].bounds_max[j] = meshes[i].bounds_max[j];
+			entries[i].bounds_center[j] = meshes[i].bounds_center[j];
+		}
+		entries[i].bounds_radius = meshes[i].bounds_radius;
+		entries[i].vertex_offset = offset = align(offset);
+		offset += (uint64_t)meshes[i].vertex_count * meshes[i].vertex_stride;
+		entries[i].index_offset = offset = align(offset);
+		offset += (uint64_t)meshes[i].index_count * sizeof(GLuint);
+		entries[i].texture_offset = offset;
+		for (int j = 0; j < meshes[i].textures.size(); ++j)
+			offset += 2 * sizeof(uint32_t) + meshes[i].textures[j].type.size() + meshes[i].textures[j].filename.size();
+	}
+
+	// Written under a temporary name so a crash never leaves a truncated cache behind
+	std::string temp_path = cache_path + ".tmp";
+	std::ofstream cache_file(temp_path, std::ios::binary | std::ios::trunc);
+	if (!cache_file)
+	{
+		std::cout << "Mesh cache: unable to write " << cache_path << std::endl;
+		return false;
+	}
+	const char padding[MESH_CACHE_ALIGNMENT] = {};
+	cache_file.write((const char *)&header, sizeof(header));
+	cache_file.write((const char *)entries.data(), entries.size() * sizeof(MeshCacheEntry));
+	for (int i = 0; i < meshes.size(); ++i)
+	{
+		cache_file.write(padding, entries[i].vertex_offset - (uint64_t)cache_file.tellp());
+		cache_file.write((const char *)meshes[i].vertices, (uint64_t)meshes[i].vertex_count * meshes[i].vertex_stride);
+		cache_file.write(padding, entries[i].index_offset - (uint64_t)cache_file.tellp());
+		cache_file.write((const char *)meshes[i].indexes, (uint64_t)meshes[i].index_count * sizeof(GLuint));
+		for (int j = 0; j < meshes[i].textures.size(); ++j)
+		{
+			const std::string *strings[2] = { &meshes[i].textures[j].type, &meshes[i].textures[j].filename };
+			for (int k = 0; k < 2; ++k)
+			{
+				uint32_t length = (uint32_t)strings[k]->size();
+				cache_file.write((const char *)&length, sizeof(length));
+				cache_file.write(strings[k]->data(), length);
+			}
+		}
+	}
+	cache_file.close();
+	if (!cache_file)
+	{
+		remove(temp_path.c_str());
+		return false;
+	}
+	remove(cache_path.c_str());
+	return rename(temp_path.c_str(), cache_path.c_str()) == 0;
+}
+bool MeshCache::readString(uint64_t &offset, std::string &str) const
+{
+	uint32_t length;
+	if (offset + sizeof(length) > file.getSize())
+		return false;
+	memcpy(&length, file.getData() + offset, sizeof(length));
+	offset += sizeof(length);
+	if (offset + length > file.getSize())
+		return false;
+	str.assign((const char *)file.getData() + offset, length);
+	offset += length;
+	return true;
+}
+bool MeshCache::open(const std::string &cache_path, uint64_t source_hash, GLuint import_flags, VertexFormat vertex_format)
+{
+	close();
+	if (!file.open(cache_path))
+		return false;
+
+	MeshCacheHeader header;
+	if (file.getSize() < sizeof(header))
+	{
+		close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != MESH_CACHE_VERSION ||
+		header.import_flags != import_flags || header.source_hash != source_hash || header.vertex_format != vertex_format ||
+		sizeof(header) + (uint64_t)header.mesh_count * sizeof(MeshCacheEntry) > file.getSize())
+	{
+		close();
+		return false;
+	}
+
+	const MeshCacheEntry *entries = (const MeshCacheEntry *)(file.getData() + sizeof(header));
+	for (int i = 0; i < header.mesh_count; ++i)
+	{
+		const MeshCacheEntry &entry = entries[i];
+		CachedMesh mesh;
+		if (entry.vertex_offset + (uint64_t)entry.vertex_count * entry.vertex_stride > file.getSize() ||
+			entry.index_offset + (uint64_t)entry.index_count * sizeof(GLuint) > file.getSize() ||
+			entry.vertex_format != vertex_format || entry.vertex_stride != getVertexStride(vertex_format) ||
+			entry.lod_count == 0 || entry.lod_count > MESH_MAX_LODS)
+		{
+			close();
+			return false;
+		}
+		mesh.vertices = file.getData() + entry.vertex_offset;
+		mesh.vertex_count = entry.vertex_count;
+		mesh.vertex_stride = entry.vertex_stride;
+		mesh.vertex_format = vertex_format;
+		for (int j = 0; j < 3; ++j)
+		{
+			mesh.quantization.offset[j] = entry.position_offset[j];
+			mesh.quantization.scale[j] = entry.position_scale[j];
+		}
+		mesh.indexes = (const GLuint *)(file.getData() + entry.index_offset);
+		mesh.index_count = entry.index_count;
+		// Indexes go straight to the GPU, an out of range one would read past the vertex buffer
+		for (GLuint j = 0; j < mesh.index_count; ++j)
+			if (mesh.indexes[j] >= mesh.vertex_count)
+			{
+				close();
+				return false;
+			}
+		mesh.lods.assign(entry.lods, entry.lods + entry.lod_count);
+		for (int j = 0; j < mesh.lods.size(); ++j)
+			if ((uint64_t)mesh.lods[j].index_offset + mesh.lods[j].index_count > entry.index_count)
+			{
+				close();
+				return false;
+			}
+		for (int j = 0; j < 3; ++j)
+		{
+			mesh.bounds_min[j] = entry.bounds_min[j];
+			mesh.bounds_max[j] = entry.bounds_max[j];
+			mesh.bounds_center[j] = entry.bounds_center[j];
+		}
+		mesh.bounds_radius = entry.bounds_radius;
+
+		uint64_t offset = entry.texture_offset;
+		mesh.textures.resize(entry.texture_count);
+		for (int j = 0; j < entry.texture_count; ++j)
+		{
+			if (!readString(offset, mesh.textures[j].type) || !readString(offset, mesh.textures[j].filename))
+			{
+				close();
+				return false;
+			}
+		}
+		meshes.push_back(mesh);
+	}
+	return true;
+}
+void MeshCache::close()
+{
+	meshes.clear();
+	file.close();
+}
+const std::vector <CachedMesh> &MeshCache::getMeshes() const { return meshes; }
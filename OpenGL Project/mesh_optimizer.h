@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "vertex_format.h"
+
+#define VERTEX_CACHE_SIZE 32
+#define VERTEX_CACHE_ANALYZE_SIZE 16
+
+struct VertexCacheStats
+{
+	GLfloat acmr;	// Vertex shader invocations per triangle
+	GLfloat atvr;	// Vertex shader invocations per referenced vertex, 1.0 is optimal
+};
+
+VertexCacheStats analyzeVertexCache(const std::vector <GLuint> &indexes, size_t vertex_count, GLuint cache_size = VERTEX_CACHE_ANALYZE_SIZE);
+void optimizeVertexCache(std::vector <GLuint> &indexes, size_t vertex_count);
+void optimizeOverdraw(std::vector <GLuint> &indexes, const std::vector <Vertex> &vertices, GLfloat threshold = 1.05f);
+void optimizeVertexFetch(std::vector <GLuint> &indexes, std::vector <Vertex> &vertices);
+
+// Simulates a FIFO post-transform cache, the usual model of the hardware
+VertexCacheStats analyzeVertexCache(const std::vector <GLuint> &indexes, size_t vertex_count, GLuint cache_size)
+{
+	VertexCacheStats stats = { 0.0f, 0.0f };
+	if (indexes.empty())
+		return stats;
+
+	std::vector <size_t> timestamps(vertex_count, 0);
+	std::vector <bool> referenced(vertex_count, false);
+	size_t time = cache_size + 1, misses = 0, unique = 0;
+	for (size_t i = 0; i < indexes.size(); ++i)
+	{
+		GLuint index = indexes[i];
+		if (time - timestamps[index] > cache_size)
+		{
+			timestamps[index] = time++;
+			++misses;
+		}
+		if (!referenced[index])
+		{
+			referenced[index] = true;
+			++unique;
+		}
+	}
+	stats.acmr = (GLfloat)misses / (indexes.size() / 3);
+	stats.atvr = (GLfloat)misses / unique;
+	return stats;
+}
+
+namespace forsyth
+{
+	const GLfloat cache_decay_power = 1.5f;
+	const GLfloat last_triangle_score = 0.75f;
+	const GLfloat valence_boost_scale = 2.0f;
+	const GLfloat valence_boost_power = 0.5f;
+
+	GLfloat vertexScore(int cache_position, GLuint remaining_triangles)
+	{
+		if (remaining_triangles == 0)
+			return -1.0f;
+
+		GLfloat score = 0.0f;
+		if (cache_position >= 0)
+		{
+			// The last triangle's vertices get a fixed score so the next one isn't biased towards them
+			if (cache_position < 3)
+				score = last_triangle_score;
+			else
+				score = pow(1.0f - (GLfloat)(cache_position - 3) / (VERTEX_CACHE_SIZE - 3), cache_decay_power);
+		}
+		// Vertices with few triangles left are finished first so they can leave the cache
+		return score + valence_boost_scale * pow((GLfloat)remaining_triangles, -valence_boost_power);
+	}
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation: triangles are emitted
+// greedily by the score of their vertices in a simulated LRU cache
+void optimizeVertexCache(std::vector <GLuint> &indexes, size_t vertex_count)
+{
+	size_t triangle_count = indexes.size() / 3;
+	if (triangle_count == 0)
+		return;
+
+	// Triangles adjacent to each vertex, packed in one array
+	std::vector <GLuint> adjacency_offsets(vertex_count + 1, 0), remaining(vertex_count, 0), adjacency(triangle_count * 3);
+	for (size_t i = 0; i < indexes.size(); ++i)
+		++remaining[indexes[i]];
+	for (size_t i = 0; i < vertex_count; ++i)
+		adjacency_offsets[i + 1] = adjacency_offsets[i] + remaining[i];
+	std::vector <GLuint> filled(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+	for (size_t i = 0; i < indexes.size(); ++i)
+		adjacency[filled[indexes[i]]++] = (GLuint)(i / 3);
+
+	std::vector <int> cache_positions(vertex_count, -1);
+	std::vector <GLfloat> vertex_scores(vertex_count), triangle_scores(triangle_count, 0.0f);
+	for (size_t i = 0; i < vertex_count; ++i)
+		vertex_scores[i] = forsyth::vertexScore(-1, remaining[i]);
+	for (size_t i = 0; i < triangle_count; ++i)
+		for (int j = 0; j < 3; ++j)
+			triangle_scores[i] += vertex_scores[indexes[i * 3 + j]];
+
+	std::vector <bool> emitted(triangle_count, false);
+	std::vector <GLuint> result, cache, new_cache;
+	result.reserve(indexes.size());
+	cache.reserve(VERTEX_CACHE_SIZE + 3);
+	new_cache.reserve(VERTEX_CACHE_SIZE + 3);
+
+	size_t best_triangle = 0, input_cursor = 0;
+	for (size_t i = 1; i < triangle_count; ++i)
+		if (triangle_scores[i] > triangle_scores[best_triangle])
+			best_triangle = i;
+
+	for (size_t emitted_count = 0; emitted_count < triangle_count; ++emitted_count)
+	{
+		if (best_triangle == SIZE_MAX)
+		{
+			// Nothing in the cache is connected to unemitted triangles, continue from the input order
+			while (emitted[input_cursor])
+				++input_cursor;
+			best_triangle = input_cursor;
+		}
+
+		const GLuint *triangle = &indexes[best_triangle * 3];
+		emitted[best_triangle] = true;
+		new_cache.clear();
+		for (int j = 0; j < 3; ++j)
+		{
+			GLuint vertex = triangle[j];
+			result.push_back(vertex);
+			new_cache.push_back(vertex);
+
+			GLuint *begin = &adjacency[adjacency_offsets[vertex]], *end = begin + remaining[vertex];
+			*std::find(begin, end, (GLuint)best_triangle) = *(end - 1);
+			--remaining[vertex];
+		}
+		for (size_t j = 0; j < cache.size(); ++j)
+			if (cache[j] != triangle[0] && cache[j] != triangle[1] && cache[j] != triangle[2])
+				new_cache.push_back(cache[j]);
+		cache.swap(new_cache);
+
+		// Rescore everything the cache touched, vertices pushed out of it included
+		best_triangle = SIZE_MAX;
+		GLfloat best_score = -1.0f;
+		for (size_t j = 0; j < cache.size(); ++j)
+		{
+			GLuint vertex = cache[j];
+			cache_positions[vertex] = j < VERTEX_CACHE_SIZE ? (int)j : -1;
+			GLfloat score = forsyth::vertexScore(cache_positions[vertex], remaining[vertex]);
+			GLfloat delta = score - vertex_scores[vertex];
+			vertex_scores[vertex] = score;
+			for (GLuint k = 0; k < remaining[vertex]; ++k)
+			{
+				GLuint adjacent = adjacency[adjacency_offsets[vertex] + k];
+				triangle_scores[adjacent] += delta;
+				if (triangle_scores[adjacent] > best_score)
+				{
+					best_score = triangle_scores[adjacent];
+					best_triangle = adjacent;
+				}
+			}
+		}
+		if (cache.size() > VERTEX_CACHE_SIZE)
+			cache.resize(VERTEX_CACHE_SIZE);
+	}
+	indexes.swap(result);
+}
+
+// Splits the cache-optimised order into clusters and draws the outward facing
+// ones first, so early-Z rejects more of the rest. A cluster ends where the
+// cache is cold anyway (hard boundary) or where its own ACMR is within
+// threshold of the whole run (soft boundary)
+void optimizeOverdraw(std::vector <GLuint> &indexes, const std::vector <Vertex> &vertices, GLfloat threshold)
+{
+	size_t triangle_count = indexes.size() / 3;
+	if (triangle_count == 0)
+		return;
+
+	std::vector <size_t> timestamps(vertices.size(), 0);
+	size_t time = VERTEX_CACHE_ANALYZE_SIZE + 1;
+	auto triangleMisses = [&](size_t triangle)
+	{
+		GLuint misses = 0;
+		for (int j = 0; j < 3; ++j)
+		{
+			GLuint index = indexes[triangle * 3 + j];
+			if (time - timestamps[index] > VERTEX_CACHE_ANALYZE_SIZE)
+			{
+				timestamps[index] = time++;
+				++misses;
+			}
+		}
+		return misses;
+	};
+
+	// The first cluster starts at 0 even when the first triangle is degenerate and misses fewer than 3
+	std::vector <size_t> hard_boundaries(1, 0);
+	for (size_t i = 0; i < triangle_count; ++i)
+		if (triangleMisses(i) == 3 && i > 0)
+			hard_boundaries.push_back(i);
+	hard_boundaries.push_back(triangle_count);
+
+	std::vector <size_t> clusters;
+	for (size_t i = 0; i + 1 < hard_boundaries.size(); ++i)
+	{
+		size_t start = hard_boundaries[i], end = hard_boundaries[i + 1];
+		time += VERTEX_CACHE_ANALYZE_SIZE + 1;
+		GLuint cluster_misses = 0;
+		for (size_t j = start; j < end; ++j)
+			cluster_misses += triangleMisses(j);
+		GLfloat cluster_threshold = threshold * cluster_misses / (end - start);
+
+		time += VERTEX_CACHE_ANALYZE_SIZE + 1;
+		clusters.push_back(start);
+		GLuint running_misses = 0, running_triangles = 0;
+		for (size_t j = start; j < end; ++j)
+		{
+			running_misses += triangleMisses(j);
+			++running_triangles;
+			if (j + 1 < end && (GLfloat)running_misses / running_triangles <= cluster_threshold)
+			{
+				clusters.push_back(j + 1);
+				running_misses = running_triangles = 0;
+				time += VERTEX_CACHE_ANALYZE_SIZE + 1;
+			}
+		}
+	}
+	clusters.push_back(triangle_count);
+
+	glm::vec3 mesh_centroid(0.0f);
+	for (size_t i = 0; i < indexes.size(); ++i)
+		mesh_centroid += vertices[indexes[i]].position;
+	mesh_centroid /= (GLfloat)indexes.size();
+
+	struct Cluster
+	{
+		size_t start, end;
+		GLfloat sort_key;
+	};
+	std::vector <Cluster> sorted_clusters;
+	for (size_t i = 0; i + 1 < clusters.size(); ++i)
+	{
+		glm::vec3 centroid(0.0f), normal(0.0f);
+		GLfloat area = 0.0f;
+		for (size_t j = clusters[i]; j < clusters[i + 1]; ++j)
+		{
+			glm::vec3 a = vertices[indexes[j * 3]].position, b = vertices[indexes[j * 3 + 1]].position, c = vertices[indexes[j * 3 + 2]].position;
+			glm::vec3 triangle_normal = glm::cross(b - a, c - a);
+			GLfloat triangle_area = glm::length(triangle_normal);
+			centroid += (a + b + c) * (triangle_area / 3.0f);
+			normal += triangle_normal;
+			area += triangle_area;
+		}
+		Cluster cluster = { clusters[i], clusters[i + 1], 0.0f };
+		GLfloat normal_length = glm::length(normal);
+		if (area > 0.0f && normal_length > 0.0f)
+			cluster.sort_key = glm::dot(centroid / area - mesh_centroid, normal / normal_length);
+		sorted_clusters.push_back(cluster);
+	}
+	std::stable_sort(sorted_clusters.begin(), sorted_clusters.end(), [](const Cluster &a, const Cluster &b) { return a.sort_key > b.sort_key; });
+
+	std::vector <GLuint> result;
+	result.reserve(indexes.size());
+	for (size_t i = 0; i < sorted_clusters.size(); ++i)
+		result.insert(result.end(), indexes.begin() + sorted_clusters[i].start * 3, indexes.begin() + sorted_clusters[i].end * 3);
+	indexes.swap(result);
+}
+
+// Stores vertices in the order they are first used and drops unreferenced ones
+void optimizeVertexFetch(std::vector <GLuint> &indexes, std::vector <Vertex> &vertices)
+{
+	std::vector <GLuint> remap(vertices.size(), UINT32_MAX);
+	std::vector <Vertex> result;
+	result.reserve(vertices.size());
+	for (size_t i = 0; i < indexes.size(); ++i)
+	{
+		GLuint &index = remap[indexes[i]];
+		if (index == UINT32_MAX)
+		{
+			index = (GLuint)result.size();
+			result.push_back(vertices[indexes[i]]);
+		}
+		indexes[i] = index;
+	}
+	vertices.swap(result);
+}
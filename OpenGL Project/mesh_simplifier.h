@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "vertex_format.h"
+
+// Plane distance quadric, weighted by triangle area so evaluate() returns the
+// mean squared distance to the planes accumulated in it
+struct Quadric
+{
+	double a2, b2, c2, d2, ab, ac, ad, bc, bd, cd;
+	double weight;
+	void addPlane(const glm::vec3 &normal, GLfloat distance, double plane_weight);
+	void add(const Quadric &other);
+	double evaluate(const glm::vec3 &point) const;
+};
+
+std::vector <GLuint> simplifyMesh(const std::vector <GLuint> &indexes, const std::vector <Vertex> &vertices, size_t target_index_count, GLfloat &error);
+
+void Quadric::addPlane(const glm::vec3 &normal, GLfloat distance, double plane_weight)
+{
+	double a = normal.x, b = normal.y, c = normal.z, d = distance;
+	a2 += a * a * plane_weight; b2 += b * b * plane_weight; c2 += c * c * plane_weight; d2 += d * d * plane_weight;
+	ab += a * b * plane_weight; ac += a * c * plane_weight; ad += a * d * plane_weight;
+	bc += b * c * plane_weight; bd += b * d * plane_weight; cd += c * d * plane_weight;
+	weight += plane_weight;
+}
+void Quadric::add(const Quadric &other)
+{
+	a2 += other.a2; b2 += other.b2; c2 += other.c2; d2 += other.d2;
+	ab += other.ab; ac += other.ac; ad += other.ad;
+	bc += other.bc; bd += other.bd; cd += other.cd;
+	weight += other.weight;
+}
+double Quadric::evaluate(const glm::vec3 &point) const
+{
+	double x = point.x, y = point.y, z = point.z;
+	double result = x * x * a2 + y * y * b2 + z * z * c2 + d2 +
+		2.0 * (x * y * ab + x * z * ac + y * z * bc + x * ad + y * bd + z * cd);
+	return weight > 0.0 ? fabs(result) / weight : 0.0;
+}
+
+namespace simplifier
+{
+	struct Collapse
+	{
+		GLuint from, to;
+		double cost;
+	};
+
+	// Moving from onto to must not turn any of the surviving triangles around
+	bool flipsTriangles(const std::vector <GLuint> &indexes, const std::vector <Vertex> &vertices,
+		const std::vector <GLuint> &adjacency_offsets, const std::vector <GLuint> &adjacency, GLuint from, GLuint to)
+	{
+		for (GLuint i = adjacency_offsets[from]; i < adjacency_offsets[from + 1]; ++i)
+		{
+			const GLuint *triangle = &indexes[adjacency[i] * 3];
+			if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+				continue;
+			glm::vec3 before[3], after[3];
+			for (int j = 0; j < 3; ++j)
+			{
+				before[j] = vertices[triangle[j]].position;
+				after[j] = vertices[triangle[j] == from ? to : triangle[j]].position;
+			}
+			glm::vec3 normal_before = glm::cross(before[1] - before[0], before[2] - before[0]);
+			glm::vec3 normal_after = glm::cross(after[1] - after[0], after[2] - after[0]);
+			if (glm::dot(normal_before, normal_after) <= 0.25f * glm::length(normal_before) * glm::length(normal_after))
+				return true;
+		}
+		return false;
+	}
+}
+
+// Greedy quadric error edge collapse. Vertices only move onto existing ones,
+// so the result indexes the same vertex buffer as the source. Connectivity is
+// taken from positions, so a vertex split for its UV or normal is a seam and
+// not a border. Seam vertices and vertices on open edges are never moved, so
+// the mesh neither tears nor loses its attributes
+std::vector <GLuint> simplifyMesh(const std::vector <GLuint> &source, const std::vector <Vertex> &vertices, size_t target_index_count, GLfloat &error)
+{
+	std::vector <GLuint> indexes(source);
+	size_t vertex_count = vertices.size();
+	double max_cost = 0.0;
+
+	// Every vertex maps onto the first one with the same position
+	std::vector <GLuint> order(vertex_count), welded(vertex_count);
+	for (size_t i = 0; i < vertex_count; ++i)
+		order[i] = (GLuint)i;
+	std::sort(order.begin(), order.end(), [&vertices](GLuint a, GLuint b)
+	{
+		const glm::vec3 &pa = vertices[a].position, &pb = vertices[b].position;
+		return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+	});
+	std::vector <bool> locked(vertex_count, false);
+	for (size_t i = 0; i < vertex_count; ++i)
+	{
+		welded[order[i]] = order[i];
+		if (i && vertices[order[i]].position == vertices[order[i - 1]].position)
+		{
+			welded[order[i]] = welded[order[i - 1]];
+			locked[order[i]] = locked[order[i - 1]] = true;
+		}
+	}
+
+	std::unordered_set <uint64_t> edges;
+	for (size_t i = 0; i < indexes.size(); i += 3)
+		for (int j = 0; j < 3; ++j)
+			edges.insert((uint64_t)welded[indexes[i + j]] << 32 | welded[indexes[i + (j + 1) % 3]]);
+	std::vector <bool> border(vertex_count, false);
+	for (size_t i = 0; i < indexes.size(); i += 3)
+		for (int j = 0; j < 3; ++j)
+		{
+			GLuint a = welded[indexes[i + j]], b = welded[indexes[i + (j + 1) % 3]];
+			if (edges.find((uint64_t)b << 32 | a) == edges.end())
+				border[a] = border[b] = true;
+		}
+	for (size_t i = 0; i < vertex_count; ++i)
+		if (border[welded[i]])
+			locked[i] = true;
+
+	std::vector <Quadric> quadrics(vertex_count, Quadric());
+	for (size_t i = 0; i < indexes.size(); i += 3)
+	{
+		glm::vec3 a = vertices[indexes[i]].position, b = vertices[indexes[i + 1]].position, c = vertices[indexes[i + 2]].position;
+		glm::vec3 normal = glm::cross(b - a, c - a);
+		GLfloat area = glm::length(normal);
+		if (area == 0.0f)
+			continue;
+		normal /= area;
+		for (int j = 0; j < 3; ++j)
+			quadrics[indexes[i + j]].addPlane(normal, -glm::dot(normal, a), area);
+	}
+
+	std::vector <simplifier::Collapse> collapses;
+	std::vector <GLuint> adjacency_offsets, adjacency, remap(vertex_count);
+	std::vector <bool> touched(vertex_count);
+	while (indexes.size() > target_index_count)
+	{
+		// Triangles around each vertex, for the flip test
+		adjacency_offsets.assign(vertex_count + 1, 0);
+		for (size_t i = 0; i < indexes.size(); ++i)
+			++adjacency_offsets[indexes[i] + 1];
+		for (size_t i = 0; i < vertex_count; ++i)
+			adjacency_offsets[i + 1] += adjacency_offsets[i];
+		adjacency.resize(indexes.size());
+		std::vector <GLuint> filled(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+		for (size_t i = 0; i < indexes.size(); ++i)
+			adjacency[filled[indexes[i]]++] = (GLuint)(i / 3);
+
+		collapses.clear();
+		for (size_t i = 0; i < indexes.size(); i += 3)
+			for (int j = 0; j < 3; ++j)
+			{
+				GLuint a = indexes[i + j], b = indexes[i + (j + 1) % 3];
+				if (!locked[a])
+				{
+					simplifier::Collapse collapse = { a, b, quadrics[a].evaluate(vertices[b].position) };
+					collapses.push_back(collapse);
+				}
+				if (!locked[b])
+				{
+					simplifier::Collapse collapse = { b, a, quadrics[b].evaluate(vertices[a].position) };
+					collapses.push_back(collapse);
+				}
+			}
+		std::sort(collapses.begin(), collapses.end(), [](const simplifier::Collapse &a, const simplifier::Collapse &b) { return a.cost < b.cost; });
+
+		// Each pass collapses independent edges only, the neighbourhood of a collapse is frozen until the next one
+		for (size_t i = 0; i < vertex_count; ++i)
+			remap[i] = (GLuint)i;
+		touched.assign(vertex_count, false);
+		size_t removed_indexes = 0, needed_indexes = indexes.size() - target_index_count;
+		for (size_t i = 0; i < collapses.size() && removed_indexes < needed_indexes; ++i)
+		{
+			const simplifier::Collapse &collapse = collapses[i];
+			if (touched[collapse.from] || touched[collapse.to] ||
+				simplifier::flipsTriangles(indexes, vertices, adjacency_offsets, adjacency, collapse.from, collapse.to))
+				continue;
+
+			for (GLuint j = adjacency_offsets[collapse.from]; j < adjacency_offsets[collapse.from + 1]; ++j)
+			{
+				const GLuint *triangle = &indexes[adjacency[j] * 3];
+				if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+					removed_indexes += 3;
+				for (int k = 0; k < 3; ++k)
+					touched[triangle[k]] = true;
+			}
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to].add(quadrics[collapse.from]);
+			max_cost = std::max(max_cost, collapse.cost);
+		}
+		if (removed_indexes == 0)
+			break;
+
+		size_t write = 0;
+		for (size_t i = 0; i < indexes.size(); i += 3)
+		{
+			GLuint a = remap[indexes[i]], b = remap[indexes[i + 1]], c = remap[indexes[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			indexes[write++] = a;
+			indexes[write++] = b;
+			indexes[write++] = c;
+		}
+		indexes.resize(write);
+	}
+
+	error = (GLfloat)sqrt(max_cost);
+	return indexes;
+}
@@ -1,122 +1,357 @@
 #pragma once
 
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
 #include <vector>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include "shader.h"
+#include "shader_permutations.h"
 #include "texture.h"
+#include "texture_registry.h"
+#include "texture_array.h"
+#include "mesh_cache.h"
+#include "vertex_format.h"
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+#include "geometry_arena.h"
+#include "instancing.h"
 
 using namespace std;
 
-struct Vertex 
-{
-    glm::vec3 position;
-    glm::vec3 normal;
-    glm::vec3 tangent;
-    glm::vec3 bitangent;
-    glm::vec2 tex_coords;
-};
+// Defined in render_queue.h
+enum RenderPass : GLuint;
+class RenderQueue;
+// Defined in visibility_buffer.h
+class VisibilityBuffer;
 
-class Mesh 
+struct MeshData
 {
     vector <Vertex> vertices;
+    vector <GLubyte> packed_vertices;
+    VertexQuantization quantization;
     vector <GLuint> indexes;
-    vector <Texture2D> textures;
-    GLuint vertex_array, vertex_buffer, element_buffer;
-public:
-    Mesh(vector<Vertex> vertices, vector<GLuint> indexes, vector<Texture2D> textures);
-    void render(Shader &shader);
+    vector <MeshLod> lods;
+    glm::vec3 bounds_min, bounds_max;
+    glm::vec3 bounds_center;
+    GLfloat bounds_radius;
+    vector <MeshTextureRef> textures;
 };
 
-Mesh::Mesh(vector<Vertex> vertices, vector<GLuint> indexes, vector<Texture2D> textures) : vertices(vertices), indexes(indexes), textures(textures)
+struct MeshTexture
 {
-    glGenVertexArrays(1, &vertex_array);
-    glGenBuffers(1, &vertex_buffer);
-    glGenBuffers(1, &element_buffer);
-
-    glBindVertexArray(vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexes.size() * sizeof(GLuint), &indexes[0], GL_STATIC_DRAW);
-
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(3 * sizeof(GLfloat)));
+    TextureHandle texture;
+    string type;
+    UniformName sampler;    // Resolved when the mesh is created so drawing never builds strings
+    GLuint fallback;
+    mutable TextureArrayLayer array_layer;    // Filled in on the first draw after the texture is ready
+};
 
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(6 * sizeof(GLfloat)));
+// Camera parameters for picking a level of detail by its error on screen
+struct LodSelector
+{
+    glm::mat4 model, view, projection;
+    GLfloat viewport_height;
+    GLfloat max_pixel_error;
+};
 
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(9 * sizeof(GLfloat)));
+class Mesh 
+{
+    vector <MeshLod> lods;
+    glm::vec3 bounds_min, bounds_max;
+    glm::vec3 bounds_center;
+    GLfloat bounds_radius;
+    VertexFormat vertex_format;
+    VertexQuantization quantization;
+    vector <MeshTexture> textures;
+    ShaderFeatures features;
+    GLuint material_key;    // 16-bit digest of the texture set, for sorting draws
+    GLuint geometry;
+    static int getArraySlot(const string &type);
+    void bindTextureArrays(Shader &shader) const;
+public:
+    Mesh(const CachedMesh &mesh, vector<MeshTexture> textures, bool texture_arrays);
+    ShaderFeatures getFeatures() const;
+    GLuint getMaterialKey() const;
+    glm::vec3 getBoundsCenter() const;
+    glm::vec3 getBoundsMin() const;
+    glm::vec3 getBoundsMax() const;
+    GLuint getGeometry() const;
+    const MeshLod &getLod(GLuint lod) const;
+    const VertexQuantization &getQuantization() const;
+    glm::vec4 getArrayLayers() const;
+    GLuint selectLod(const LodSelector &selector) const;
+    void bindMaterial(Shader &shader) const;
+    void render(Shader &shader, GLuint lod) const;
+    void renderInstanced(Shader &shader, const InstanceBuffer &instances, GLuint lod) const;
+    void release();
+};
 
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(12 * sizeof(GLfloat)));
+Mesh::Mesh(const CachedMesh &mesh, vector<MeshTexture> textures, bool texture_arrays = false) : 
+    lods(mesh.lods), bounds_min(mesh.bounds_min), bounds_max(mesh.bounds_max), bounds_center(mesh.bounds_center), bounds_radius(mesh.bounds_radius), vertex_format(mesh.vertex_format), quantization(mesh.quantization), textures(textures)
+{
+    features = vertex_format != VERTEX_FORMAT_FULL ? SHADER_PACKED_VERTEX : 0;
+    if (texture_arrays)
+        features |= SHADER_TEXTURE_ARRAYS;
+    int dif_count = 0, spec_count = 0, norm_count = 0, emi_count = 0;
+    for (int i = 0; i < this->textures.size(); ++i)
+    {
+        MeshTexture &texture = this->textures[i];
+        if (texture.type == "diffuse_map")
+            texture.sampler = "material." + texture.type + "[" + to_string(dif_count++) + "]";
+        else if (texture.type == "specular_map")
+        {
+            texture.sampler = "material." + texture.type + "[" + to_string(spec_count++) + "]";
+            features |= SHADER_SPECULAR_MAP;
+        }
+        else if (texture.type == "normal_map")
+        {
+            texture.sampler = "material." + texture.type + "[" + to_string(norm_count++) + "]";
+            features |= SHADER_NORMAL_MAP;
+        }
+        else if (texture.type == "emission_map")
+        {
+            texture.sampler = "material." + texture.type + "[" + to_string(emi_count++) + "]";
+            features |= SHADER_EMISSION_MAP;
+        }
+        texture.fallback = Texture2D::getFallback(texture.type);
+    }
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < this->textures.size(); ++i)
+        hash = (hash ^ this->textures[i].texture->getID()) * 16777619u;
+    material_key = (hash ^ hash >> 16) & 0xffff;
+    geometry = GeometryArena::instance().allocate(vertex_format, mesh.vertices, mesh.vertex_count, mesh.indexes, mesh.index_count);
+}
+ShaderFeatures Mesh::getFeatures() const { return features; }
+GLuint Mesh::getMaterialKey() const
+{
+    if (!(features & SHADER_TEXTURE_ARRAYS))
+        return material_key;
+    // Meshes whose maps sit in the same arrays share bindings and sort together
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < textures.size(); ++i)
+        hash = (hash ^ (textures[i].array_layer.layer < 0 ? 0xffff : textures[i].array_layer.array)) * 16777619u;
+    return (hash ^ hash >> 16) & 0xffff;
+}
+glm::vec3 Mesh::getBoundsCenter() const { return bounds_center; }
+glm::vec3 Mesh::getBoundsMin() const { return bounds_min; }
+glm::vec3 Mesh::getBoundsMax() const { return bounds_max; }
+GLuint Mesh::getGeometry() const { return geometry; }
+// Anything past the coarsest level picks the coarsest, as for instances
+const MeshLod &Mesh::getLod(GLuint lod) const { return lods[min(lod, (GLuint)lods.size() - 1)]; }
+const VertexQuantization &Mesh::getQuantization() const { return quantization; }
+GLuint Mesh::selectLod(const LodSelector &selector) const
+{
+    GLfloat scale = max(glm::length(glm::vec3(selector.model[0])), max(glm::length(glm::vec3(selector.model[1])), glm::length(glm::vec3(selector.model[2]))));
+    glm::vec3 center = glm::vec3(selector.view * selector.model * glm::vec4(bounds_center, 1.0f));
+    GLfloat distance = glm::length(center) - bounds_radius * scale;
+    if (distance <= 0.0f)
+        return 0;
 
-    glBindVertexArray(0);
+    // Coarsest level whose error still projects to less than the allowed number of pixels
+    GLfloat pixels_per_unit = scale * selector.projection[1][1] * selector.viewport_height * 0.5f / distance;
+    GLuint lod = 0;
+    while (lod + 1 < lods.size() && lods[lod + 1].error * pixels_per_unit <= selector.max_pixel_error)
+        ++lod;
+    return lod;
 }
-void Mesh::render(Shader &shader)
+int Mesh::getArraySlot(const string &type)
 {
-    string type;
-    int dif_count = 0, spec_count = 0, norm_count = 0, emi_count = 0;
+    if (type == "diffuse_map")
+        return 0;
+    if (type == "specular_map")
+        return 1;
+    if (type == "normal_map")
+        return 2;
+    if (type == "emission_map")
+        return 3;
+    return -1;
+}
+// Layer of the first map of each type in its array, in the order of units 0-3.
+// Maps still loading get a negative layer and the shader's fallback
+glm::vec4 Mesh::getArrayLayers() const
+{
+    glm::vec4 layers(-1.0f);
     for (int i = 0; i < textures.size(); ++i)
     {
-        type = textures[i].getType();
-        if (type == "diffuse_map")
-            shader.setUniform(("material." + type + "[" + to_string(dif_count++) + "]").c_str(), i);
-        else if (type == "specular_map")
-            shader.setUniform(("material." + type + "[" + to_string(spec_count++) + "]").c_str(), i);
-        else if (type == "normal_map")
-            shader.setUniform(("material." + type + "[" + to_string(norm_count++) + "]").c_str(), i);
-        else if (type == "emission_map")
-            shader.setUniform(("material." + type + "[" + to_string(emi_count++) + "]").c_str(), i);
-        textures[i].active(GL_TEXTURE0 + i);
+        int slot = getArraySlot(textures[i].type);
+        if (slot < 0 || layers[slot] >= 0.0f)
+            continue;
+        if (textures[i].array_layer.layer < 0)
+            textures[i].array_layer = TextureArrayRegistry::instance().getLayer(textures[i].texture);
+        if (textures[i].array_layer.layer >= 0)
+            layers[slot] = (GLfloat)textures[i].array_layer.layer;
     }
-
-    glBindVertexArray(vertex_array);
-    glDrawElements(GL_TRIANGLES, indexes.size(), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-
+    return layers;
+}
+// One array per map type on units 0-3, the first map of each type is used as in the 2D path
+void Mesh::bindTextureArrays(Shader &shader) const
+{
+    static const UniformName samplers[4] = { "material.diffuse_array"_uniform, "material.specular_array"_uniform,
+        "material.normal_array"_uniform, "material.emission_array"_uniform };
+    glm::vec4 layers = getArrayLayers();
+    bool bound[4] = {};
     for (int i = 0; i < textures.size(); ++i)
     {
-        glActiveTexture(GL_TEXTURE0 + i);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        int slot = getArraySlot(textures[i].type);
+        if (slot < 0 || bound[slot] || textures[i].array_layer.layer < 0)
+            continue;
+        GLState::instance().bindTexture(GL_TEXTURE0 + slot, GL_TEXTURE_2D_ARRAY, TextureArrayRegistry::instance().getTexture(textures[i].array_layer.array));
+        bound[slot] = true;
     }
+    for (int i = 0; i < 4; ++i)
+        shader.setUniform(samplers[i], i);
+    shader.setUniform("material.layers"_uniform, layers);
+}
+void Mesh::bindMaterial(Shader &shader) const
+{
+    if (features & SHADER_TEXTURE_ARRAYS)
+        bindTextureArrays(shader);
+    else
+        for (int i = 0; i < textures.size(); ++i)
+        {
+            shader.setUniform(textures[i].sampler, i);
+            if (textures[i].texture->isReady())
+                textures[i].texture->active(GL_TEXTURE0 + i);
+            else
+                GLState::instance().bindTexture(GL_TEXTURE0 + i, GL_TEXTURE_2D, textures[i].fallback);
+        }
+
+    shader.setUniform("position_offset"_uniform, quantization.offset);
+    shader.setUniform("position_scale"_uniform, quantization.scale);
+}
+void Mesh::render(Shader &shader, GLuint lod = 0) const
+{
+    // Textures stay bound, the next mesh overwrites only the units that differ
+    bindMaterial(shader);
+    GeometryArena::instance().draw(geometry, lods[lod].index_offset, lods[lod].index_count);
+}
+// Instances share one level, anything past the coarsest one picks the coarsest
+void Mesh::renderInstanced(Shader &shader, const InstanceBuffer &instances, GLuint lod = 0) const
+{
+    if (instances.getCount() == 0)
+        return;
+    lod = min(lod, (GLuint)lods.size() - 1);
+    bindMaterial(shader);
+    GeometryArena::instance().drawInstanced(geometry, lods[lod].index_offset, lods[lod].index_count, instances.getBuffer(), instances.getCount());
 }
+void Mesh::release() { GeometryArena::instance().free(geometry); }
 
 
+// Import results shared between the loading thread and the GL thread.
+// Vertex/index pointers of the published meshes stay valid until the model
+// has uploaded all of them
+struct ModelLoadState
+{
+    mutex access;
+    MeshCache cache;
+    deque <MeshData> imported;
+    vector <CachedMesh> meshes;
+    bool finished, failed;
+};
+
 class Model
 {
 private:
-    vector <Mesh> meshes;
-    string directory;
+    static const GLuint import_flags = aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs | aiProcess_GenNormals | aiProcess_CalcTangentSpace;
+    deque <Mesh> meshes;    // grows while loading, queued draws keep pointers to it
+    string path, directory;
+    VertexFormat vertex_format;
+    bool texture_arrays;
+    shared_ptr <ModelLoadState> load_state;
+    thread loader;
+    void load();
     void loadNode(aiNode *node, const aiScene *scene);
-    Mesh loadMesh(aiMesh *mesh, const aiScene *scene);
-    vector <Texture2D> loadMaterialTextures(aiMaterial *material, aiTextureType type, string type_name);
+    MeshData loadMesh(aiMesh *mesh, const aiScene *scene);
+    void optimizeMesh(MeshData &data);
+    vector <MeshTextureRef> loadMaterialTextures(aiMaterial *material, aiTextureType type, string type_name);
+    Mesh createMesh(const CachedMesh &mesh);
+    void upload(size_t max_meshes);
 public:
-    Model(const string &path);
-    void render(Shader &shader);
+    Model(const string &path, bool async, VertexFormat vertex_format, bool texture_arrays);
+    Model(const Model &) = delete;
+    Model &operator=(const Model &) = delete;
+    ~Model();
+    bool isLoaded();
+    bool getBounds(glm::vec3 &bounds_min, glm::vec3 &bounds_max) const;
+    GLuint getIndexCount() const;
+    void render(Shader &shader, const LodSelector *selector);
+    void render(ShaderVariants &variants, ShaderFeatures scene_features, const glm::mat4 &transform, const LodSelector *selector);
+    void render(RenderQueue &queue, RenderPass pass, Shader &shader, const glm::mat4 &transform, const LodSelector *selector);
+    void render(RenderQueue &queue, RenderPass pass, ShaderVariants &variants, ShaderFeatures scene_features, const glm::mat4 &transform, const LodSelector *selector);
+    void renderInstanced(Shader &shader, const InstanceBuffer &instances, GLuint lod);
+    void renderInstanced(RenderQueue &queue, RenderPass pass, Shader &shader, const InstanceBuffer &instances, GLuint lod);
+    void renderInstanced(RenderQueue &queue, RenderPass pass, ShaderVariants &variants, ShaderFeatures scene_features, const InstanceBuffer &instances, GLuint lod);
+    void render(VisibilityBuffer &visibility, const glm::mat4 &transform, const LodSelector *selector);
+    void renderInstanced(VisibilityBuffer &visibility, const InstanceBuffer &instances, const vector <glm::mat4> &transforms, GLuint lod);
 };
 
-Model::Model(const string &path) 
+Model::Model(const string &path, bool async = false, VertexFormat vertex_format = VERTEX_FORMAT_FULL, bool texture_arrays = false) : 
+    path(path), vertex_format(vertex_format), texture_arrays(texture_arrays), load_state(new ModelLoadState())
+{
+    directory = path.substr(0, path.find_last_of('/'));
+    load_state->finished = load_state->failed = false;
+
+    if (async)
+    {
+        loader = thread(&Model::load, this);
+        return;
+    }
+
+    load();
+    if (load_state->failed)
+        throw -1;
+    upload(SIZE_MAX);
+}
+Model::~Model()
 {
+    if (loader.joinable())
+        loader.join();
+    for (int i = 0; i < meshes.size(); ++i)
+        meshes[i].release();
+}
+void Model::load()
+{
+    bool hashed;
+    // Each vertex format gets its own cache file so models sharing a source don't evict each other
+    string cache_path = path + (vertex_format == VERTEX_FORMAT_FULL ? "" : string(".") + getVertexFormatName(vertex_format)) + ".meshcache";
+    uint64_t source_hash = MeshCache::hashSource(path, hashed);
+    if (hashed && load_state->cache.open(cache_path, source_hash, import_flags, vertex_format))
+    {
+        lock_guard <mutex> lock(load_state->access);
+        load_state->meshes = load_state->cache.getMeshes();
+        load_state->finished = true;
+        return;
+    }
+
     Assimp::Importer importer;
-    const aiScene *scene = importer.ReadFile(path.c_str(), aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenNormals | aiProcess_CalcTangentSpace);
+    const aiScene *scene = importer.ReadFile(path.c_str(), import_flags);
 
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
     {
         cout << "Error while loading model: " << importer.GetErrorString() << endl;
-        throw -1;
+        lock_guard <mutex> lock(load_state->access);
+        load_state->failed = load_state->finished = true;
+        return;
     }
-    directory = path.substr(0, path.find_last_of('/'));
 
     loadNode(scene->mRootNode, scene);
+
+    vector <CachedMesh> cached_meshes;
+    {
+        lock_guard <mutex> lock(load_state->access);
+        cached_meshes = load_state->meshes;
+    }
+    if (hashed)
+        MeshCache::write(cache_path, source_hash, import_flags, vertex_format, cached_meshes);
+
+    lock_guard <mutex> lock(load_state->access);
+    load_state->finished = true;
 }
 void Model::loadNode(aiNode *node, const aiScene *scene)
 {
@@ -124,16 +359,41 @@ void Model::loadNode(aiNode *node, const aiScene *scene)
     for (int i = 0; i < node->mNumMeshes; ++i)
     {
         mesh = scene->mMeshes[node->mMeshes[i]];
-        meshes.push_back(loadMesh(mesh, scene));
+        MeshData data = loadMesh(mesh, scene);
+        optimizeMesh(data);
+        data.quantization = packVertices(data.vertices, vertex_format, data.packed_vertices);
+        data.vertices.clear();
+        data.vertices.shrink_to_fit();
+
+        // Published one by one so the GL thread can start uploading while the rest is imported
+        lock_guard <mutex> lock(load_state->access);
+        load_state->imported.push_back(std::move(data));
+        MeshData &stored = load_state->imported.back();
+        CachedMesh cached_mesh;
+        cached_mesh.vertex_stride = getVertexStride(vertex_format);
+        cached_mesh.vertices = stored.packed_vertices.data();
+        cached_mesh.vertex_count = stored.packed_vertices.size() / cached_mesh.vertex_stride;
+        cached_mesh.vertex_format = vertex_format;
+        cached_mesh.quantization = stored.quantization;
+        cached_mesh.indexes = stored.indexes.data();
+        cached_mesh.index_count = stored.indexes.size();
+        cached_mesh.lods = stored.lods;
+        cached_mesh.bounds_min = stored.bounds_min;
+        cached_mesh.bounds_max = stored.bounds_max;
+        cached_mesh.bounds_center = stored.bounds_center;
+        cached_mesh.bounds_radius = stored.bounds_radius;
+        cached_mesh.textures = stored.textures;
+        load_state->meshes.push_back(cached_mesh);
     }
     for (int i = 0; i < node->mNumChildren; i++)
         loadNode(node->mChildren[i], scene);
 }
-Mesh Model::loadMesh(aiMesh* mesh, const aiScene* scene) 
+MeshData Model::loadMesh(aiMesh* mesh, const aiScene* scene) 
 {
-    vector <Vertex> vertices;
-    vector <GLuint> indexes;
-    vector <Texture2D> textures;
+    MeshData data;
+    vector <Vertex> &vertices = data.vertices;
+    vector <GLuint> &indexes = data.indexes;
+    vector <MeshTextureRef> &textures = data.textures;
     
     for (int i = 0; i < mesh->mNumVertices; ++i)
     {
@@ -183,32 +443,155 @@ Mesh Model::loadMesh(aiMesh* mesh, const aiScene* scene)
     if (mesh->mMaterialIndex >= 0)
     {
         aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
-        vector <Texture2D> diffuse_maps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "diffuse_map");
+        vector <MeshTextureRef> diffuse_maps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "diffuse_map");
         textures.insert(textures.end(), diffuse_maps.begin(), diffuse_maps.end());
-        vector <Texture2D> specular_maps = loadMaterialTextures(material, aiTextureType_SPECULAR, "specular_map");
+        vector <MeshTextureRef> specular_maps = loadMaterialTextures(material, aiTextureType_SPECULAR, "specular_map");
         textures.insert(textures.end(), specular_maps.begin(), specular_maps.end());
-        vector <Texture2D> normal_maps = loadMaterialTextures(material, aiTextureType_HEIGHT, "normal_map");
+        vector <MeshTextureRef> normal_maps = loadMaterialTextures(material, aiTextureType_HEIGHT, "normal_map");
         textures.insert(textures.end(), normal_maps.begin(), normal_maps.end());
-        vector <Texture2D> emission_maps = loadMaterialTextures(material, aiTextureType_EMISSIVE, "emission_map");
+        vector <MeshTextureRef> emission_maps = loadMaterialTextures(material, aiTextureType_EMISSIVE, "emission_map");
         textures.insert(textures.end(), emission_maps.begin(), emission_maps.end());
     }
     
-    return Mesh(vertices, indexes, textures);
+    return data;
+}
+void Model::optimizeMesh(MeshData &data)
+{
+    // Result is stored in the mesh cache, so this only runs when the model is imported
+    VertexCacheStats before = analyzeVertexCache(data.indexes, data.vertices.size());
+    optimizeVertexCache(data.indexes, data.vertices.size());
+    optimizeOverdraw(data.indexes, data.vertices);
+    optimizeVertexFetch(data.indexes, data.vertices);
+    VertexCacheStats after = analyzeVertexCache(data.indexes, data.vertices.size());
+
+    // Box for frustum culling, sphere around its center for LOD selection
+    data.bounds_min = data.bounds_max = glm::vec3(0.0f);
+    for (int i = 0; i < data.vertices.size(); ++i)
+    {
+        data.bounds_min = i ? glm::min(data.bounds_min, data.vertices[i].position) : data.vertices[i].position;
+        data.bounds_max = i ? glm::max(data.bounds_max, data.vertices[i].position) : data.vertices[i].position;
+    }
+    data.bounds_center = (data.bounds_min + data.bounds_max) * 0.5f;
+    data.bounds_radius = 0.0f;
+    for (int i = 0; i < data.vertices.size(); ++i)
+        data.bounds_radius = max(data.bounds_radius, glm::length(data.vertices[i].position - data.bounds_center));
+
+    // Every level halves the previous one and is appended to the same index buffer.
+    // Errors are summed since each level is measured against the one before it
+    MeshLod full_lod = { 0, (GLuint)data.indexes.size(), 0.0f };
+    data.lods.push_back(full_lod);
+    vector <GLuint> lod_indexes(data.indexes);
+    while (data.lods.size() < MESH_MAX_LODS)
+    {
+        GLfloat error;
+        vector <GLuint> simplified = simplifyMesh(lod_indexes, data.vertices, lod_indexes.size() / 6 * 3, error);
+        if (simplified.empty() || simplified.size() > lod_indexes.size() * 9 / 10)
+            break;
+        optimizeVertexCache(simplified, data.vertices.size());
+        MeshLod lod = { (GLuint)data.indexes.size(), (GLuint)simplified.size(), data.lods.back().error + error };
+        data.lods.push_back(lod);
+        data.indexes.insert(data.indexes.end(), simplified.begin(), simplified.end());
+        lod_indexes.swap(simplified);
+    }
+
+    lock_guard <mutex> lock(load_state->access);
+    cout << "Mesh optimizer: " << path << " [" << load_state->meshes.size() << "] ACMR " << before.acmr << " -> " << after.acmr
+        << ", ATVR " << before.atvr << " -> " << after.atvr << ", LOD triangles";
+    for (int i = 0; i < data.lods.size(); ++i)
+        cout << " " << data.lods[i].index_count / 3;
+    cout << endl;
 }
-vector <Texture2D> Model::loadMaterialTextures(aiMaterial *material, aiTextureType type, string type_name)
+vector <MeshTextureRef> Model::loadMaterialTextures(aiMaterial *material, aiTextureType type, string type_name)
 {
-    vector <Texture2D> textures;
+    vector <MeshTextureRef> textures;
     aiString str;
     for (int i = 0; i < material->GetTextureCount(type); ++i)
     {
         material->GetTexture(type, i, &str);
-        Texture2D texture(str.C_Str(), type_name, directory);
+        MeshTextureRef texture = { type_name, str.C_Str() };
         textures.push_back(texture);
     }
     return textures;
 }
-void Model::render(Shader &shader)
+Mesh Model::createMesh(const CachedMesh &mesh)
+{
+    vector <MeshTexture> textures;
+    for (int i = 0; i < mesh.textures.size(); ++i)
+    {
+        MeshTexture texture = { TextureRegistry::instance().load(mesh.textures[i].filename, mesh.textures[i].type, directory,
+            GL_REPEAT, GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, true, true), mesh.textures[i].type, UniformName(), 0, { 0, -1 } };
+        textures.push_back(texture);
+    }
+    return Mesh(mesh, textures, texture_arrays);
+}
+void Model::upload(size_t max_meshes)
+{
+    if (!load_state)
+        return;
+
+    bool finished;
+    for (size_t uploaded = 0; uploaded < max_meshes; ++uploaded)
+    {
+        CachedMesh mesh;
+        {
+            lock_guard <mutex> lock(load_state->access);
+            finished = load_state->finished;
+            if (meshes.size() == load_state->meshes.size())
+                break;
+            mesh = load_state->meshes[meshes.size()];
+        }
+        meshes.push_back(createMesh(mesh));
+    }
+
+    if (finished && meshes.size() == load_state->meshes.size())
+    {
+        // Everything is in video memory, drop the CPU copies and the mapped cache
+        if (loader.joinable())
+            loader.join();
+        load_state.reset();
+    }
+}
+bool Model::isLoaded() { return !load_state; }
+// Box around all meshes uploaded so far, in model space
+bool Model::getBounds(glm::vec3 &bounds_min, glm::vec3 &bounds_max) const
 {
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        bounds_min = i ? glm::min(bounds_min, meshes[i].getBoundsMin()) : meshes[i].getBoundsMin();
+        bounds_max = i ? glm::max(bounds_max, meshes[i].getBoundsMax()) : meshes[i].getBoundsMax();
+    }
+    return !meshes.empty();
+}
+// Indexes of the full detail level over all meshes uploaded so far
+GLuint Model::getIndexCount() const
+{
+    GLuint count = 0;
+    for (size_t i = 0; i < meshes.size(); ++i)
+        count += meshes[i].getLod(0).index_count;
+    return count;
+}
+void Model::render(Shader &shader, const LodSelector *selector = nullptr)
+{
+    upload(1);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+        meshes[i].render(shader, selector ? meshes[i].selectLod(*selector) : 0);
+}
+// One draw per mesh for all instances, the shader has to read the model matrix from attributes 5-8
+void Model::renderInstanced(Shader &shader, const InstanceBuffer &instances, GLuint lod = 0)
+{
+    upload(1);
     for (unsigned int i = 0; i < meshes.size(); i++)
-        meshes[i].render(shader);
+        meshes[i].renderInstanced(shader, instances, lod);
+}
+// Every mesh draws with the cheapest variant covering its material
+void Model::render(ShaderVariants &variants, ShaderFeatures scene_features, const glm::mat4 &transform, const LodSelector *selector = nullptr)
+{
+    upload(1);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        Shader &shader = variants.get(scene_features | meshes[i].getFeatures());
+        shader.use();
+        shader.setUniform("model"_uniform, transform);
+        meshes[i].render(shader, selector ? meshes[i].selectLod(*selector) : 0);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "gl_state.h"
+#include "shader.h"
+#include "uniform_buffers.h"
+#include "frustum_culler.h"
+#include "bounding_volume_tree.h"
+#include "light_clusters.h"
+#include "render_queue.h"
+
+#define POINT_SHADOW_TEXTURE_UNIT 30		// atlas, tile table on 31
+#define POINT_SHADOW_SIZE_CLASSES 4			// tiles with faces of 256, 128, 64 and 32 texels
+#define POINT_SHADOW_MAX_FACE 256
+#define POINT_SHADOW_NEAR 0.05f
+#define POINT_SHADOW_MAX_RANGE 100.0f		// far plane of lights that never fade out completely
+
+struct PointShadowStats
+{
+	GLuint frames, renders, candidates;		// candidates: lights that wanted a render, summed over frames
+	GLuint tiles[POINT_SHADOW_SIZE_CLASSES];
+	GLuint no_tile;							// visible lights the atlas had no room for, last frame
+};
+
+// Shadows of many point lights in one depth texture. Every light gets a tile
+// holding its six cube faces side by side, 3 by 2, rendered along the world
+// axes in one pass: the geometry shader sends each triangle to the faces it
+// touches and clip distances cut it at the face edges. The atlas is split in
+// bands, one per tile size, and a light's size follows the size of its sphere of
+// influence on screen. Lights off screen give their tiles back.
+//
+// Only a budget of lights is rendered per frame. Lights that moved, changed
+// their size or had casters move in their range are candidates, the most
+// important ones are taken first, weighted by how long they have waited. Tiles
+// keep the position they were rendered from, a light that has to wait casts the
+// shadow of a moment ago instead of a wrong one
+class PointShadowAtlas
+{
+	struct LightShadow
+	{
+		glm::vec3 pos;			// world space, as the tile was rendered
+		GLfloat range;
+		GLfloat importance;		// radius on screen in pixels, 0 off screen
+		GLint size_class;		// of the tile, -1 without one
+		GLint wanted_class;
+		GLuint slot;
+		GLuint age;				// frames since the last render
+		bool dirty;
+	};
+	struct ScheduledLight
+	{
+		GLuint light;
+		glm::ivec2 origin;
+		GLint face_size;
+	};
+	GLuint texture, framebuffer;
+	GLuint tile_buffer, tile_texture;
+	GLuint resolution, budget;
+	GLuint slots_per_row[POINT_SHADOW_SIZE_CLASSES];
+	std::vector <GLuint> free_slots[POINT_SHADOW_SIZE_CLASSES];
+	std::vector <LightShadow> lights;
+	std::vector <ScheduledLight> scheduled;
+	std::vector <GLuint> candidates;
+	std::vector <glm::vec4> tiles;		// per light: tile origin in texels, face size and range; position and near plane
+	PointShadowStats stats;
+	static GLint getFaceSize(GLint size_class);
+	glm::ivec2 getOrigin(GLint size_class, GLuint slot) const;
+	void releaseTile(LightShadow &light);
+	bool allocateTile(LightShadow &light);
+public:
+	PointShadowAtlas(GLuint resolution, GLuint budget);
+	PointShadowAtlas(const PointShadowAtlas &) = delete;
+	PointShadowAtlas &operator=(const PointShadowAtlas &) = delete;
+	void invalidate();
+	void invalidate(const BoundingBox &box);
+	void update(const std::vector <PointLightUniforms> &point_lights, const glm::mat4 &view, const glm::mat4 &projection, GLint screen_height);
+	GLuint getScheduledCount() const;
+	glm::mat4 getCullingSpace(GLuint slot) const;
+	void bindTile(GLuint slot);
+	void setUniforms(Shader &shader, GLuint slot) const;
+	void finishTiles() const;
+	void bind() const;
+	void fillUniforms(ShadowUniforms &uniforms, const glm::mat4 &view) const;
+	void printStats() const;
+	void release();
+};
+
+// Each tile size gets an equal band of the atlas rows, resolution has to be a
+// multiple of 4 * POINT_SHADOW_MAX_FACE
+PointShadowAtlas::PointShadowAtlas(GLuint resolution, GLuint budget = RENDER_POINT_SHADOW_PASSES) :
+	resolution(resolution), budget(std::min(budget, (GLuint)RENDER_POINT_SHADOW_PASSES)), stats()
+{
+	GLuint band_height = resolution / POINT_SHADOW_SIZE_CLASSES;
+	for (GLint i = 0; i < POINT_SHADOW_SIZE_CLASSES; ++i)
+	{
+		GLint face_size = getFaceSize(i);
+		slots_per_row[i] = resolution / (3 * face_size);
+		GLuint slot_count = slots_per_row[i] * (band_height / (2 * face_size));
+		// Reversed, so the first slots are handed out first
+		for (GLuint slot = slot_count; slot > 0; --slot)
+			free_slots[i].push_back(slot - 1);
+	}
+
+	glGenTextures(1, &texture);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glGenFramebuffers(1, &framebuffer);
+	GLState::instance().bindFramebuffer(framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Point shadow atlas is incomplete\n";
+	GLState::instance().bindFramebuffer(0);
+
+	glGenBuffers(1, &tile_buffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, tile_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, 2 * sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &tile_texture);
+	GLState::instance().bindTexture(GL_TEXTURE_BUFFER, tile_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, tile_buffer);
+	GLState::instance().bindTexture(GL_TEXTURE_BUFFER, 0);
+}
+GLint PointShadowAtlas::getFaceSize(GLint size_class) { return POINT_SHADOW_MAX_FACE >> size_class; }
+glm::ivec2 PointShadowAtlas::getOrigin(GLint size_class, GLuint slot) const
+{
+	GLint face_size = getFaceSize(size_class);
+	GLint band = size_class * (GLint)resolution / POINT_SHADOW_SIZE_CLASSES;
+	return glm::ivec2(slot % slots_per_row[size_class] * 3 * face_size, band + slot / slots_per_row[size_class] * 2 * face_size);
+}
+void PointShadowAtlas::releaseTile(LightShadow &light)
+{
+	if (light.size_class < 0)
+		return;
+	free_slots[light.size_class].push_back(light.slot);
+	light.size_class = -1;
+	light.dirty = true;
+}
+// Takes a tile of the wanted size, or a smaller one when that band is full
+bool PointShadowAtlas::allocateTile(LightShadow &light)
+{
+	if (light.size_class == light.wanted_class)
+		return true;
+	releaseTile(light);
+	for (GLint size_class = light.wanted_class; size_class < POINT_SHADOW_SIZE_CLASSES; ++size_class)
+		if (!free_slots[size_class].empty())
+		{
+			light.size_class = size_class;
+			light.slot = free_slots[size_class].back();
+			free_slots[size_class].pop_back();
+			return true;
+		}
+	return false;
+}
+void PointShadowAtlas::invalidate()
+{
+	for (size_t i = 0; i < lights.size(); ++i)
+		lights[i].dirty = true;
+}
+// Casters appeared, disappeared or moved inside the box
+void PointShadowAtlas::invalidate(const BoundingBox &box)
+{
+	for (size_t i = 0; i < lights.size(); ++i)
+	{
+		LightShadow &light = lights[i];
+		glm::vec3 closest = glm::clamp(light.pos, box.min, box.max);
+		if (light.size_class >= 0 && glm::dot(closest - light.pos, closest - light.pos) < light.range * light.range)
+			light.dirty = true;
+	}
+}
+// Point light positions are in world space. Decides which lights are rendered
+// this frame, call after the invalidations of the frame
+void PointShadowAtlas::update(const std::vector <PointLightUniforms> &point_lights, const glm::mat4 &view, const glm::mat4 &projection, GLint screen_height)
+{
+	LightShadow empty = { glm::vec3(0.0f), 0.0f, 0.0f, -1, -1, 0, 0, true };
+	for (size_t i = point_lights.size(); i < lights.size(); ++i)
+		releaseTile(lights[i]);
+	lights.resize(point_lights.size(), empty);
+
+	Frustum frustum = extractFrustum(projection * view);
+	GLfloat pixels_per_unit = projection[1][1] * screen_height / 2.0f;
+	candidates.clear();
+	for (size_t i = 0; i < point_lights.size(); ++i)
+	{
+		LightShadow &light = lights[i];
+		glm::vec3 pos = point_lights[i].pos;
+		GLfloat range = std::min(getLightRadius(point_lights[i]), POINT_SHADOW_MAX_RANGE);
+		if (pos != light.pos || range != light.range)
+			light.dirty = true;
+		++light.age;
+
+		// Importance is the projected radius of the sphere the light reaches
+		bool visible = range > POINT_SHADOW_NEAR;
+		for (int plane = 0; plane < 6 && visible; ++plane)
+			visible = glm::dot(glm::vec3(frustum.planes[plane]), pos) + frustum.planes[plane].w >= -range;
+		if (!visible)
+		{
+			light.importance = 0.0f;
+			light.wanted_class = -1;
+			releaseTile(light);
+			continue;
+		}
+		GLfloat distance = glm::length(glm::vec3(view * glm::vec4(pos, 1.0f)));
+		light.importance = distance > range ? pixels_per_unit * range / sqrt(distance * distance - range * range) : (GLfloat)screen_height;
+		light.wanted_class = 0;
+		while (light.wanted_class < POINT_SHADOW_SIZE_CLASSES - 1 && getFaceSize(light.wanted_class) > light.importance)
+			++light.wanted_class;
+		// A tile smaller than wanted only counts while a bigger one is free, or the light would wait for it every frame
+		bool resize = light.size_class != light.wanted_class && (light.size_class < light.wanted_class || !free_slots[light.wanted_class].empty());
+		if (light.dirty || resize)
+			candidates.push_back((GLuint)i);
+	}
+
+	// Lights that waited longer catch up even when smaller, none starves
+	size_t count = std::min(candidates.size(), (size_t)budget);
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), [this](GLuint a, GLuint b)
+	{
+		return lights[a].importance * (lights[a].age + 1) > lights[b].importance * (lights[b].age + 1);
+	});
+	scheduled.clear();
+	for (size_t i = 0; i < count; ++i)
+	{
+		LightShadow &light = lights[candidates[i]];
+		if (!allocateTile(light))
+			continue;
+		light.pos = point_lights[candidates[i]].pos;
+		light.range = std::min(getLightRadius(point_lights[candidates[i]]), POINT_SHADOW_MAX_RANGE);
+		light.age = 0;
+		light.dirty = false;
+		ScheduledLight entry = { candidates[i], getOrigin(light.size_class, light.slot), getFaceSize(light.size_class) };
+		scheduled.push_back(entry);
+	}
+
+	tiles.resize(lights.size() * 2);
+	stats.no_tile = 0;
+	for (GLint i = 0; i < POINT_SHADOW_SIZE_CLASSES; ++i)
+		stats.tiles[i] = 0;
+	for (size_t i = 0; i < lights.size(); ++i)
+	{
+		const LightShadow &light = lights[i];
+		if (light.size_class < 0)
+		{
+			tiles[i * 2] = glm::vec4(0.0f);
+			stats.no_tile += light.wanted_class >= 0;
+			continue;
+		}
+		glm::ivec2 origin = getOrigin(light.size_class, light.slot);
+		tiles[i * 2] = glm::vec4((GLfloat)origin.x, (GLfloat)origin.y, (GLfloat)getFaceSize(light.size_class), light.range);
+		tiles[i * 2 + 1] = glm::vec4(light.pos, POINT_SHADOW_NEAR);
+		++stats.tiles[light.size_class];
+	}
+	if (!tiles.empty())
+	{
+		// Orphaned first, the shaders of the last frame may still read it
+		glBindBuffer(GL_TEXTURE_BUFFER, tile_buffer);
+		glBufferData(GL_TEXTURE_BUFFER, (GLsizeiptr)tiles.size() * sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, (GLsizeiptr)tiles.size() * sizeof(glm::vec4), tiles.data());
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+	++stats.frames;
+	stats.renders += (GLuint)scheduled.size();
+	stats.candidates += (GLuint)candidates.size();
+}
+GLuint PointShadowAtlas::getScheduledCount() const { return (GLuint)scheduled.size(); }
+// Box around the light's range as a matrix for frustum culling
+glm::mat4 PointShadowAtlas::getCullingSpace(GLuint slot) const
+{
+	const LightShadow &light = lights[scheduled[slot].light];
+	return glm::ortho(-light.range, light.range, -light.range, light.range, -light.range, light.range) * glm::translate(glm::mat4(1.0f), -light.pos);
+}
+// Clears the tile and enables the clip distances of the face edges
+void PointShadowAtlas::bindTile(GLuint slot)
+{
+	const ScheduledLight &entry = scheduled[slot];
+	GLState::instance().bindFramebuffer(framebuffer);
+	glViewport(entry.origin.x, entry.origin.y, 3 * entry.face_size, 2 * entry.face_size);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(entry.origin.x, entry.origin.y, 3 * entry.face_size, 2 * entry.face_size);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+	for (int i = 0; i < 4; ++i)
+		glEnable(GL_CLIP_DISTANCE0 + i);
+}
+void PointShadowAtlas::setUniforms(Shader &shader, GLuint slot) const
+{
+	const LightShadow &light = lights[scheduled[slot].light];
+	shader.setUniform("light_pos", light.pos);
+	shader.setUniform("light_range", light.range);
+}
+// Shaders that don't write clip distances must not run with them enabled
+void PointShadowAtlas::finishTiles() const
+{
+	for (int i = 0; i < 4; ++i)
+		glDisable(GL_CLIP_DISTANCE0 + i);
+}
+void PointShadowAtlas::bind() const
+{
+	GLState::instance().bindTexture(GL_TEXTURE0 + POINT_SHADOW_TEXTURE_UNIT, GL_TEXTURE_2D, texture);
+	GLState::instance().bindTexture(GL_TEXTURE0 + POINT_SHADOW_TEXTURE_UNIT + 1, GL_TEXTURE_BUFFER, tile_texture);
+}
+void PointShadowAtlas::fillUniforms(ShadowUniforms &uniforms, const glm::mat4 &view) const { uniforms.view_to_world = glm::inverse(view); }
+void PointShadowAtlas::printStats() const
+{
+	std::cout << "Point shadow atlas: " << resolution << "x" << resolution << ", tiles of";
+	for (GLint i = 0; i < POINT_SHADOW_SIZE_CLASSES; ++i)
+		std::cout << " " << getFaceSize(i) << ": " << stats.tiles[i];
+	std::cout << ", " << stats.no_tile << " visible lights without a tile, "
+		<< (stats.frames ? (GLfloat)stats.renders / stats.frames : 0.0f) << " of " << (stats.frames ? (GLfloat)stats.candidates / stats.frames : 0.0f)
+		<< " waiting lights rendered per frame (budget " << budget << ")\n";
+}
+void PointShadowAtlas::release()
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	GLState::instance().forgetFramebuffer(framebuffer);
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &tile_texture);
+	GLState::instance().forgetTexture(texture);
+	GLState::instance().forgetTexture(tile_texture);
+	glDeleteBuffers(1, &tile_buffer);
+}
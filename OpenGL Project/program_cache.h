@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// GL 4.1 / ARB_get_program_binary, not part of the 3.3 loader
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+typedef void (APIENTRYP PFNGETPROGRAMBINARYPROC)(GLuint program, GLsizei buf_size, GLsizei *length, GLenum *binary_format, void *binary);
+typedef void (APIENTRYP PFNPROGRAMBINARYPROC)(GLuint program, GLenum binary_format, const void *binary, GLsizei length);
+typedef void (APIENTRYP PFNPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+
+#define PROGRAM_CACHE_DIRECTORY "ShaderCache"
+#define PROGRAM_CACHE_VERSION 1
+
+struct ProgramCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t binary_format;
+	uint64_t key;
+	uint32_t length;
+	float compile_time;		// ms spent compiling from source, to report what a hit saves
+};
+
+// On-disk cache of linked program binaries. Keys cover the final sources
+// (defines included) and the driver strings, so a driver update or an edited
+// shader simply misses
+class ProgramBinaryCache
+{
+	PFNGETPROGRAMBINARYPROC getProgramBinary;
+	PFNPROGRAMBINARYPROC programBinary;
+	PFNPROGRAMPARAMETERIPROC programParameteri;
+	bool initialized, supported;
+	std::string driver;
+	GLuint hits, misses;
+	GLfloat time_saved;
+	ProgramBinaryCache();
+	void init();
+	static std::string getPath(uint64_t key);
+public:
+	static ProgramBinaryCache &instance();
+	uint64_t getKey(const std::string &vertex_source, const std::string &fragment_source, const std::string &geometry_source);
+	void prepare(GLuint program);
+	bool load(GLuint program, uint64_t key);
+	void store(GLuint program, uint64_t key, GLfloat compile_time);
+	void printStats();
+};
+
+ProgramBinaryCache::ProgramBinaryCache() : getProgramBinary(nullptr), programBinary(nullptr), programParameteri(nullptr),
+	initialized(false), supported(false), hits(0), misses(0), time_saved(0.0f) {}
+ProgramBinaryCache &ProgramBinaryCache::instance()
+{
+	static ProgramBinaryCache cache;
+	return cache;
+}
+void ProgramBinaryCache::init()
+{
+	if (initialized)
+		return;
+	initialized = true;
+
+	const char *strings[3] = { (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION) };
+	for (int i = 0; i < 3; ++i)
+		driver += std::string(strings[i] ? strings[i] : "") + "\n";
+
+	getProgramBinary = (PFNGETPROGRAMBINARYPROC)glfwGetProcAddress("glGetProgramBinary");
+	programBinary = (PFNPROGRAMBINARYPROC)glfwGetProcAddress("glProgramBinary");
+	programParameteri = (PFNPROGRAMPARAMETERIPROC)glfwGetProcAddress("glProgramParameteri");
+	GLint format_count = 0;
+	if (getProgramBinary && programBinary && programParameteri)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+	while (glGetError() != GL_NO_ERROR);
+	supported = format_count > 0;
+	if (!supported)
+		return;
+
+#ifdef _WIN32
+	_mkdir(PROGRAM_CACHE_DIRECTORY);
+#else
+	mkdir(PROGRAM_CACHE_DIRECTORY, 0755);
+#endif
+}
+std::string ProgramBinaryCache::getPath(uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+	return std::string(PROGRAM_CACHE_DIRECTORY) + "/" + name;
+}
+uint64_t ProgramBinaryCache::getKey(const std::string &vertex_source, const std::string &fragment_source, const std::string &geometry_source = "")
+{
+	init();
+	// FNV-1a, sources are separated so moving text between stages changes the key.
+	// Without a geometry stage the key is the same as before there was one
+	uint64_t hash = 14695981039346656037ull;
+	const std::string *parts[4] = { &vertex_source, &fragment_source, &driver, &geometry_source };
+	for (int i = 0; i < (geometry_source.empty() ? 3 : 4); ++i)
+	{
+		for (size_t j = 0; j < parts[i]->size(); ++j)
+			hash = (hash ^ (unsigned char)(*parts[i])[j]) * 1099511628211ull;
+		hash = (hash ^ 0xff) * 1099511628211ull;
+	}
+	return hash;
+}
+void ProgramBinaryCache::prepare(GLuint program)
+{
+	if (supported)
+		programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+bool ProgramBinaryCache::load(GLuint program, uint64_t key)
+{
+	init();
+	if (!supported)
+		return false;
+
+	std::string path = getPath(key);
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	ProgramCacheHeader header;
+	std::vector <char> binary;
+	file.read((char *)&header, sizeof(header));
+	if (file && memcmp(header.magic, "PROGBIN", 8) == 0 && header.version == PROGRAM_CACHE_VERSION && header.key == key)
+	{
+		binary.resize(header.length);
+		file.read(binary.data(), header.length);
+	}
+	file.close();
+	if (binary.empty() || !file)
+	{
+		remove(path.c_str());
+		return false;
+	}
+
+	GLfloat start = (GLfloat)glfwGetTime();
+	programBinary(program, header.binary_format, binary.data(), header.length);
+	GLint success = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success)
+	{
+		// The driver may refuse binaries it produced itself, e.g. after a settings change
+		std::cout << "Program cache: binary rejected, compiling from source" << std::endl;
+		remove(path.c_str());
+		return false;
+	}
+	++hits;
+	time_saved += header.compile_time - ((GLfloat)glfwGetTime() - start) * 1000.0f;
+	return true;
+}
+void ProgramBinaryCache::store(GLuint program, uint64_t key, GLfloat compile_time)
+{
+	++misses;
+	GLint success = GL_FALSE, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!supported || !success)
+		return;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	ProgramCacheHeader header;
+	memcpy(header.magic, "PROGBIN", 8);
+	header.version = PROGRAM_CACHE_VERSION;
+	header.key = key;
+	header.compile_time = compile_time;
+	std::vector <char> binary(length);
+	GLenum format;
+	getProgramBinary(program, length, &length, &format, binary.data());
+	header.binary_format = format;
+	header.length = length;
+
+	std::string path = getPath(key), temp_path = path + ".tmp";
+	std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+	file.write((const char *)&header, sizeof(header));
+	file.write(binary.data(), length);
+	file.close();
+	if (!file)
+	{
+		remove(temp_path.c_str());
+		return;
+	}
+	remove(path.c_str());
+	rename(temp_path.c_str(), path.c_str());
+}
+void ProgramBinaryCache::printStats()
+{
+	if (!supported)
+	{
+		std::cout << "Program cache: program binaries are not supported by the driver\n";
+		return;
+	}
+	std::cout << "Program cache: " << hits << " hits, " << misses << " misses, " << time_saved << " ms saved\n";
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "shader.h"
+#include "shader_permutations.h"
+#include "model.h"
+#include "frustum_culler.h"
+#include "uniform_buffers.h"
+
+#define RENDER_POINT_SHADOW_PASSES 4		// point lights whose shadows can be rendered in one frame
+
+// Passes run in this order, each one after its begin callback
+enum RenderPass : GLuint
+{
+	RENDER_PASS_SHADOW_STATIC,	// cached static casters of each cascade, RENDER_PASS_SHADOW_STATIC + cascade
+	RENDER_PASS_SHADOW = RENDER_PASS_SHADOW_STATIC + SHADOW_MAX_CASCADES,	// moving casters over a copy of the static layer, RENDER_PASS_SHADOW + cascade
+	RENDER_PASS_POINT_SHADOW = RENDER_PASS_SHADOW + SHADOW_MAX_CASCADES,	// a point light's tile in the shadow atlas, RENDER_PASS_POINT_SHADOW + slot
+	RENDER_PASS_OPAQUE = RENDER_PASS_POINT_SHADOW + RENDER_POINT_SHADOW_PASSES,
+	RENDER_PASS_LIGHTING,		// full screen, only used by the deferred and visibility buffer paths
+	RENDER_PASS_SKY,
+	RENDER_PASS_TRANSPARENT,	// back to front
+	RENDER_PASS_COUNT
+};
+
+// Sort key, most significant first: pass (4 bits), program (12), material (16),
+// depth (32). Depth is the float bit pattern of the view distance, which for
+// non-negative values orders the same as the float itself
+#define RENDER_KEY_PASS_SHIFT 60
+#define RENDER_KEY_PROGRAM_SHIFT 48
+#define RENDER_KEY_MATERIAL_SHIFT 32
+static_assert(RENDER_PASS_COUNT <= 16, "passes must fit the 4 bits of the sort key");
+
+#define RENDER_QUEUE_TIMER_FRAMES 3		// timer queries are read back this many frames later, when the GPU is done with them
+
+struct DrawPacket
+{
+	const Mesh *mesh;
+	Shader *shader;
+	glm::mat4 transform;
+	GLuint lod;
+	const InstanceBuffer *instances;	// null for a single draw with transform
+	GLint bounds;						// box in the pass culler, negative when the draw isn't culled
+};
+
+struct RenderQueueStats
+{
+	GLuint packets;
+	GLuint program_changes, material_changes;
+	CullingStats culling[RENDER_PASS_COUNT];
+};
+
+// Collects the draws of a frame and submits them sorted by key in one sweep.
+// Passes given a frustum drop the draws whose bounds are outside it first.
+// Every pass is timed on the GPU, printStats() shows the averages
+class RenderQueue
+{
+	struct SortItem
+	{
+		uint64_t key;
+		GLuint packet;
+	};
+	std::vector <DrawPacket> packets;
+	std::vector <SortItem> items, sort_buffer;
+	std::function<void()> pass_begin[RENDER_PASS_COUNT];
+	FrustumCuller cullers[RENDER_PASS_COUNT];
+	Frustum frusta[RENDER_PASS_COUNT];
+	bool culling[RENDER_PASS_COUNT];
+	glm::mat4 view;
+	RenderQueueStats stats, frame_stats;
+	GLuint timers[RENDER_QUEUE_TIMER_FRAMES][RENDER_PASS_COUNT];
+	GLuint timed_frames, frame_index;
+	double pass_times[RENDER_PASS_COUNT];		// ms, summed over timed_frames
+	static uint64_t makeKey(RenderPass pass, GLuint program, GLuint material, GLfloat depth);
+	void cull();
+	void sort();
+	void readTimers(GLuint frame);
+public:
+	RenderQueue();
+	RenderQueue(const RenderQueue &) = delete;
+	RenderQueue &operator=(const RenderQueue &) = delete;
+	void setPass(RenderPass pass, std::function<void()> begin);
+	void setView(const glm::mat4 &view);
+	void setFrustum(RenderPass pass, const glm::mat4 &view_projection);
+	void addCullingStats(RenderPass pass, const CullingStats &culled);
+	void add(RenderPass pass, Shader &shader, const Mesh &mesh, const glm::mat4 &transform, GLuint lod);
+	void addInstanced(RenderPass pass, Shader &shader, const Mesh &mesh, const InstanceBuffer &instances, GLuint lod);
+	void submit();
+	const RenderQueueStats &getFrameStats() const;
+	double getPassTime(RenderPass pass) const;
+	void printStats() const;
+	void release();
+};
+
+RenderQueue::RenderQueue() : culling(), view(1.0f), stats(), frame_stats(), timed_frames(0), frame_index(0), pass_times()
+{
+	glGenQueries(RENDER_QUEUE_TIMER_FRAMES * RENDER_PASS_COUNT, &timers[0][0]);
+}
+uint64_t RenderQueue::makeKey(RenderPass pass, GLuint program, GLuint material, GLfloat depth)
+{
+	uint32_t depth_bits;
+	depth = depth > 0.0f ? depth : 0.0f;
+	memcpy(&depth_bits, &depth, sizeof(depth_bits));
+	if (pass == RENDER_PASS_TRANSPARENT)
+		depth_bits = ~depth_bits;
+	return (uint64_t)(pass & 0xf) << RENDER_KEY_PASS_SHIFT | (uint64_t)(program & 0xfff) << RENDER_KEY_PROGRAM_SHIFT |
+		(uint64_t)(material & 0xffff) << RENDER_KEY_MATERIAL_SHIFT | depth_bits;
+}
+void RenderQueue::setPass(RenderPass pass, std::function<void()> begin) { pass_begin[pass] = begin; }
+void RenderQueue::setView(const glm::mat4 &view) { this->view = view; }
+void RenderQueue::setFrustum(RenderPass pass, const glm::mat4 &view_projection)
+{
+	frusta[pass] = extractFrustum(view_projection);
+	culling[pass] = true;
+}
+// For draws culled before they reach the queue, like instances
+void RenderQueue::addCullingStats(RenderPass pass, const CullingStats &culled)
+{
+	stats.culling[pass].visible += culled.visible;
+	stats.culling[pass].culled += culled.culled;
+}
+void RenderQueue::add(RenderPass pass, Shader &shader, const Mesh &mesh, const glm::mat4 &transform, GLuint lod)
+{
+	GLfloat depth = -(view * transform * glm::vec4(mesh.getBoundsCenter(), 1.0f)).z;
+	SortItem item = { makeKey(pass, shader.getID(), mesh.getMaterialKey(), depth), (GLuint)packets.size() };
+	DrawPacket packet = { &mesh, &shader, transform, lod, nullptr, -1 };
+	if (culling[pass])
+		packet.bounds = (GLint)cullers[pass].add(mesh.getBoundsMin(), mesh.getBoundsMax(), transform);
+	items.push_back(item);
+	packets.push_back(packet);
+}
+// Instances are spread out, they sort as if at the object space origin
+void RenderQueue::addInstanced(RenderPass pass, Shader &shader, const Mesh &mesh, const InstanceBuffer &instances, GLuint lod)
+{
+	// Not culled here, the caller culls the instances before filling the buffer
+	GLfloat depth = -(view * glm::vec4(mesh.getBoundsCenter(), 1.0f)).z;
+	SortItem item = { makeKey(pass, shader.getID(), mesh.getMaterialKey(), depth), (GLuint)packets.size() };
+	DrawPacket packet = { &mesh, &shader, glm::mat4(1.0f), lod, &instances, -1 };
+	items.push_back(item);
+	packets.push_back(packet);
+}
+// Every pass tests its boxes in one batch, then the items of invisible packets are dropped
+void RenderQueue::cull()
+{
+	for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+		if (culling[pass] && cullers[pass].getCount())
+		{
+			cullers[pass].cull(frusta[pass]);
+			addCullingStats((RenderPass)pass, cullers[pass].getStats());
+		}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const DrawPacket &packet = packets[items[i].packet];
+		if (packet.bounds < 0 || cullers[items[i].key >> RENDER_KEY_PASS_SHIFT].isVisible(packet.bounds))
+			items[kept++] = items[i];
+	}
+	items.resize(kept);
+	for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+		cullers[pass].clear();
+}
+// LSD radix sort on bytes. All eight histograms come from one read of the keys,
+// bytes every key shares (usually the pass and program ones) are skipped
+void RenderQueue::sort()
+{
+	GLuint counts[8][256] = {};
+	for (size_t i = 0; i < items.size(); ++i)
+		for (int byte = 0; byte < 8; ++byte)
+			++counts[byte][(items[i].key >> (byte * 8)) & 0xff];
+
+	sort_buffer.resize(items.size());
+	for (int byte = 0; byte < 8; ++byte)
+	{
+		if (counts[byte][(items[0].key >> (byte * 8)) & 0xff] == items.size())
+			continue;
+		GLuint offsets[256], sum = 0;
+		for (int i = 0; i < 256; ++i)
+		{
+			offsets[i] = sum;
+			sum += counts[byte][i];
+		}
+		for (size_t i = 0; i < items.size(); ++i)
+			sort_buffer[offsets[(items[i].key >> (byte * 8)) & 0xff]++] = items[i];
+		items.swap(sort_buffer);
+	}
+}
+// The queries of a ring slot are issued for every pass, so a slot either has
+// all results pending or none
+void RenderQueue::readTimers(GLuint frame)
+{
+	for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+	{
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(timers[frame][pass], GL_QUERY_RESULT, &elapsed);
+		pass_times[pass] += elapsed / 1000000.0;
+	}
+	++timed_frames;
+}
+void RenderQueue::submit()
+{
+	cull();
+	if (!items.empty())
+		sort();
+
+	stats.packets += (GLuint)items.size();
+	size_t next = 0;
+	Shader *shader = nullptr;
+	GLuint material = (GLuint)-1;
+	GLuint timer_frame = frame_index % RENDER_QUEUE_TIMER_FRAMES;
+	if (frame_index >= RENDER_QUEUE_TIMER_FRAMES)
+		readTimers(timer_frame);
+	for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+	{
+		glBeginQuery(GL_TIME_ELAPSED, timers[timer_frame][pass]);
+		// Begin callbacks run for empty passes too, they also clear their targets
+		if (pass_begin[pass])
+		{
+			pass_begin[pass]();
+			shader = nullptr;		// the callback may have used a program of its own
+		}
+		for (; next < items.size() && (items[next].key >> RENDER_KEY_PASS_SHIFT) == (uint64_t)pass; ++next)
+		{
+			const DrawPacket &packet = packets[items[next].packet];
+			GLuint packet_material = (GLuint)(items[next].key >> RENDER_KEY_MATERIAL_SHIFT) & 0xffff;
+			if (packet.shader != shader)
+			{
+				packet.shader->use();
+				shader = packet.shader;
+				++stats.program_changes;
+			}
+			if (packet_material != material)
+			{
+				material = packet_material;
+				++stats.material_changes;
+			}
+			if (packet.instances)
+				packet.mesh->renderInstanced(*shader, *packet.instances, packet.lod);
+			else
+			{
+				shader->setUniform("model"_uniform, packet.transform);
+				packet.mesh->render(*shader, packet.lod);
+			}
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+	}
+	++frame_index;
+
+	items.clear();
+	packets.clear();
+	frame_stats = stats;
+	stats = RenderQueueStats();
+}
+const RenderQueueStats &RenderQueue::getFrameStats() const { return frame_stats; }
+// Average GPU time of the pass in ms
+double RenderQueue::getPassTime(RenderPass pass) const { return timed_frames ? pass_times[pass] / timed_frames : 0.0; }
+void RenderQueue::printStats() const
+{
+	std::cout << "Render queue, last frame: " << frame_stats.packets << " draws, " << frame_stats.program_changes << " program changes, "
+		<< frame_stats.material_changes << " material changes\n";
+	static_assert(SHADOW_MAX_CASCADES == 4 && RENDER_POINT_SHADOW_PASSES == 4, "pass_names lists two shadow passes per cascade and four point shadow passes");
+	static const char *pass_names[RENDER_PASS_COUNT] = { "static shadow 0", "static shadow 1", "static shadow 2", "static shadow 3",
+		"shadow 0", "shadow 1", "shadow 2", "shadow 3", "point shadow 0", "point shadow 1", "point shadow 2", "point shadow 3",
+		"opaque", "lighting", "sky", "transparent" };
+	std::cout << "Culling, last frame (visible/culled):";
+	for (int pass = 0, first = 1; pass < RENDER_PASS_COUNT; ++pass)
+		if (frame_stats.culling[pass].visible || frame_stats.culling[pass].culled)
+		{
+			std::cout << (first ? " " : ", ") << pass_names[pass] << " " << frame_stats.culling[pass].visible << "/" << frame_stats.culling[pass].culled;
+			first = 0;
+		}
+	std::cout << "\n";
+	std::cout << "GPU time per pass, average of " << timed_frames << " frames:";
+	double total = 0.0;
+	for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+	{
+		std::cout << (pass ? ", " : " ") << pass_names[pass] << " " << getPassTime((RenderPass)pass) << " ms";
+		total += getPassTime((RenderPass)pass);
+	}
+	std::cout << ", total " << total << " ms\n";
+}
+void RenderQueue::release() { glDeleteQueries(RENDER_QUEUE_TIMER_FRAMES * RENDER_PASS_COUNT, &timers[0][0]); }
+
+// Model methods that need the complete queue type
+void Model::render(RenderQueue &queue, RenderPass pass, Shader &shader, const glm::mat4 &transform, const LodSelector *selector = nullptr)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		queue.add(pass, shader, meshes[i], transform, selector ? meshes[i].selectLod(*selector) : 0);
+}
+void Model::render(RenderQueue &queue, RenderPass pass, ShaderVariants &variants, ShaderFeatures scene_features, const glm::mat4 &transform, const LodSelector *selector = nullptr)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		queue.add(pass, variants.get(scene_features | meshes[i].getFeatures()), meshes[i], transform, selector ? meshes[i].selectLod(*selector) : 0);
+}
+void Model::renderInstanced(RenderQueue &queue, RenderPass pass, Shader &shader, const InstanceBuffer &instances, GLuint lod = 0)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		queue.addInstanced(pass, shader, meshes[i], instances, lod);
+}
+void Model::renderInstanced(RenderQueue &queue, RenderPass pass, ShaderVariants &variants, ShaderFeatures scene_features, const InstanceBuffer &instances, GLuint lod = 0)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		queue.addInstanced(pass, variants.get(scene_features | SHADER_INSTANCED | meshes[i].getFeatures()), meshes[i], instances, lod);
+}
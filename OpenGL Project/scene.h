@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "model.h"
+#include "frustum_culler.h"
+#include "bounding_volume_tree.h"
+
+#define SCENE_STATIC_FRAMES 30		// frames an object has to stay in place before it counts as static
+
+struct SceneObject
+{
+	Model *model;
+	glm::mat4 transform;
+	GLint proxy;		// leaf in the tree, BVH_NULL_NODE until the model's bounds are known
+	GLuint still_frames;
+	bool moved;			// since the last updateMotion()
+	BoundingBox swept;	// the old and the new place of a moved object
+};
+
+// Objects placed in the world, found by frustum queries through a bounding volume
+// tree. Models still loading have no final bounds yet: they stay out of the tree
+// and every query returns them, drawing them is what uploads their meshes.
+// Objects that haven't moved for SCENE_STATIC_FRAMES frames are static, caches
+// such as the shadow map's are told where that changes and where objects moved
+class Scene
+{
+	std::vector <SceneObject> objects;
+	std::vector <GLuint> pending;
+	std::vector <BoundingBox> static_changes;
+	BoundingVolumeTree tree;
+	bool getWorldBounds(const SceneObject &object, BoundingBox &box) const;
+public:
+	Scene() = default;
+	Scene(const Scene &) = delete;
+	Scene &operator=(const Scene &) = delete;
+	GLuint add(Model &model, const glm::mat4 &transform);
+	void setTransform(GLuint object, const glm::mat4 &transform);
+	Model &getModel(GLuint object) const;
+	const glm::mat4 &getTransform(GLuint object) const;
+	bool isStatic(GLuint object) const;
+	void updateMotion(std::vector <BoundingBox> &changed, std::vector <BoundingBox> &moving);
+	void query(const Frustum &frustum, std::vector <GLuint> &visible);
+	void printStats() const;
+};
+
+bool Scene::getWorldBounds(const SceneObject &object, BoundingBox &box) const
+{
+	BoundingBox local;
+	if (!object.model->getBounds(local.min, local.max))
+		return false;
+	box = transformBox(local, object.transform);
+	return true;
+}
+GLuint Scene::add(Model &model, const glm::mat4 &transform)
+{
+	SceneObject object = { &model, transform, BVH_NULL_NODE, 0, false, BoundingBox() };
+	objects.push_back(object);
+	pending.push_back((GLuint)objects.size() - 1);
+	return (GLuint)objects.size() - 1;
+}
+// Moves within the leaf's margin leave the tree as it is. A static object that
+// moves leaves its old place in the static changes
+void Scene::setTransform(GLuint object, const glm::mat4 &transform)
+{
+	SceneObject &scene_object = objects[object];
+	if (scene_object.transform == transform)
+		return;
+	BoundingBox box;
+	bool bounded = getWorldBounds(scene_object, box);
+	if (bounded && isStatic(object))
+		static_changes.push_back(box);
+	if (bounded && !scene_object.moved)
+		scene_object.swept = box;
+	scene_object.transform = transform;
+	scene_object.moved = true;
+	if (!bounded || !getWorldBounds(scene_object, box))
+		return;
+	scene_object.swept.min = glm::min(scene_object.swept.min, box.min);
+	scene_object.swept.max = glm::max(scene_object.swept.max, box.max);
+	if (scene_object.proxy != BVH_NULL_NODE)
+		tree.move(scene_object.proxy, box);
+}
+Model &Scene::getModel(GLuint object) const { return *objects[object].model; }
+const glm::mat4 &Scene::getTransform(GLuint object) const { return objects[object].transform; }
+bool Scene::isStatic(GLuint object) const { return objects[object].still_frames >= SCENE_STATIC_FRAMES; }
+// Called once a frame after the transforms are set. Fills changed with the
+// boxes where static geometry appeared or disappeared since the last call and
+// moving with the boxes swept by the objects that moved
+void Scene::updateMotion(std::vector <BoundingBox> &changed, std::vector <BoundingBox> &moving)
+{
+	moving.clear();
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		SceneObject &object = objects[i];
+		BoundingBox box;
+		if (object.moved && getWorldBounds(object, box))
+		{
+			BoundingBox swept = { glm::min(object.swept.min, box.min), glm::max(object.swept.max, box.max) };
+			moving.push_back(swept);
+		}
+		// Meshes of a loading model keep arriving, it isn't static until they all have
+		if (object.moved || !object.model->isLoaded())
+			object.still_frames = 0;
+		else if (object.still_frames < SCENE_STATIC_FRAMES && ++object.still_frames == SCENE_STATIC_FRAMES && getWorldBounds(object, box))
+			static_changes.push_back(box);
+		object.moved = false;
+	}
+	changed.swap(static_changes);
+	static_changes.clear();
+}
+// Clears visible and fills it with the objects whose boxes intersect the frustum
+void Scene::query(const Frustum &frustum, std::vector <GLuint> &visible)
+{
+	visible.clear();
+	for (size_t i = 0; i < pending.size();)
+	{
+		SceneObject &object = objects[pending[i]];
+		BoundingBox box;
+		if (object.model->isLoaded() && getWorldBounds(object, box))
+		{
+			object.proxy = tree.insert(box, pending[i]);
+			pending[i] = pending.back();
+			pending.pop_back();
+			continue;
+		}
+		visible.push_back(pending[i++]);
+	}
+	tree.query(frustum, visible);
+}
+void Scene::printStats() const
+{
+	const BoundingVolumeTreeStats &stats = tree.getStats();
+	GLuint static_objects = 0;
+	for (size_t i = 0; i < objects.size(); ++i)
+		static_objects += isStatic((GLuint)i);
+	std::cout << "Scene: " << objects.size() << " objects (" << static_objects << " static), " << pending.size() << " loading, tree height " << tree.getHeight()
+		<< ", " << (stats.queries ? stats.nodes_visited / stats.queries : 0) << " nodes visited per query, "
+		<< stats.reinsertions << " of " << stats.moves << " moves reinserted\n";
+}
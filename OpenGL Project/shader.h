@@ -3,23 +3,101 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <string>
+#include <vector>
+#include <cstdint>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include "uniform_buffers.h"
+#include "gl_state.h"
+#include "program_cache.h"
+
+// 64-bit FNV-1a, usable in constant expressions so literal names are hashed at compile time
+constexpr uint64_t hashUniformName(const char *name)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (; *name; ++name)
+		hash = (hash ^ (unsigned char)*name) * 1099511628211ull;
+	return hash;
+}
+
+struct UniformName
+{
+	uint64_t hash;
+	constexpr UniformName() : hash(0) {}
+	constexpr UniformName(const char *name) : hash(hashUniformName(name)) {}
+	UniformName(const std::string &name) : hash(hashUniformName(name.c_str())) {}
+};
+
+// "view"_uniform is always folded by the compiler, a plain literal usually is
+constexpr UniformName operator"" _uniform(const char *name, size_t) { return UniformName(name); }
+
+// GL types a C++ value may be uploaded to
+template <class T> struct UniformType;
+template <> struct UniformType <GLint> { static bool matches(GLenum type); };
+template <> struct UniformType <GLfloat> { static bool matches(GLenum type) { return type == GL_FLOAT; } };
+template <> struct UniformType <glm::vec3> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC3; } };
+template <> struct UniformType <glm::vec4> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC4; } };
+template <> struct UniformType <glm::mat3> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT3; } };
+template <> struct UniformType <glm::mat4> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT4; } };
+
+bool UniformType <GLint>::matches(GLenum type)
+{
+	switch (type)
+	{
+	case GL_INT: case GL_BOOL:
+	case GL_SAMPLER_2D: case GL_SAMPLER_CUBE: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_2D_ARRAY: case GL_SAMPLER_2D_ARRAY_SHADOW: case GL_SAMPLER_BUFFER:
+	case GL_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_2D:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Location resolved once, checked against the reflected type
+template <class T> struct Uniform
+{
+	GLint location;
+	bool isValid() const { return location >= 0; }
+};
 
 class Shader 
 {
+	struct UniformSlot
+	{
+		uint64_t hash;
+		GLint location;
+		GLenum type;
+	};
 	GLuint shader_id;
+	std::vector <UniformSlot> uniforms;		// open addressing, power of two size, hash 0 marks a free slot
 	void checkCompileStatus(GLuint shader, GLint type);
+	static std::string insertDefines(const std::string &source, const std::string &defines);
+	static std::string readLibraries(const std::vector <std::string> &library_paths);
+	void reflectUniforms();
+	void bindUniformBlocks();
+	void addUniform(const std::string &name, GLint location, GLenum type);
+	const UniformSlot *findUniform(UniformName name) const;
+	GLint getLocation(UniformName name) const;
+	static void upload(GLint location, GLint value);
+	static void upload(GLint location, GLfloat value);
+	static void upload(GLint location, const glm::vec3 &value);
+	static void upload(GLint location, const glm::vec4 &value);
+	static void upload(GLint location, const glm::mat3 &value);
+	static void upload(GLint location, const glm::mat4 &value);
 public:
-	Shader(const std::string &vertex_shader_path, const std::string &fragment_shader_path);
+	Shader(const std::string &vertex_shader_path, const std::string &fragment_shader_path, const std::string &defines, const std::string &geometry_shader_path,
+		const std::vector <std::string> &library_paths);
 	GLuint getID();
 	void use();
-	void setUniform(const std::string &name, GLint value) const;
-	void setUniform(const std::string &name, GLfloat value) const;
-	void setUniform(const std::string &name, glm::mat3 value) const;
-	void setUniform(const std::string &name, glm::mat4 value) const;
-	void setUniform(const std::string &name, glm::vec3 value) const;
+	template <class T> Uniform <T> getUniform(UniformName name) const;
+	template <class T> void setUniform(Uniform <T> uniform, const T &value) const;
+	void setUniform(UniformName name, GLint value) const;
+	void setUniform(UniformName name, GLfloat value) const;
+	void setUniform(UniformName name, glm::mat3 value) const;
+	void setUniform(UniformName name, glm::mat4 value) const;
+	void setUniform(UniformName name, glm::vec3 value) const;
+	void setUniform(UniformName name, glm::vec4 value) const;
 };
 
 void Shader::checkCompileStatus(GLuint shader, GLint type) 
@@ -34,17 +112,53 @@ void Shader::checkCompileStatus(GLuint shader, GLint type)
 		std::cout << "Error while compiling shader\n" << info_log << std::endl;
 	}
 }
-Shader::Shader(const std::string &vertex_shader_path, const std::string &fragment_shader_path) 
+std::string Shader::insertDefines(const std::string &source, const std::string &defines)
+{
+	// Right after #version, which has to stay the first line
+	if (defines.empty())
+		return source;
+	size_t version = source.find("#version");
+	size_t line_end = version == std::string::npos ? std::string::npos : source.find('\n', version);
+	if (line_end == std::string::npos)
+		return defines + "\n" + source;
+	return source.substr(0, line_end + 1) + defines + "\n" + source.substr(line_end + 1);
+}
+// Shared sources, concatenated in order
+std::string Shader::readLibraries(const std::vector <std::string> &library_paths)
+{
+	std::string source;
+	for (size_t i = 0; i < library_paths.size(); ++i)
+	{
+		std::ifstream library_file(library_paths[i]);
+		if (!library_file)
+		{
+			std::cout << "Error opening file!\n";
+			continue;
+		}
+		std::stringstream library_stream;
+		library_stream << library_file.rdbuf();
+		source += library_stream.str() + "\n";
+	}
+	return source;
+}
+// The geometry stage is optional, an empty path leaves it out. Libraries go
+// into the geometry and fragment stages right after the defines, so their
+// #ifdefs see the variant
+Shader::Shader(const std::string &vertex_shader_path, const std::string &fragment_shader_path, const std::string &defines = "", const std::string &geometry_shader_path = "",
+	const std::vector <std::string> &library_paths = std::vector <std::string>()) 
 {
 	const char *vertex_shader_src;
 	const char *fragment_shader_src;
 	std::string vertex_shader_src_s;
 	std::string fragment_shader_src_s;
+	std::string geometry_shader_src_s;
 	std::ifstream vertex_shader_file;
 	std::ifstream fragment_shader_file;
+	std::ifstream geometry_shader_file;
 
 	vertex_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 	fragment_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	geometry_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 	try 
 	{
 		vertex_shader_file.open(vertex_shader_path);
@@ -60,15 +174,41 @@ Shader::Shader(const std::string &vertex_shader_path, const std::string &fragmen
 
 		vertex_shader_src_s = vertex_shader_stream.str();
 		fragment_shader_src_s = fragment_shader_stream.str();
+
+		if (!geometry_shader_path.empty())
+		{
+			geometry_shader_file.open(geometry_shader_path);
+			std::stringstream geometry_shader_stream;
+			geometry_shader_stream << geometry_shader_file.rdbuf();
+			geometry_shader_file.close();
+			geometry_shader_src_s = geometry_shader_stream.str();
+		}
 	} 
 	catch (std::ifstream::failure &a) 
 	{
 		std::cout << "Error opening file!\n";
 	};
 	
+	std::string library_src_s = readLibraries(library_paths);
+	vertex_shader_src_s = insertDefines(vertex_shader_src_s, defines);
+	fragment_shader_src_s = insertDefines(insertDefines(fragment_shader_src_s, library_src_s), defines);
+	if (!geometry_shader_src_s.empty())
+		geometry_shader_src_s = insertDefines(insertDefines(geometry_shader_src_s, library_src_s), defines);
 	vertex_shader_src = vertex_shader_src_s.c_str();
 	fragment_shader_src = fragment_shader_src_s.c_str();
 
+	ProgramBinaryCache &cache = ProgramBinaryCache::instance();
+	uint64_t cache_key = cache.getKey(vertex_shader_src_s, fragment_shader_src_s, geometry_shader_src_s);
+	shader_id = glCreateProgram();
+	if (cache.load(shader_id, cache_key))
+	{
+		reflectUniforms();
+		bindUniformBlocks();
+		return;
+	}
+	glDeleteProgram(shader_id);
+	GLfloat compile_start = (GLfloat)glfwGetTime();
+
 	GLuint vertex_shader, fragment_shader;
 	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 	glShaderSource(vertex_shader, 1, &vertex_shader_src, NULL);
@@ -79,20 +219,153 @@ Shader::Shader(const std::string &vertex_shader_path, const std::string &fragmen
 	glShaderSource(fragment_shader, 1, &fragment_shader_src, NULL);
 	glCompileShader(fragment_shader);
 	checkCompileStatus(fragment_shader, GL_COMPILE_STATUS);
+
+	GLuint geometry_shader = 0;
+	if (!geometry_shader_src_s.empty())
+	{
+		const char *geometry_shader_src = geometry_shader_src_s.c_str();
+		geometry_shader = glCreateShader(GL_GEOMETRY_SHADER);
+		glShaderSource(geometry_shader, 1, &geometry_shader_src, NULL);
+		glCompileShader(geometry_shader);
+		checkCompileStatus(geometry_shader, GL_COMPILE_STATUS);
+	}
 	
 	shader_id = glCreateProgram();
+	cache.prepare(shader_id);
 	glAttachShader(shader_id, vertex_shader);
 	glAttachShader(shader_id, fragment_shader);
+	if (geometry_shader)
+		glAttachShader(shader_id, geometry_shader);
 	glLinkProgram(shader_id);
 	checkCompileStatus(shader_id, GL_LINK_STATUS);
 
 	glDeleteShader(vertex_shader);
 	glDeleteShader(fragment_shader);
+	if (geometry_shader)
+		glDeleteShader(geometry_shader);
+	cache.store(shader_id, cache_key, ((GLfloat)glfwGetTime() - compile_start) * 1000.0f);
+
+	reflectUniforms();
+	bindUniformBlocks();
+}
+void Shader::reflectUniforms()
+{
+	GLint count = 0, max_length = 0;
+	glGetProgramiv(shader_id, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(shader_id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+	GLuint table_size = 16;
+	while (table_size < count * 4)
+		table_size *= 2;
+	UniformSlot empty = { 0, -1, GL_NONE };
+	uniforms.assign(table_size, empty);
+
+	std::vector <char> name_buffer(max_length + 1);
+	for (GLint i = 0; i < count; ++i)
+	{
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(shader_id, i, (GLsizei)name_buffer.size(), nullptr, &size, &type, name_buffer.data());
+		std::string name = name_buffer.data();
+		GLint location = glGetUniformLocation(shader_id, name.c_str());
+		if (location < 0)
+			continue;	// Block members have no location
+
+		// Arrays are reported as "name[0]", every element is registered along with the bare name
+		size_t bracket = name.rfind("[0]");
+		if (bracket != std::string::npos && bracket + 3 == name.size())
+		{
+			std::string base = name.substr(0, bracket);
+			addUniform(base, location, type);
+			for (GLint j = 0; j < size; ++j)
+			{
+				std::string element = base + "[" + std::to_string(j) + "]";
+				addUniform(element, glGetUniformLocation(shader_id, element.c_str()), type);
+			}
+		}
+		else
+			addUniform(name, location, type);
+	}
+}
+void Shader::bindUniformBlocks()
+{
+	GLint count = 0;
+	glGetProgramiv(shader_id, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	for (GLint i = 0; i < count; ++i)
+	{
+		char name[256];
+		glGetActiveUniformBlockName(shader_id, i, sizeof(name), nullptr, name);
+		GLint binding = getUniformBlockBinding(name);
+		if (binding >= 0)
+			glUniformBlockBinding(shader_id, i, binding);
+		else
+			std::cout << "Unknown uniform block " << name << std::endl;
+	}
+}
+void Shader::addUniform(const std::string &name, GLint location, GLenum type)
+{
+	if (location < 0)
+		return;
+	uint64_t hash = hashUniformName(name.c_str());
+	GLuint mask = (GLuint)uniforms.size() - 1;
+	for (GLuint i = (GLuint)hash & mask; ; i = (i + 1) & mask)
+	{
+		if (uniforms[i].hash == 0)
+		{
+			UniformSlot slot = { hash, location, type };
+			uniforms[i] = slot;
+			return;
+		}
+		if (uniforms[i].hash == hash)
+		{
+			if (uniforms[i].location != location)
+				std::cout << "Uniform name hash collision: " << name << std::endl;
+			return;
+		}
+	}
+}
+const Shader::UniformSlot *Shader::findUniform(UniformName name) const
+{
+	if (uniforms.empty() || name.hash == 0)
+		return nullptr;
+	GLuint mask = (GLuint)uniforms.size() - 1;
+	for (GLuint i = (GLuint)name.hash & mask; uniforms[i].hash != 0; i = (i + 1) & mask)
+		if (uniforms[i].hash == name.hash)
+			return &uniforms[i];
+	return nullptr;
+}
+GLint Shader::getLocation(UniformName name) const
+{
+	const UniformSlot *slot = findUniform(name);
+	return slot ? slot->location : -1;
+}
+void Shader::upload(GLint location, GLint value) { glUniform1i(location, value); }
+void Shader::upload(GLint location, GLfloat value) { glUniform1f(location, value); }
+void Shader::upload(GLint location, const glm::vec3 &value) { glUniform3f(location, value.x, value.y, value.z); }
+void Shader::upload(GLint location, const glm::vec4 &value) { glUniform4f(location, value.x, value.y, value.z, value.w); }
+void Shader::upload(GLint location, const glm::mat3 &value) { glUniformMatrix3fv(location, 1, GL_FALSE, glm::value_ptr(value)); }
+void Shader::upload(GLint location, const glm::mat4 &value) { glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value)); }
+template <class T> Uniform <T> Shader::getUniform(UniformName name) const
+{
+	Uniform <T> uniform = { -1 };
+	const UniformSlot *slot = findUniform(name);
+	if (slot && UniformType <T>::matches(slot->type))
+		uniform.location = slot->location;
+	else if (slot)
+		std::cout << "Uniform type mismatch in program " << shader_id << std::endl;
+	return uniform;
+}
+template <class T> void Shader::setUniform(Uniform <T> uniform, const T &value) const
+{
+	if (uniform.location >= 0)
+		upload(uniform.location, value);
 }
-void Shader::use() { glUseProgram(shader_id); }
+void Shader::use() { GLState::instance().useProgram(shader_id); }
 GLuint Shader::getID() { return shader_id; }
-void Shader::setUniform(const std::string & name, GLint value) const { glUniform1i(glGetUniformLocation(shader_id, name.c_str()), value); }
-void Shader::setUniform(const std::string & name, GLfloat value) const { glUniform1f(glGetUniformLocation(shader_id, name.c_str()), value); }
-void Shader::setUniform(const std::string & name, glm::mat3 value) const { glUniformMatrix3fv(glGetUniformLocation(shader_id, name.c_str()), 1, GL_FALSE, glm::value_ptr(value)); }
-void Shader::setUniform(const std::string & name, glm::mat4 value) const { glUniformMatrix4fv(glGetUniformLocation(shader_id, name.c_str()), 1, GL_FALSE, glm::value_ptr(value)); }
-void Shader::setUniform(const std::string & name, glm::vec3 value) const { glUniform3f(glGetUniformLocation(shader_id, name.c_str()), value.x, value.y, value.z); }
\ No newline at end of file
+// Inactive or unknown names are skipped the same way glUniform* ignores location -1
+void Shader::setUniform(UniformName name, GLint value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
+void Shader::setUniform(UniformName name, GLfloat value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
+void Shader::setUniform(UniformName name, glm::mat3 value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
+void Shader::setUniform(UniformName name, glm::mat4 value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
+void Shader::setUniform(UniformName name, glm::vec3 value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
+void Shader::setUniform(UniformName name, glm::vec4 value) const { GLint location = getLocation(name); if (location >= 0) upload(location, value); }
\ No newline at end of file
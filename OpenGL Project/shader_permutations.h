@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+#include <glad/glad.h>
+#include "shader.h"
+#include "uniform_buffers.h"
+
+// Feature bits of a program variant. Material bits come from the mesh, the
+// rest from the scene. The point light count lives in the upper bits
+typedef GLuint ShaderFeatures;
+enum ShaderFeature
+{
+	SHADER_NORMAL_MAP = 1 << 0,
+	SHADER_SPECULAR_MAP = 1 << 1,
+	SHADER_EMISSION_MAP = 1 << 2,
+	SHADER_SHADOWS = 1 << 3,
+	SHADER_PACKED_VERTEX = 1 << 4,
+	SHADER_TEXTURE_ARRAYS = 1 << 5,
+	SHADER_INSTANCED = 1 << 6,
+	SHADER_CLUSTERED_LIGHTS = 1 << 7,	// point lights come from the cluster grid, the count bits are ignored
+	SHADER_POINT_SHADOWS = 1 << 8,		// clustered point lights look up their tiles in the point shadow atlas
+};
+#define SHADER_POINT_LIGHTS_SHIFT 9
+#define SHADER_POINT_LIGHTS_MASK (0xff << SHADER_POINT_LIGHTS_SHIFT)
+
+ShaderFeatures shaderPointLights(GLuint count);
+GLuint getShaderPointLights(ShaderFeatures features);
+std::string getShaderDefines(ShaderFeatures features);
+std::vector <std::string> getLightingLibraries();
+
+ShaderFeatures shaderPointLights(GLuint count)
+{
+	return (count < MAX_POINT_LIGHTS ? count : MAX_POINT_LIGHTS) << SHADER_POINT_LIGHTS_SHIFT;
+}
+GLuint getShaderPointLights(ShaderFeatures features) { return (features & SHADER_POINT_LIGHTS_MASK) >> SHADER_POINT_LIGHTS_SHIFT; }
+std::string getShaderDefines(ShaderFeatures features)
+{
+	std::string defines;
+	if (features & SHADER_NORMAL_MAP)
+		defines += "#define HAS_NORMAL_MAP\n";
+	if (features & SHADER_SPECULAR_MAP)
+		defines += "#define HAS_SPECULAR_MAP\n";
+	if (features & SHADER_EMISSION_MAP)
+		defines += "#define HAS_EMISSION_MAP\n";
+	if (features & SHADER_SHADOWS)
+		defines += "#define HAS_SHADOWS\n";
+	if (features & SHADER_PACKED_VERTEX)
+		defines += "#define PACKED_VERTEX\n";
+	if (features & SHADER_TEXTURE_ARRAYS)
+		defines += "#define TEXTURE_ARRAYS\n";
+	if (features & SHADER_INSTANCED)
+		defines += "#define INSTANCED\n";
+	if (features & SHADER_CLUSTERED_LIGHTS)
+		defines += "#define CLUSTERED_LIGHTS\n";
+	if (features & SHADER_POINT_SHADOWS)
+		defines += "#define HAS_POINT_SHADOWS\n";
+	defines += "#define NUM_POINT_LIGHTS " + std::to_string(getShaderPointLights(features));
+	return defines;
+}
+// Shared by every pass that lights a surface: forward, deferred and visibility resolve
+std::vector <std::string> getLightingLibraries() { return { "point_shadow_faces.glsl", "lighting.glsl" }; }
+
+// Programs built from one pair of sources, compiled on first use of a feature
+// set. The setup callback runs once per new variant for the uniforms that
+// never change afterwards (sampler units, constants). Libraries are inserted
+// after the defines, as in Shader
+class ShaderVariants
+{
+	std::string vertex_path, fragment_path;
+	std::vector <std::string> library_paths;
+	std::function<void(Shader &)> setup;
+	std::unordered_map <ShaderFeatures, std::unique_ptr <Shader> > variants;
+public:
+	ShaderVariants(const std::string &vertex_path, const std::string &fragment_path, std::function<void(Shader &)> setup, const std::vector <std::string> &library_paths);
+	ShaderVariants(const ShaderVariants &) = delete;
+	ShaderVariants &operator=(const ShaderVariants &) = delete;
+	Shader &get(ShaderFeatures features);
+	size_t getVariantCount() const;
+};
+
+ShaderVariants::ShaderVariants(const std::string &vertex_path, const std::string &fragment_path, std::function<void(Shader &)> setup = nullptr,
+	const std::vector <std::string> &library_paths = std::vector <std::string>()) :
+	vertex_path(vertex_path), fragment_path(fragment_path), library_paths(library_paths), setup(setup) {}
+Shader &ShaderVariants::get(ShaderFeatures features)
+{
+	auto found = variants.find(features);
+	if (found != variants.end())
+		return *found->second;
+
+	std::unique_ptr <Shader> shader(new Shader(vertex_path, fragment_path, getShaderDefines(features), "", library_paths));
+	if (setup)
+	{
+		shader->use();
+		setup(*shader);
+	}
+	std::cout << "Shader variant " << fragment_path << " 0x" << std::hex << features << std::dec << " built\n";
+	Shader &result = *shader;
+	variants[features] = std::move(shader);
+	return result;
+}
+size_t ShaderVariants::getVariantCount() const { return variants.size(); }
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "gl_state.h"
+#include "shader.h"
+#include "shader_permutations.h"
+#include "uniform_buffers.h"
+#include "instancing.h"
+#include "model.h"
+#include "render_queue.h"
+#include "light_clusters.h"
+#include "gbuffer.h"
+#include "visibility_buffer.h"
+#include "shadow_cascades.h"
+#include "texture_loader.h"
+
+#define SHADING_BENCHMARK_LIGHTS 32
+
+enum ShadingMode
+{
+	SHADING_FORWARD,
+	SHADING_DEFERRED,
+	SHADING_VISIBILITY,
+	SHADING_MODE_COUNT
+};
+
+// Renders a cloud of copies of one model with forward shading, through the
+// G-buffer and through the visibility buffer, at every level of detail from the
+// coarsest to the full mesh. Forward shading pays for every fragment that
+// survives the depth test as it is drawn, deferred for writing the G-buffer, the
+// visibility buffer only for two integers per fragment and then for rebuilding
+// the triangle of each pixel once. GPU time is the sum of the opaque and
+// lighting passes. Started with --benchmark-shading
+void benchmarkShading(const std::string &path, GLuint width, GLuint height, GLuint count, GLuint frames = 20)
+{
+	Model model(path, false, VERTEX_FORMAT_QUANTIZED, true);
+	TextureLoader::instance().finish();
+
+	ShaderVariants forward_shader("vertex.vsh", "fragment.fsh", [](Shader &variant)
+	{
+		variant.setUniform("material.shininess", 64.0f);
+		variant.setUniform("shadow_map", 15);
+		variant.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+		variant.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+		variant.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+	}, getLightingLibraries());
+	ShaderVariants gbuffer_shader("vertex.vsh", "fragment_gbuffer.fsh");
+	Shader deferred_shader("vertex_fullscreen.vsh", "fragment_deferred.fsh", getShaderDefines(SHADER_SHADOWS | SHADER_CLUSTERED_LIGHTS), "", getLightingLibraries());
+	Shader visibility_shader("vertex_visibility.vsh", "fragment_visibility.fsh");
+	Shader visibility_instanced_shader("vertex_visibility.vsh", "fragment_visibility.fsh", getShaderDefines(SHADER_INSTANCED));
+	Shader material_depth_shader("vertex_fullscreen.vsh", "fragment_material_depth.fsh");
+	ShaderVariants resolve_shader("vertex_fullscreen.vsh", "fragment_visibility_resolve.fsh", [](Shader &variant)
+	{
+		VisibilityBuffer::setSamplers(variant);
+		variant.setUniform("material.shininess", 64.0f);
+		variant.setUniform("shadow_map", 15);
+		variant.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+		variant.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+		variant.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+	}, getLightingLibraries());
+	deferred_shader.use();
+	deferred_shader.setUniform("albedo_specular", GBUFFER_TEXTURE_UNIT + GBUFFER_ALBEDO_SPECULAR);
+	deferred_shader.setUniform("octahedral_normal", GBUFFER_TEXTURE_UNIT + GBUFFER_NORMAL);
+	deferred_shader.setUniform("emission", GBUFFER_TEXTURE_UNIT + GBUFFER_EMISSION);
+	deferred_shader.setUniform("depth", GBUFFER_TEXTURE_UNIT + GBUFFER_TARGET_COUNT);
+	deferred_shader.setUniform("shadow_map", 15);
+	deferred_shader.setUniform("cluster_grid", CLUSTER_TEXTURE_UNIT);
+	deferred_shader.setUniform("cluster_lights", CLUSTER_TEXTURE_UNIT + 1);
+	deferred_shader.setUniform("light_data", CLUSTER_TEXTURE_UNIT + 2);
+	deferred_shader.setUniform("shininess", 64.0f);
+	material_depth_shader.use();
+	VisibilityBuffer::setSamplers(material_depth_shader);
+
+	// The copies fill a sphere in front of the camera and hide each other, as an asteroid field would
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, 30.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(50.0f), (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);
+	std::vector <glm::mat4> transforms(count);
+	srand(1);
+	for (GLuint i = 0; i < count; ++i)
+	{
+		glm::vec3 direction = glm::normalize(glm::vec3(rand() - RAND_MAX / 2, rand() - RAND_MAX / 2, rand() - RAND_MAX / 2) + glm::vec3(0.001f));
+		GLfloat radius = 12.0f * pow((GLfloat)rand() / RAND_MAX, 1.0f / 3.0f), scale = 0.1f + 0.2f * rand() / RAND_MAX;
+		transforms[i] = glm::translate(glm::mat4(1.0f), direction * radius);
+		transforms[i] = glm::rotate(transforms[i], glm::radians(360.0f * rand() / RAND_MAX), glm::vec3(0.3f, 1.0f, 0.1f));
+		transforms[i] = glm::scale(transforms[i], glm::vec3(scale));
+	}
+	InstanceBuffer instances;
+	instances.update(transforms);
+
+	// The shadow map is one cascade of one texel at the far plane, so every fragment is lit and none is skipped
+	GLuint shadow_map;
+	GLfloat far_depth = 1.0f;
+	glGenTextures(1, &shadow_map);
+	GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, shadow_map);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT, 1, 1, 1, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &far_depth);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	UniformBuffer frame_buffer(FRAME_UNIFORMS_BINDING, sizeof(FrameUniforms)), light_buffer(LIGHT_UNIFORMS_BINDING, sizeof(LightUniforms));
+	UniformBuffer shadow_buffer(SHADOW_UNIFORMS_BINDING, sizeof(ShadowUniforms));
+	glm::mat4 light_space = glm::ortho(-15.0f, 15.0f, -15.0f, 15.0f, 1.0f, 40.0f) * glm::lookAt(glm::vec3(0.0f, 0.0f, 20.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	FrameUniforms frame = { view, projection, projection * view, glm::vec4(0.0f, 0.0f, 30.0f, 1.0f) };
+	frame_buffer.update(frame);
+	ShadowUniforms shadows = {};
+	shadows.cascade_space[0] = light_space;
+	shadows.view_to_cascade[0] = light_space * glm::inverse(view);
+	shadows.cascade_count = 1;
+	shadow_buffer.update(shadows);
+	LightUniforms lights = {};
+	lights.dir_light.dir = glm::mat3(view) * glm::normalize(glm::vec3(0.0f, 0.0f, -1.0f));
+	lights.dir_light.ambient_intensity = glm::vec3(0.03f, 0.02f, 0.01f);
+	lights.dir_light.diffuse_intensity = glm::vec3(0.9f, 0.8f, 0.8f);
+	lights.dir_light.specular_intensity = glm::vec3(1.0f, 0.7f, 0.0f);
+	std::vector <PointLightUniforms> point_lights(SHADING_BENCHMARK_LIGHTS);
+	for (int i = 0; i < SHADING_BENCHMARK_LIGHTS; ++i)
+	{
+		GLfloat angle = glm::radians(360.0f * i / SHADING_BENCHMARK_LIGHTS);
+		point_lights[i] = PointLightUniforms();
+		point_lights[i].pos = glm::vec3(8.0f * sin(angle), 4.0f * cos(angle * 3.0f), 8.0f * cos(angle));
+		point_lights[i].diffuse_intensity = point_lights[i].specular_intensity = glm::vec3(0.6f, 0.5f, 0.4f);
+		point_lights[i].constant = 1.0f;
+		point_lights[i].linear = 0.7f;
+		point_lights[i].quadratic = 1.8f;
+	}
+	LightClusterGrid light_clusters;
+	light_clusters.setProjection(projection, 0.1f, 100.0f, width, height);
+	light_clusters.fillUniforms(lights);
+	light_buffer.update(lights);
+	light_clusters.update(point_lights, view);
+
+	GBuffer gbuffer(width, height);
+	VisibilityBuffer visibility_buffer(width, height);
+	ShaderFeatures lit_features = SHADER_SHADOWS | SHADER_CLUSTERED_LIGHTS;
+	static const char *mode_names[SHADING_MODE_COUNT] = { "forward", "deferred", "visibility" };
+
+	std::cout << "Shading benchmark: " << count << " copies of " << path << ", " << width << "x" << height << ", "
+		<< SHADING_BENCHMARK_LIGHTS << " point lights\n";
+	for (GLint lod = MESH_MAX_LODS - 1; lod >= 0; --lod)
+	{
+		double times[SHADING_MODE_COUNT];
+		GLuint triangles = 0;
+		for (int mode = 0; mode < SHADING_MODE_COUNT; ++mode)
+		{
+			// A queue per run, its timers average only the frames of this mode
+			RenderQueue queue;
+			queue.setPass(RENDER_PASS_OPAQUE, [&]()
+			{
+				GLState::instance().cullFace(GL_BACK);
+				GLState::instance().depthFunc(GL_LESS);
+				GLState::instance().bindTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, shadow_map);
+				light_clusters.bind();
+				if (mode == SHADING_DEFERRED)
+				{
+					glDisable(GL_BLEND);
+					gbuffer.bind();
+				}
+				else if (mode == SHADING_VISIBILITY)
+					visibility_buffer.renderGeometry(visibility_shader, visibility_instanced_shader);
+				else
+				{
+					GLState::instance().bindFramebuffer(0);
+					glViewport(0, 0, width, height);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				}
+			});
+			queue.setPass(RENDER_PASS_LIGHTING, [&]()
+			{
+				if (mode == SHADING_FORWARD)
+					return;
+				GLState::instance().bindFramebuffer(0);
+				glViewport(0, 0, width, height);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				if (mode == SHADING_VISIBILITY)
+				{
+					visibility_buffer.resolve(material_depth_shader, resolve_shader, lit_features, 0);
+					return;
+				}
+				glEnable(GL_BLEND);
+				glDisable(GL_DEPTH_TEST);
+				deferred_shader.use();
+				deferred_shader.setUniform("inverse_projection", glm::inverse(projection));
+				gbuffer.bindTextures();
+				gbuffer.drawFullscreen();
+				glEnable(GL_DEPTH_TEST);
+			});
+			queue.setView(view);
+
+			// Timers are read back RENDER_QUEUE_TIMER_FRAMES frames late, the first ones also warm up the programs
+			for (GLuint frame_number = 0; frame_number < frames + RENDER_QUEUE_TIMER_FRAMES; ++frame_number)
+			{
+				if (mode == SHADING_VISIBILITY)
+					model.renderInstanced(visibility_buffer, instances, transforms, lod);
+				else
+					model.renderInstanced(queue, RENDER_PASS_OPAQUE, mode == SHADING_DEFERRED ? gbuffer_shader : forward_shader,
+						mode == SHADING_DEFERRED ? 0 : lit_features, instances, lod);
+				queue.submit();
+				GLState::instance().endFrame();
+			}
+			glFinish();
+			times[mode] = queue.getPassTime(RENDER_PASS_OPAQUE) + queue.getPassTime(RENDER_PASS_LIGHTING);
+			if (mode == SHADING_VISIBILITY)
+				triangles = visibility_buffer.getFrameStats().triangles;
+			queue.release();
+		}
+
+		std::cout << "  LOD " << lod << ": " << triangles << " triangles, " << triangles / (width * height / 1000.0) << " per 1000 pixels";
+		for (int mode = 0; mode < SHADING_MODE_COUNT; ++mode)
+			std::cout << ", " << mode_names[mode] << " " << times[mode] << " ms";
+		std::cout << "\n";
+	}
+
+	glDeleteTextures(1, &shadow_map);
+	GLState::instance().forgetTexture(shadow_map);
+	instances.release();
+	frame_buffer.release();
+	light_buffer.release();
+	shadow_buffer.release();
+	light_clusters.release();
+	gbuffer.release();
+	visibility_buffer.release();
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cmath>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "gl_state.h"
+#include "uniform_buffers.h"
+#include "frustum_culler.h"
+#include "bounding_volume_tree.h"
+
+#define SHADOW_TEXTURE_UNIT 15
+#define SHADOW_CASTER_DISTANCE 20.0f		// how far towards the light casters are looked for in front of a cascade
+
+struct ShadowCascadeStats
+{
+	GLuint frames;
+	GLuint updates[SHADOW_MAX_CASCADES];
+	GLuint static_updates[SHADOW_MAX_CASCADES], refreshes[SHADOW_MAX_CASCADES];
+};
+
+// Cascaded shadow maps for the directional light, one layer of a depth texture
+// array per cascade. The view frustum is split into slices between the near
+// plane and the shadow distance, each cascade covers the bounding sphere of its
+// slice: the sphere doesn't change size as the camera turns, and its center is
+// moved in whole texels of the light's view, so static geometry keeps falling
+// on the same texels and doesn't shimmer. Cascades past the first ones are only
+// re-rendered every few frames, staggered so they don't land on the same frame;
+// until then the shaders keep using the matrix the layer was rendered with.
+//
+// Each cascade is cached in two layers. Static casters go into a layer of their
+// own, redrawn only when the cascade moves, the light turns or static geometry
+// inside it changes. The layer the shaders sample is a copy of it with the
+// moving casters drawn on top, and is left alone while there are none
+class ShadowCascades
+{
+	struct Cascade
+	{
+		glm::mat4 light_space;
+		GLuint interval;		// frames between updates
+		bool rendered, due;
+		bool static_valid;
+		bool rebuild_static, refresh;		// what is drawn this frame
+		bool had_dynamic;					// moving casters were drawn into the layer last time
+	};
+	GLuint texture, framebuffer;
+	GLuint static_texture, static_framebuffer;
+	GLuint resolution, cascade_count;
+	GLfloat split_lambda, shadow_distance;
+	Cascade cascades[SHADOW_MAX_CASCADES];
+	GLfloat splits[SHADOW_MAX_CASCADES + 1];		// view distances the slices start and end at
+	glm::vec3 light_dir;
+	GLuint frame;
+	ShadowCascadeStats stats;
+	void computeSplits(GLfloat near_plane);
+	glm::mat4 fitCascade(GLuint cascade, const glm::mat4 &inverse_view, GLfloat tan_half_fov, GLfloat aspect) const;
+public:
+	ShadowCascades(GLuint resolution, GLuint cascade_count, GLfloat split_lambda, GLfloat shadow_distance, GLuint distant_interval);
+	ShadowCascades(const ShadowCascades &) = delete;
+	ShadowCascades &operator=(const ShadowCascades &) = delete;
+	void invalidate();
+	void invalidate(const BoundingBox &box);
+	void update(const glm::mat4 &view, const glm::mat4 &projection, GLfloat near_plane, const glm::vec3 &light_dir);
+	void setDynamicCasters(GLuint cascade, bool present);
+	GLuint getCascadeCount() const;
+	bool isDue(GLuint cascade) const;
+	bool needsStatic(GLuint cascade) const;
+	bool needsRefresh(GLuint cascade) const;
+	const glm::mat4 &getLightSpace(GLuint cascade) const;
+	void bindStaticLayer(GLuint cascade);
+	void bindLayer(GLuint cascade);
+	void bind() const;
+	void fillUniforms(ShadowUniforms &uniforms, const glm::mat4 &view) const;
+	void printStats() const;
+	void release();
+};
+
+// split_lambda blends uniform (0) and logarithmic (1) split distances. The first
+// half of the cascades is rendered every frame, the rest every distant_interval
+ShadowCascades::ShadowCascades(GLuint resolution, GLuint cascade_count, GLfloat split_lambda, GLfloat shadow_distance, GLuint distant_interval = 4) :
+	resolution(resolution), cascade_count(glm::clamp(cascade_count, 1u, (GLuint)SHADOW_MAX_CASCADES)), split_lambda(split_lambda),
+	shadow_distance(shadow_distance), light_dir(0.0f), frame(0), stats()
+{
+	for (GLuint i = 0; i < SHADOW_MAX_CASCADES; ++i)
+	{
+		cascades[i].light_space = glm::mat4(1.0f);
+		cascades[i].interval = i < (this->cascade_count + 1) / 2 ? 1 : glm::max(distant_interval, 1u);
+		cascades[i].rendered = cascades[i].due = false;
+		cascades[i].static_valid = cascades[i].rebuild_static = cascades[i].refresh = cascades[i].had_dynamic = false;
+	}
+
+	GLuint textures[2], framebuffers[2];
+	glGenTextures(2, textures);
+	glGenFramebuffers(2, framebuffers);
+	for (int i = 0; i < 2; ++i)
+	{
+		GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution, resolution, this->cascade_count, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		GLState::instance().bindFramebuffer(framebuffers[i]);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textures[i], 0, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "Shadow cascades are incomplete\n";
+	}
+	GLState::instance().bindFramebuffer(0);
+	texture = textures[0];
+	framebuffer = framebuffers[0];
+	static_texture = textures[1];
+	static_framebuffer = framebuffers[1];
+}
+// Practical split scheme: logarithmic splits keep the texel to pixel ratio even
+// but make the first cascade tiny, uniform ones waste the near cascades
+void ShadowCascades::computeSplits(GLfloat near_plane)
+{
+	for (GLuint i = 0; i <= cascade_count; ++i)
+	{
+		GLfloat part = (GLfloat)i / cascade_count;
+		GLfloat logarithmic = near_plane * pow(shadow_distance / near_plane, part);
+		GLfloat uniform = near_plane + (shadow_distance - near_plane) * part;
+		splits[i] = split_lambda * logarithmic + (1.0f - split_lambda) * uniform;
+	}
+}
+glm::mat4 ShadowCascades::fitCascade(GLuint cascade, const glm::mat4 &inverse_view, GLfloat tan_half_fov, GLfloat aspect) const
+{
+	// Slice corners in view space, the sphere is centered on their average
+	glm::vec3 corners[8];
+	glm::vec3 center(0.0f);
+	for (int i = 0; i < 8; ++i)
+	{
+		GLfloat distance = splits[cascade + (i >> 2)];
+		GLfloat y = distance * tan_half_fov, x = y * aspect;
+		corners[i] = glm::vec3(i & 1 ? x : -x, i & 2 ? y : -y, -distance);
+		center += corners[i] / 8.0f;
+	}
+	GLfloat radius = 0.0f;
+	for (int i = 0; i < 8; ++i)
+		radius = glm::max(radius, glm::length(corners[i] - center));
+	radius = ceil(radius * 16.0f) / 16.0f;		// float noise would change the texel size from frame to frame
+
+	// The light's view only rotates, so snapping in it moves the cascade in whole texels of the world
+	glm::vec3 up = fabs(light_dir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::mat4 light_view = glm::lookAt(glm::vec3(0.0f), light_dir, up);
+	glm::vec3 light_center = glm::vec3(light_view * inverse_view * glm::vec4(center, 1.0f));
+	GLfloat texel = 2.0f * radius / resolution;
+	light_center.x = floor(light_center.x / texel) * texel;
+	light_center.y = floor(light_center.y / texel) * texel;
+	light_center.z = floor(light_center.z / texel) * texel;		// depth too, or the cached static layer would go stale with every step
+
+	glm::mat4 light_projection = glm::ortho(light_center.x - radius, light_center.x + radius, light_center.y - radius, light_center.y + radius,
+		-light_center.z - radius - SHADOW_CASTER_DISTANCE, -light_center.z + radius);
+	return light_projection * light_view;
+}
+void ShadowCascades::invalidate()
+{
+	for (GLuint i = 0; i < cascade_count; ++i)
+		cascades[i].static_valid = false;
+}
+// Static geometry appeared or disappeared inside the box
+void ShadowCascades::invalidate(const BoundingBox &box)
+{
+	for (GLuint i = 0; i < cascade_count; ++i)
+	{
+		GLuint plane_mask = FRUSTUM_ALL_PLANES;
+		if (cascades[i].static_valid && intersectsFrustum(extractFrustum(cascades[i].light_space), box.min, box.max, plane_mask))
+			cascades[i].static_valid = false;
+	}
+}
+// Decides which cascades are rendered this frame and fits them. A changed light
+// direction invalidates all of them, a cascade with stale static casters is
+// updated even between its intervals. Call after the invalidations of the frame
+void ShadowCascades::update(const glm::mat4 &view, const glm::mat4 &projection, GLfloat near_plane, const glm::vec3 &light_dir)
+{
+	if (light_dir != this->light_dir)
+		invalidate();
+	this->light_dir = light_dir;
+	computeSplits(near_plane);
+	glm::mat4 inverse_view = glm::inverse(view);
+	GLfloat tan_half_fov = 1.0f / projection[1][1], aspect = projection[1][1] / projection[0][0];
+	for (GLuint i = 0; i < cascade_count; ++i)
+	{
+		Cascade &cascade = cascades[i];
+		cascade.due = !cascade.static_valid || (frame + i) % cascade.interval == 0;
+		cascade.rebuild_static = cascade.refresh = false;
+		if (!cascade.due)
+			continue;
+		// Snapping keeps the matrix exactly the same until the camera has moved a whole texel
+		glm::mat4 light_space = fitCascade(i, inverse_view, tan_half_fov, aspect);
+		if (light_space != cascade.light_space)
+			cascade.static_valid = false;
+		cascade.light_space = light_space;
+		cascade.rebuild_static = !cascade.static_valid;
+		cascade.rendered = true;
+		++stats.updates[i];
+		stats.static_updates[i] += cascade.rebuild_static;
+	}
+	++frame;
+	++stats.frames;
+}
+// Reports whether moving casters were found in a due cascade. The layer is
+// redrawn when it has them now or had them last time, so they don't linger
+void ShadowCascades::setDynamicCasters(GLuint cascade, bool present)
+{
+	Cascade &current = cascades[cascade];
+	if (!current.due)
+		return;
+	current.refresh = current.rebuild_static || present || current.had_dynamic;
+	current.had_dynamic = present;
+	stats.refreshes[cascade] += current.refresh;
+}
+GLuint ShadowCascades::getCascadeCount() const { return cascade_count; }
+bool ShadowCascades::isDue(GLuint cascade) const { return cascade < cascade_count && cascades[cascade].due; }
+bool ShadowCascades::needsStatic(GLuint cascade) const { return cascade < cascade_count && cascades[cascade].rebuild_static; }
+bool ShadowCascades::needsRefresh(GLuint cascade) const { return cascade < cascade_count && cascades[cascade].refresh; }
+const glm::mat4 &ShadowCascades::getLightSpace(GLuint cascade) const { return cascades[cascade].light_space; }
+// Attaches the cascade's static layer and clears it
+void ShadowCascades::bindStaticLayer(GLuint cascade)
+{
+	GLState::instance().bindFramebuffer(static_framebuffer);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, static_texture, 0, cascade);
+	glViewport(0, 0, resolution, resolution);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	cascades[cascade].static_valid = true;
+}
+// Attaches the cascade's layer and fills it with a copy of the static one
+void ShadowCascades::bindLayer(GLuint cascade)
+{
+	GLState::instance().bindFramebuffer(framebuffer);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, cascade);
+	GLState::instance().bindReadFramebuffer(static_framebuffer);
+	glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, static_texture, 0, cascade);
+	glBlitFramebuffer(0, 0, resolution, resolution, 0, 0, resolution, resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	glViewport(0, 0, resolution, resolution);
+}
+void ShadowCascades::bind() const { GLState::instance().bindTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, texture); }
+void ShadowCascades::fillUniforms(ShadowUniforms &uniforms, const glm::mat4 &view) const
+{
+	glm::mat4 inverse_view = glm::inverse(view);
+	for (GLuint i = 0; i < cascade_count; ++i)
+	{
+		uniforms.cascade_space[i] = cascades[i].light_space;
+		uniforms.view_to_cascade[i] = cascades[i].light_space * inverse_view;
+	}
+	uniforms.cascade_count = cascade_count;
+}
+void ShadowCascades::printStats() const
+{
+	std::cout << "Shadow cascades: " << cascade_count << " of " << resolution << "x" << resolution << ", split at";
+	for (GLuint i = 1; i <= cascade_count; ++i)
+		std::cout << " " << splits[i];
+	std::cout << ", updates per frame:";
+	for (GLuint i = 0; i < cascade_count; ++i)
+		std::cout << " " << (stats.frames ? (GLfloat)stats.updates[i] / stats.frames : 0.0f);
+	std::cout << ", static layer redrawn:";
+	for (GLuint i = 0; i < cascade_count; ++i)
+		std::cout << " " << stats.static_updates[i];
+	std::cout << ", layer redrawn:";
+	for (GLuint i = 0; i < cascade_count; ++i)
+		std::cout << " " << stats.refreshes[i];
+	std::cout << " of " << stats.frames << " frames\n";
+}
+void ShadowCascades::release()
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteFramebuffers(1, &static_framebuffer);
+	GLState::instance().forgetFramebuffer(framebuffer);
+	GLState::instance().forgetFramebuffer(static_framebuffer);
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &static_texture);
+	GLState::instance().forgetTexture(texture);
+	GLState::instance().forgetTexture(static_texture);
+}
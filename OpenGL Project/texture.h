@@ -4,29 +4,74 @@
 #include <string>
 #include <glad/glad.h>
 #include "stb_image.h"
+#include "texture_loader.h"
 
 class Texture2D 
 {
 	GLuint id;
 	std::string type;
+	GLint width, height, nr_channels;
+	size_t memory_size;
+	bool ready;
 public:
-	Texture2D(const std::string &filename, const std::string &type, const std::string &directory, GLint par1, GLint par2, GLint par3, GLint par4, bool gen_mipmap);
+	Texture2D(const std::string &filename, const std::string &type, const std::string &directory, GLint par1, GLint par2, GLint par3, GLint par4, bool gen_mipmap, bool async);
+	Texture2D(const Texture2D &) = delete;
+	Texture2D &operator=(const Texture2D &) = delete;
 	GLuint getID();
+	bool isReady();
 	std::string getType();
+	size_t getMemorySize();
 	void load(std::string path, bool gen_mipmap);
 	void setParameter(GLint parameter, GLint value);
 	void bind();
 	void unbind();
 	void active(GLint slot);
+	void release();
+	static GLuint getFallback(const std::string &type);
 };
 
 Texture2D::Texture2D(const std::string &filename, const std::string &type, const std::string &directory = ".",
-	GLint par1 = GL_REPEAT, GLint par2 = GL_REPEAT, GLint par3 = GL_LINEAR_MIPMAP_LINEAR, GLint par4 = GL_LINEAR, bool gen_mipmap = true) 
-	: type(type)
+	GLint par1 = GL_REPEAT, GLint par2 = GL_REPEAT, GLint par3 = GL_LINEAR_MIPMAP_LINEAR, GLint par4 = GL_LINEAR, bool gen_mipmap = true, bool async = false) 
+	: type(type), width(0), height(0), nr_channels(0), memory_size(0), ready(false)
 {
-	stbi_set_flip_vertically_on_load(true);
 	std::string path = directory + "/" + filename ;
-	GLint width, height, nr_channels;
+	glGenTextures(1, &id);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, par1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, par2);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, par3);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, par4);
+	if (async)
+	{
+		GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+		TextureLoader::instance().request(path, true, id, GL_TEXTURE_2D, GL_TEXTURE_2D, gen_mipmap, [this](bool success, const TextureImage &image)
+		{
+			width = image.width;
+			height = image.height;
+			nr_channels = image.nr_channels;
+			memory_size = image.memory_size;
+			ready = success;
+		});
+		return;
+	}
+
+	// Block-compressed version produced by compressTextures() takes precedence over the source image
+	KtxImage compressed;
+	if (readKtx(getKtxPath(path), compressed) && compressed.flipped && isCompressedFormatSupported(compressed.internal_format))
+	{
+		uploadKtx(GL_TEXTURE_2D, compressed);
+		if (compressed.base_format == GL_RED)
+			setGrayscaleSwizzle(GL_TEXTURE_2D);
+		width = compressed.width;
+		height = compressed.height;
+		nr_channels = compressed.base_format == GL_RED ? 1 : (compressed.base_format == GL_RG ? 2 : (compressed.base_format == GL_RGB ? 3 : 4));
+		memory_size = compressed.data.size();
+		GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+		ready = true;
+		return;
+	}
+
+	stbi_set_flip_vertically_on_load(true);
 	GLenum channels = GL_RED;
 	GLubyte *data = stbi_load(path.c_str(), &width, &height, &nr_channels, 0);
 	if (data == nullptr)
@@ -42,45 +87,82 @@ Texture2D::Texture2D(const std::string &filename, const std::string &type, const
 	else if (nr_channels == 4)
 		channels = GL_RGBA;
 
-	glGenTextures(1, &id);
-	glBindTexture(GL_TEXTURE_2D, id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, par1);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, par2);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, par3);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, par4);
 	glTexImage2D(GL_TEXTURE_2D, 0, channels, width, height, 0, channels, GL_UNSIGNED_BYTE, data);
+	if (channels == GL_RED)
+		setGrayscaleSwizzle(GL_TEXTURE_2D);
 	if (gen_mipmap)
 		glGenerateMipmap(GL_TEXTURE_2D);
+	memory_size = (size_t)width * height * nr_channels * (gen_mipmap ? 4 : 3) / 3;
 	stbi_image_free(data);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+	ready = true;
 }
 GLuint Texture2D::getID() { return id; }
+bool Texture2D::isReady() { return ready; }
 std::string Texture2D::getType() { return type; }
+size_t Texture2D::getMemorySize() { return memory_size; }
 void Texture2D::load(std::string path, bool gen_mipmap)
 {
-	GLint width, height, nr_channels;
 	GLubyte *data = stbi_load(path.c_str(), &width, &height, &nr_channels, 0);
 	if (data == nullptr)
 	{
 		std::cout << "Texture loading error\n";
 		throw - 1;
 	}
-	glBindTexture(GL_TEXTURE_2D, id);
+	memory_size = (size_t)width * height * 3 * (gen_mipmap ? 4 : 3) / 3;
+	GLState::instance().bindTexture(GL_TEXTURE_2D, id);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
 	if (gen_mipmap)
 		glGenerateMipmap(GL_TEXTURE_2D);
 	stbi_image_free(data);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
 }
 void Texture2D::setParameter(GLint parameter, GLint value) {
-	glBindTexture(GL_TEXTURE_2D, id);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, id);
 	glTexParameteri(GL_TEXTURE_2D, parameter, value);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
 }
-void Texture2D::bind() { glBindTexture(GL_TEXTURE_2D, id); }
-void Texture2D::unbind() { glBindTexture(GL_TEXTURE_2D, 0); }
+void Texture2D::bind() { GLState::instance().bindTexture(GL_TEXTURE_2D, id); }
+void Texture2D::unbind() { GLState::instance().bindTexture(GL_TEXTURE_2D, 0); }
 void Texture2D::active(GLint slot) 
 {
-	glActiveTexture(slot);
-	glBindTexture(GL_TEXTURE_2D, id);
+	GLState::instance().bindTexture(slot, GL_TEXTURE_2D, id);
+}
+void Texture2D::release() 
+{
+	if (!ready)
+		TextureLoader::instance().cancel(id);
+	glDeleteTextures(1, &id);
+	GLState::instance().forgetTexture(id);
+	id = 0;
+}
+GLuint Texture2D::getFallback(const std::string &type)
+{
+	// 1x1 stand-ins used while the real map is still loading
+	static GLuint diffuse = 0, normal = 0, black = 0;
+	GLuint *id = &black;
+	GLubyte color[3] = { 0, 0, 0 };
+	if (type == "diffuse_map")
+	{
+		id = &diffuse;
+		color[0] = color[1] = color[2] = 128;
+	}
+	else if (type == "normal_map")
+	{
+		id = &normal;
+		color[0] = color[1] = 128;
+		color[2] = 255;
+	}
+	if (*id == 0)
+	{
+		glGenTextures(1, id);
+		GLState::instance().bindTexture(GL_TEXTURE_2D, *id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, color);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+	}
+	return *id;
 }
\ No newline at end of file
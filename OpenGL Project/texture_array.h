@@ -0,0 +1,236 @@
+#pragma once
+
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <glad/glad.h>
+#include "gl_state.h"
+#include "texture.h"
+#include "texture_registry.h"
+
+#define TEXTURE_ARRAY_MIN_LAYERS 4
+#define TEXTURE_ARRAY_MAX_LEVELS 16
+
+// Where a 2D texture ended up: array index in the registry and layer in it.
+// The layer is negative while the texture isn't in an array yet
+struct TextureArrayLayer
+{
+	GLuint array;
+	GLint layer;
+};
+
+// Packs material textures of the same size, format and mip count into
+// GL_TEXTURE_2D_ARRAYs, so meshes whose maps share arrays draw with the same
+// bindings and differ only in the layer index. Layers are copied on the GPU
+// from the loaded 2D texture through a pixel buffer, compressed data stays
+// compressed. The source textures are kept, the 2D binding path still uses them
+class TextureArrayRegistry
+{
+	struct TextureArray
+	{
+		GLuint texture;
+		GLenum internal_format;
+		GLint width, height, levels;
+		bool compressed;
+		GLint level_sizes[TEXTURE_ARRAY_MAX_LEVELS];		// bytes of one layer per level
+		GLint layers, capacity;
+	};
+	struct Entry
+	{
+		TextureHandle source;		// keeps the pointer key from being reused
+		TextureArrayLayer location;
+	};
+	std::vector <TextureArray> arrays;
+	std::map <Texture2D *, Entry> entries;
+	GLuint copy_buffer;
+	GLsizeiptr copy_buffer_size;
+	TextureArrayRegistry();
+	static bool describe(GLuint texture, TextureArray &description);
+	static bool isSingleChannel(GLenum internal_format);
+	void allocate(TextureArray &array, GLint capacity);
+	void copy(GLenum source_target, GLuint source, TextureArray &array, GLint first_layer, GLint layer_count);
+	GLuint findArray(const TextureArray &description);
+public:
+	static TextureArrayRegistry &instance();
+	TextureArrayLayer getLayer(const TextureHandle &texture);
+	GLuint getTexture(GLuint array) const;
+	void printStats() const;
+	void release();
+};
+
+TextureArrayRegistry::TextureArrayRegistry() : copy_buffer(0), copy_buffer_size(0) {}
+TextureArrayRegistry &TextureArrayRegistry::instance()
+{
+	static TextureArrayRegistry registry;
+	return registry;
+}
+bool TextureArrayRegistry::describe(GLuint texture, TextureArray &description)
+{
+	GLint internal_format = 0, compressed = GL_FALSE;
+	GLState::instance().bindTexture(GL_TEXTURE_2D, texture);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internal_format);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &description.width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &description.height);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+	description.internal_format = internal_format;
+	description.compressed = compressed == GL_TRUE;
+	description.levels = 0;
+	for (GLint level = 0; level < TEXTURE_ARRAY_MAX_LEVELS; ++level)
+	{
+		GLint width = 0, height = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+		if (width == 0 || height == 0)
+			break;
+		if (description.compressed)
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &description.level_sizes[level]);
+		else
+			description.level_sizes[level] = width * height * 4;		// read back as RGBA8
+		description.levels = level + 1;
+	}
+	GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+	description.texture = 0;
+	description.layers = description.capacity = 0;
+	return description.width > 0 && description.height > 0 && description.levels > 0;
+}
+bool TextureArrayRegistry::isSingleChannel(GLenum internal_format)
+{
+	return internal_format == GL_RED || internal_format == GL_R8 || internal_format == GL_COMPRESSED_RED_RGTC1;
+}
+// Arrays can't be resized, growing makes a new one and moves the existing layers over
+void TextureArrayRegistry::allocate(TextureArray &array, GLint capacity)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	for (GLint level = 0; level < array.levels; ++level)
+	{
+		GLint width = array.width >> level > 0 ? array.width >> level : 1;
+		GLint height = array.height >> level > 0 ? array.height >> level : 1;
+		if (array.compressed)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, array.internal_format, width, height, capacity, 0, array.level_sizes[level] * capacity, NULL);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, array.internal_format, width, height, capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, array.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, array.levels - 1);
+	if (isSingleChannel(array.internal_format))
+		setGrayscaleSwizzle(GL_TEXTURE_2D_ARRAY);
+	GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	GLuint old_texture = array.texture;
+	GLint old_layers = array.layers;
+	array.texture = texture;
+	array.capacity = capacity;
+	if (old_texture)
+	{
+		copy(GL_TEXTURE_2D_ARRAY, old_texture, array, 0, old_layers);
+		glDeleteTextures(1, &old_texture);
+		GLState::instance().forgetTexture(old_texture);
+	}
+}
+// Level by level: read back into the pixel buffer, then upload from it. An array
+// source is read whole, so layer_count has to be all of its layers
+void TextureArrayRegistry::copy(GLenum source_target, GLuint source, TextureArray &array, GLint first_layer, GLint layer_count)
+{
+	GLsizeiptr needed = (GLsizeiptr)array.level_sizes[0] * layer_count;
+	if (!copy_buffer)
+		glGenBuffers(1, &copy_buffer);
+	if (copy_buffer_size < needed)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, copy_buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, needed, NULL, GL_STREAM_COPY);
+		copy_buffer_size = needed;
+	}
+
+	for (GLint level = 0; level < array.levels; ++level)
+	{
+		GLint width = array.width >> level > 0 ? array.width >> level : 1;
+		GLint height = array.height >> level > 0 ? array.height >> level : 1;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, copy_buffer);
+		GLState::instance().bindTexture(source_target, source);
+		if (array.compressed)
+			glGetCompressedTexImage(source_target, level, (void *)0);
+		else
+			glGetTexImage(source_target, level, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+		GLState::instance().bindTexture(source_target, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, copy_buffer);
+		GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+		if (array.compressed)
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, first_layer, width, height, layer_count,
+				array.internal_format, array.level_sizes[level] * layer_count, (void *)0);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, first_layer, width, height, layer_count, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+		GLState::instance().bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+}
+GLuint TextureArrayRegistry::findArray(const TextureArray &description)
+{
+	for (GLuint i = 0; i < arrays.size(); ++i)
+		if (arrays[i].internal_format == description.internal_format && arrays[i].width == description.width &&
+			arrays[i].height == description.height && arrays[i].levels == description.levels)
+			return i;
+	arrays.push_back(description);
+	return (GLuint)arrays.size() - 1;
+}
+TextureArrayLayer TextureArrayRegistry::getLayer(const TextureHandle &texture)
+{
+	TextureArrayLayer location = { 0, -1 };
+	std::map <Texture2D *, Entry>::iterator it = entries.find(texture.get());
+	if (it != entries.end())
+		return it->second.location;
+	if (!texture->isReady())
+		return location;
+
+	TextureArray description;
+	if (!describe(texture->getID(), description))
+		return location;
+	GLuint index = findArray(description);
+	TextureArray &array = arrays[index];
+	GLint max_layers = 256;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	if (array.layers == max_layers)
+		return location;
+	if (array.layers == array.capacity)
+		allocate(array, array.capacity ? std::min(array.capacity * 2, max_layers) : TEXTURE_ARRAY_MIN_LAYERS);
+
+	copy(GL_TEXTURE_2D, texture->getID(), array, array.layers, 1);
+	location.array = index;
+	location.layer = array.layers++;
+	Entry entry = { texture, location };
+	entries[texture.get()] = entry;
+	return location;
+}
+GLuint TextureArrayRegistry::getTexture(GLuint array) const { return array < arrays.size() ? arrays[array].texture : 0; }
+void TextureArrayRegistry::printStats() const
+{
+	size_t memory = 0;
+	GLint layers = 0;
+	for (size_t i = 0; i < arrays.size(); ++i)
+	{
+		for (GLint level = 0; level < arrays[i].levels; ++level)
+			memory += (size_t)arrays[i].level_sizes[level] * arrays[i].capacity;
+		layers += arrays[i].layers;
+	}
+	std::cout << "Texture arrays: " << arrays.size() << " arrays, " << layers << " layers, " << memory / (1024 * 1024) << " MB\n";
+}
+void TextureArrayRegistry::release()
+{
+	for (size_t i = 0; i < arrays.size(); ++i)
+	{
+		glDeleteTextures(1, &arrays[i].texture);
+		GLState::instance().forgetTexture(arrays[i].texture);
+	}
+	arrays.clear();
+	entries.clear();
+	glDeleteBuffers(1, &copy_buffer);
+	copy_buffer = 0;
+	copy_buffer_size = 0;
+}
@@ -0,0 +1,628 @@
+#pragma once
+
+#include <cmath>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <glad/glad.h>
+#include "stb_image.h"
+#include "gl_state.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// S3TC is not part of core 3.3, but is exposed by every desktop driver
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+enum BlockFormat { BLOCK_FORMAT_BC1, BLOCK_FORMAT_BC3, BLOCK_FORMAT_BC4, BLOCK_FORMAT_BC5 };
+
+struct KtxLevel
+{
+	GLint width, height;
+	size_t offset, size;
+};
+
+// Contents of a KTX 1.1 file holding a single block-compressed 2D image with its mip chain
+struct KtxImage
+{
+	GLenum internal_format, base_format;
+	GLint width, height;
+	bool flipped;
+	std::vector <KtxLevel> levels;
+	std::vector <GLubyte> data;
+};
+
+const GLubyte ktx_identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+std::string getKtxPath(const std::string &path)
+{
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path + ".ktx";
+	return path.substr(0, dot) + ".ktx";
+}
+GLenum getBlockInternalFormat(BlockFormat format)
+{
+	switch (format)
+	{
+	case BLOCK_FORMAT_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case BLOCK_FORMAT_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case BLOCK_FORMAT_BC4: return GL_COMPRESSED_RED_RGTC1;
+	default: return GL_COMPRESSED_RG_RGTC2;
+	}
+}
+const char *getBlockFormatName(BlockFormat format)
+{
+	const char *names[] = { "BC1", "BC3", "BC4", "BC5" };
+	return names[format];
+}
+// Whether the current context can sample the given compressed format, called on the GL thread
+bool isCompressedFormatSupported(GLenum internal_format)
+{
+	static GLint s3tc = -1;
+	if (internal_format == GL_COMPRESSED_RED_RGTC1 || internal_format == GL_COMPRESSED_RG_RGTC2)
+		return true;
+	if (s3tc < 0)
+	{
+		GLint count = 0;
+		s3tc = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; ++i)
+			if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_EXT_texture_compression_s3tc") == 0)
+				s3tc = 1;
+	}
+	return s3tc == 1;
+}
+
+bool readKtx(const std::string &path, KtxImage &image)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	GLubyte identifier[12];
+	uint32_t header[13];
+	file.read((char *)identifier, sizeof(identifier));
+	file.read((char *)header, sizeof(header));
+	if (!file || memcmp(identifier, ktx_identifier, sizeof(identifier)) != 0 || header[0] != 0x04030201 ||
+		header[1] != 0 || header[3] != 0 || header[9] > 1 || header[10] != 1 || header[11] == 0)
+		return false;
+
+	image.internal_format = header[4];
+	image.base_format = header[5];
+	image.width = header[6];
+	image.height = header[7];
+	image.flipped = false;
+
+	std::vector <char> key_values(header[12]);
+	file.read(key_values.data(), key_values.size());
+	for (size_t offset = 0; offset + 4 <= key_values.size();)
+	{
+		uint32_t pair_size;
+		memcpy(&pair_size, &key_values[offset], 4);
+		std::string pair(&key_values[offset + 4], std::min((size_t)pair_size, key_values.size() - offset - 4));
+		if (pair.compare(0, 15, std::string("KTXorientation\0", 15)) == 0)
+			image.flipped = pair.find("T=u") != std::string::npos;
+		offset += 4 + ((pair_size + 3) & ~3u);
+	}
+
+	GLint width = image.width, height = image.height;
+	for (uint32_t i = 0; i < header[11]; ++i)
+	{
+		uint32_t size;
+		file.read((char *)&size, sizeof(size));
+		if (!file)
+			return false;
+		KtxLevel level = { width, height, image.data.size(), size };
+		image.data.resize(image.data.size() + size);
+		file.read((char *)&image.data[level.offset], size);
+		file.seekg((4 - size % 4) % 4, std::ios::cur);
+		image.levels.push_back(level);
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	return (bool)file;
+}
+bool writeKtx(const std::string &path, const KtxImage &image)
+{
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	std::string orientation = std::string("KTXorientation\0S=r,T=", 21) + (image.flipped ? "u" : "d") + std::string("\0", 1);
+	uint32_t pair_size = (uint32_t)orientation.size();
+	uint32_t padded_size = (pair_size + 3) & ~3u;
+	uint32_t header[13] = { 0x04030201, 0, 1, 0, image.internal_format, image.base_format, (uint32_t)image.width, (uint32_t)image.height,
+		0, 0, 1, (uint32_t)image.levels.size(), 4 + padded_size };
+	const char padding[4] = {};
+
+	file.write((const char *)ktx_identifier, sizeof(ktx_identifier));
+	file.write((const char *)header, sizeof(header));
+	file.write((const char *)&pair_size, sizeof(pair_size));
+	file.write(orientation.data(), pair_size);
+	file.write(padding, padded_size - pair_size);
+	for (int i = 0; i < image.levels.size(); ++i)
+	{
+		uint32_t size = (uint32_t)image.levels[i].size;
+		file.write((const char *)&size, sizeof(size));
+		file.write((const char *)&image.data[image.levels[i].offset], size);
+		file.write(padding, (4 - size % 4) % 4);
+	}
+	return (bool)file;
+}
+// Uploads every level of the image to the texture currently bound to bind_target
+void uploadKtx(GLenum target, const KtxImage &image)
+{
+	for (int i = 0; i < image.levels.size(); ++i)
+		glCompressedTexImage2D(target, i, image.internal_format, image.levels[i].width, image.levels[i].height, 0,
+			(GLsizei)image.levels[i].size, &image.data[image.levels[i].offset]);
+}
+
+
+namespace bcn
+{
+	uint16_t packColor(const GLfloat color[3])
+	{
+		return (uint16_t)(((GLint)(color[0] * 31.0f / 255.0f + 0.5f) << 11) | ((GLint)(color[1] * 63.0f / 255.0f + 0.5f) << 5) | (GLint)(color[2] * 31.0f / 255.0f + 0.5f));
+	}
+	// Picks the closest of the four palette entries for every pixel, returns the summed squared error
+	GLfloat assignColorIndexes(const GLfloat pixels[16][3], const uint16_t endpoints[2], uint32_t &indexes)
+	{
+		GLfloat palette[4][3];
+		for (int e = 0; e < 2; ++e)
+		{
+			GLint r = (endpoints[e] >> 11) & 31, g = (endpoints[e] >> 5) & 63, b = endpoints[e] & 31;
+			palette[e][0] = (GLfloat)((r << 3) | (r >> 2));
+			palette[e][1] = (GLfloat)((g << 2) | (g >> 4));
+			palette[e][2] = (GLfloat)((b << 3) | (b >> 2));
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+			palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+		}
+
+		GLfloat total_error = 0.0f;
+		indexes = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			GLint best = 0;
+			GLfloat best_error = 1e30f;
+			for (int p = 0; p < 4; ++p)
+			{
+				GLfloat dr = pixels[i][0] - palette[p][0], dg = pixels[i][1] - palette[p][1], db = pixels[i][2] - palette[p][2];
+				GLfloat error = dr * dr + dg * dg + db * db;
+				if (error < best_error)
+				{
+					best_error = error;
+					best = p;
+				}
+			}
+			indexes |= (uint32_t)best << (2 * i);
+			total_error += best_error;
+		}
+		return total_error;
+	}
+
+	// Endpoints of the block are taken on the principal axis of its colors and
+	// pulled in by 1/16 of the range, which lowers the error of the interpolated entries
+	void encodeColorBlock(const GLfloat pixels[16][3], GLubyte *block)
+	{
+		GLfloat mean[3] = { 0.0f, 0.0f, 0.0f }, covariance[6] = {};
+		for (int i = 0; i < 16; ++i)
+			for (int c = 0; c < 3; ++c)
+				mean[c] += pixels[i][c] / 16.0f;
+		for (int i = 0; i < 16; ++i)
+		{
+			GLfloat r = pixels[i][0] - mean[0], g = pixels[i][1] - mean[1], b = pixels[i][2] - mean[2];
+			covariance[0] += r * r; covariance[1] += r * g; covariance[2] += r * b;
+			covariance[3] += g * g; covariance[4] += g * b; covariance[5] += b * b;
+		}
+		GLfloat axis[3] = { 1.0f, 1.0f, 1.0f };
+		for (int iteration = 0; iteration < 8; ++iteration)
+		{
+			GLfloat next[3] = {
+				covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+				covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+				covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2] };
+			GLfloat length = std::max(std::max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+			if (length < 1e-6f)
+				break;
+			for (int c = 0; c < 3; ++c)
+				axis[c] = next[c] / length;
+		}
+
+		GLfloat min_t = 1e30f, max_t = -1e30f;
+		for (int i = 0; i < 16; ++i)
+		{
+			GLfloat t = (pixels[i][0] - mean[0]) * axis[0] + (pixels[i][1] - mean[1]) * axis[1] + (pixels[i][2] - mean[2]) * axis[2];
+			min_t = std::min(min_t, t);
+			max_t = std::max(max_t, t);
+		}
+		GLfloat inset = (max_t - min_t) / 16.0f;
+		min_t += inset;
+		max_t -= inset;
+
+		uint16_t endpoints[2];
+		for (int e = 0; e < 2; ++e)
+		{
+			GLfloat t = e == 0 ? max_t : min_t, color[3];
+			for (int c = 0; c < 3; ++c)
+				color[c] = std::min(std::max(mean[c] + axis[c] * t, 0.0f), 255.0f);
+			endpoints[e] = packColor(color);
+		}
+		if (endpoints[0] < endpoints[1])
+			std::swap(endpoints[0], endpoints[1]);
+
+		uint32_t indexes = 0;
+		GLfloat error = endpoints[0] != endpoints[1] ? assignColorIndexes(pixels, endpoints, indexes) : 0.0f;
+
+		// One least squares refit of the endpoints against the chosen indexes
+		if (error > 0.0f)
+		{
+			const GLfloat weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+			GLfloat aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = {}, bx[3] = {};
+			for (int i = 0; i < 16; ++i)
+			{
+				GLfloat a = weights[(indexes >> (2 * i)) & 3], b = 1.0f - a;
+				aa += a * a; ab += a * b; bb += b * b;
+				for (int c = 0; c < 3; ++c)
+				{
+					ax[c] += a * pixels[i][c];
+					bx[c] += b * pixels[i][c];
+				}
+			}
+			GLfloat determinant = aa * bb - ab * ab;
+			if (fabsf(determinant) > 1e-6f)
+			{
+				GLfloat color[2][3];
+				for (int c = 0; c < 3; ++c)
+				{
+					color[0][c] = std::min(std::max((ax[c] * bb - bx[c] * ab) / determinant, 0.0f), 255.0f);
+					color[1][c] = std::min(std::max((bx[c] * aa - ax[c] * ab) / determinant, 0.0f), 255.0f);
+				}
+				uint16_t refit[2] = { packColor(color[0]), packColor(color[1]) };
+				if (refit[0] < refit[1])
+					std::swap(refit[0], refit[1]);
+				uint32_t refit_indexes = 0;
+				if (refit[0] != refit[1] && assignColorIndexes(pixels, refit, refit_indexes) < error)
+				{
+					endpoints[0] = refit[0];
+					endpoints[1] = refit[1];
+					indexes = refit_indexes;
+				}
+			}
+		}
+		memcpy(block, endpoints, 4);
+		memcpy(block + 4, &indexes, 4);
+	}
+	void encodeAlphaBlock(const GLfloat values[16], GLubyte *block)
+	{
+		GLfloat min_value = 255.0f, max_value = 0.0f;
+		for (int i = 0; i < 16; ++i)
+		{
+			min_value = std::min(min_value, values[i]);
+			max_value = std::max(max_value, values[i]);
+		}
+		GLubyte a0 = (GLubyte)(max_value + 0.5f), a1 = (GLubyte)(min_value + 0.5f);
+
+		uint64_t indexes = 0;
+		if (a0 != a1)
+		{
+			GLfloat palette[8] = { (GLfloat)a0, (GLfloat)a1 };
+			for (int p = 1; p < 7; ++p)
+				palette[p + 1] = ((7 - p) * (GLfloat)a0 + p * (GLfloat)a1) / 7.0f;
+			for (int i = 0; i < 16; ++i)
+			{
+				GLint best = 0;
+				GLfloat best_error = 1e30f;
+				for (int p = 0; p < 8; ++p)
+				{
+					GLfloat error = fabsf(values[i] - palette[p]);
+					if (error < best_error)
+					{
+						best_error = error;
+						best = p;
+					}
+				}
+				indexes |= (uint64_t)best << (3 * i);
+			}
+		}
+		block[0] = a0;
+		block[1] = a1;
+		for (int i = 0; i < 6; ++i)
+			block[2 + i] = (GLubyte)(indexes >> (8 * i));
+	}
+
+	// Encodes one mip level, rows of blocks are split between worker threads
+	void encodeLevel(const std::vector <GLfloat> &pixels, GLint width, GLint height, GLint channels, BlockFormat format, GLubyte *output)
+	{
+		GLint blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+		size_t block_size = format == BLOCK_FORMAT_BC1 || format == BLOCK_FORMAT_BC4 ? 8 : 16;
+
+		auto encodeRows = [&](GLint first_row, GLint last_row)
+		{
+			GLfloat colors[16][3], alpha[16], green[16];
+			for (GLint by = first_row; by < last_row; ++by)
+				for (GLint bx = 0; bx < blocks_x; ++bx)
+				{
+					for (int i = 0; i < 16; ++i)
+					{
+						// Edge blocks repeat the last row/column
+						GLint x = std::min(bx * 4 + i % 4, width - 1), y = std::min(by * 4 + i / 4, height - 1);
+						const GLfloat *pixel = &pixels[((size_t)y * width + x) * channels];
+						for (int c = 0; c < 3; ++c)
+							colors[i][c] = pixel[std::min(c, channels - 1)];
+						alpha[i] = channels == 4 ? pixel[3] : pixel[0];
+						green[i] = channels > 1 ? pixel[1] : pixel[0];
+					}
+					GLubyte *block = output + ((size_t)by * blocks_x + bx) * block_size;
+					if (format == BLOCK_FORMAT_BC1)
+						encodeColorBlock(colors, block);
+					else if (format == BLOCK_FORMAT_BC3)
+					{
+						encodeAlphaBlock(alpha, block);
+						encodeColorBlock(colors, block + 8);
+					}
+					else if (format == BLOCK_FORMAT_BC4)
+						encodeAlphaBlock(alpha, block);
+					else
+					{
+						encodeAlphaBlock(alpha, block);
+						encodeAlphaBlock(green, block + 8);
+					}
+				}
+		};
+
+		GLint thread_count = std::max((GLint)std::thread::hardware_concurrency(), 1);
+		thread_count = std::min(thread_count, blocks_y);
+		std::vector <std::thread> threads;
+		for (GLint t = 1; t < thread_count; ++t)
+			threads.push_back(std::thread(encodeRows, blocks_y * t / thread_count, blocks_y * (t + 1) / thread_count));
+		encodeRows(0, blocks_y / thread_count);
+		for (int t = 0; t < threads.size(); ++t)
+			threads[t].join();
+	}
+
+	// 2x2 box filter, normal maps are renormalized after averaging
+	void downsample(const std::vector <GLfloat> &source, GLint width, GLint height, GLint channels, bool normal_map, std::vector <GLfloat> &result)
+	{
+		GLint next_width = std::max(width / 2, 1), next_height = std::max(height / 2, 1);
+		result.assign((size_t)next_width * next_height * channels, 0.0f);
+		for (GLint y = 0; y < next_height; ++y)
+			for (GLint x = 0; x < next_width; ++x)
+			{
+				GLfloat *pixel = &result[((size_t)y * next_width + x) * channels];
+				for (int dy = 0; dy < 2; ++dy)
+					for (int dx = 0; dx < 2; ++dx)
+					{
+						GLint sx = std::min(2 * x + dx, width - 1), sy = std::min(2 * y + dy, height - 1);
+						for (int c = 0; c < channels; ++c)
+							pixel[c] += source[((size_t)sy * width + sx) * channels + c] / 4.0f;
+					}
+				if (normal_map)
+				{
+					GLfloat n[3], length = 0.0f;
+					for (int c = 0; c < 3; ++c)
+					{
+						n[c] = pixel[c] / 127.5f - 1.0f;
+						length += n[c] * n[c];
+					}
+					length = sqrtf(length);
+					if (length > 1e-6f)
+						for (int c = 0; c < 3; ++c)
+							pixel[c] = (n[c] / length + 1.0f) * 127.5f;
+				}
+			}
+	}
+}
+
+BlockFormat chooseBlockFormat(const std::string &path, const GLubyte *data, GLint width, GLint height, GLint nr_channels)
+{
+	std::string name = path.substr(path.find_last_of("/\\") + 1);
+	std::transform(name.begin(), name.end(), name.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+	if (name.find("normal") != std::string::npos || name.find("nrm") != std::string::npos)
+		return BLOCK_FORMAT_BC5;
+	if (nr_channels < 3 || name.find("specular") != std::string::npos || name.find("displacement") != std::string::npos ||
+		name.find("gloss") != std::string::npos || name.find("height") != std::string::npos)
+		return BLOCK_FORMAT_BC4;
+
+	// JPEG chroma noise keeps grey images from having exactly equal channels
+	bool grayscale = true, opaque = true;
+	for (size_t i = 0; i < (size_t)width * height; ++i)
+	{
+		const GLubyte *pixel = data + i * nr_channels;
+		if (abs(pixel[0] - pixel[1]) > 4 || abs(pixel[0] - pixel[2]) > 4)
+			grayscale = false;
+		if (nr_channels == 4 && pixel[3] != 255)
+			opaque = false;
+	}
+	if (grayscale && opaque)
+		return BLOCK_FORMAT_BC4;
+	return opaque ? BLOCK_FORMAT_BC1 : BLOCK_FORMAT_BC3;
+}
+
+// Encodes the image with its complete mip chain. flip must match the way the
+// texture is later sampled (Texture2D flips images vertically, the skybox does not)
+bool compressTexture(const std::string &source_path, const std::string &ktx_path, bool flip, BlockFormat &format)
+{
+	GLint width, height, nr_channels;
+	stbi_set_flip_vertically_on_load_thread(flip);
+	GLubyte *data = stbi_load(source_path.c_str(), &width, &height, &nr_channels, 0);
+	if (data == nullptr)
+		return false;
+
+	format = chooseBlockFormat(source_path, data, width, height, nr_channels);
+	GLint channels = format == BLOCK_FORMAT_BC4 ? 1 : (format == BLOCK_FORMAT_BC3 ? 4 : 3);
+	std::vector <GLfloat> pixels((size_t)width * height * channels);
+	for (size_t i = 0; i < (size_t)width * height; ++i)
+		for (int c = 0; c < channels; ++c)
+			pixels[i * channels + c] = data[i * nr_channels + std::min(c, nr_channels - 1)];
+	stbi_image_free(data);
+
+	KtxImage image;
+	image.internal_format = getBlockInternalFormat(format);
+	image.base_format = format == BLOCK_FORMAT_BC4 ? GL_RED : (format == BLOCK_FORMAT_BC5 ? GL_RG : (format == BLOCK_FORMAT_BC3 ? GL_RGBA : GL_RGB));
+	image.width = width;
+	image.height = height;
+	image.flipped = flip;
+
+	size_t block_size = format == BLOCK_FORMAT_BC1 || format == BLOCK_FORMAT_BC4 ? 8 : 16;
+	std::vector <GLfloat> next;
+	while (true)
+	{
+		KtxLevel level = { width, height, image.data.size(), (size_t)((width + 3) / 4) * ((height + 3) / 4) * block_size };
+		image.data.resize(level.offset + level.size);
+		bcn::encodeLevel(pixels, width, height, channels, format, &image.data[level.offset]);
+		image.levels.push_back(level);
+		if (width == 1 && height == 1)
+			break;
+		bcn::downsample(pixels, width, height, channels, format == BLOCK_FORMAT_BC5, next);
+		pixels.swap(next);
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	return writeKtx(ktx_path, image);
+}
+
+std::vector <std::string> listImageFiles(const std::string &directory)
+{
+	std::vector <std::string> files, directories(1, directory);
+	while (!directories.empty())
+	{
+		std::string current = directories.back();
+		directories.pop_back();
+		std::vector <std::pair <std::string, bool>> entries;
+#ifdef _WIN32
+		WIN32_FIND_DATAA entry;
+		HANDLE search = FindFirstFileA((current + "/*").c_str(), &entry);
+		if (search == INVALID_HANDLE_VALUE)
+			continue;
+		do
+			entries.push_back(std::make_pair(std::string(entry.cFileName), (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0));
+		while (FindNextFileA(search, &entry));
+		FindClose(search);
+#else
+		DIR *dir = opendir(current.c_str());
+		if (dir == nullptr)
+			continue;
+		while (dirent *entry = readdir(dir))
+		{
+			struct stat entry_stat;
+			std::string name = entry->d_name;
+			bool is_directory = stat((current + "/" + name).c_str(), &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode);
+			entries.push_back(std::make_pair(name, is_directory));
+		}
+		closedir(dir);
+#endif
+		for (int i = 0; i < entries.size(); ++i)
+		{
+			std::string name = entries[i].first, path = current + "/" + name;
+			if (name == "." || name == "..")
+				continue;
+			if (entries[i].second)
+			{
+				directories.push_back(path);
+				continue;
+			}
+			std::string extension = name.substr(name.find_last_of('.') + 1);
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+			if (extension == "jpg" || extension == "jpeg" || extension == "png" || extension == "tga" || extension == "bmp")
+				files.push_back(path);
+		}
+	}
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+// Converts every image under the directories into a .ktx file next to it and
+// prints GPU memory and load time of the compressed and the uncompressed path.
+// Requires a current GL context, load times include the upload
+void compressTextures(const std::vector <std::string> &directories)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	size_t total_raw = 0, total_compressed = 0;
+	double total_raw_time = 0.0, total_compressed_time = 0.0;
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (int d = 0; d < directories.size(); ++d)
+	{
+		std::vector <std::string> files = listImageFiles(directories[d]);
+		for (int i = 0; i < files.size(); ++i)
+		{
+			std::string ktx_path = getKtxPath(files[i]);
+			bool flip = files[i].find("skybox") == std::string::npos;
+			BlockFormat format;
+			if (!compressTexture(files[i], ktx_path, flip, format))
+			{
+				std::cout << files[i] << ": unable to compress\n";
+				continue;
+			}
+
+			// Current path: decode, upload RGB(A) and build mipmaps on the GPU
+			Clock::time_point start = Clock::now();
+			GLint width, height, nr_channels;
+			stbi_set_flip_vertically_on_load_thread(flip);
+			GLubyte *data = stbi_load(files[i].c_str(), &width, &height, &nr_channels, 0);
+			GLenum channels = nr_channels == 1 ? GL_RED : (nr_channels == 2 ? GL_RG : (nr_channels == 3 ? GL_RGB : GL_RGBA));
+			GLState::instance().bindTexture(GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, channels, width, height, 0, channels, GL_UNSIGNED_BYTE, data);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			glFinish();
+			stbi_image_free(data);
+			double raw_time = std::chrono::duration <double, std::milli>(Clock::now() - start).count();
+			size_t raw_size = (size_t)width * height * nr_channels * 4 / 3;
+
+			start = Clock::now();
+			KtxImage image;
+			bool loaded = readKtx(ktx_path, image) && isCompressedFormatSupported(image.internal_format);
+			if (loaded)
+			{
+				uploadKtx(GL_TEXTURE_2D, image);
+				glFinish();
+			}
+			double compressed_time = std::chrono::duration <double, std::milli>(Clock::now() - start).count();
+			GLState::instance().bindTexture(GL_TEXTURE_2D, 0);
+
+			std::cout << files[i] << ": " << getBlockFormatName(format) << ", " << width << "x" << height << ", "
+				<< raw_size / 1024 << " KB -> " << image.data.size() / 1024 << " KB, load " << raw_time << " ms -> ";
+			if (loaded)
+				std::cout << compressed_time << " ms\n";
+			else
+				std::cout << "not supported by the driver\n";
+
+			total_raw += raw_size;
+			total_compressed += image.data.size();
+			total_raw_time += raw_time;
+			total_compressed_time += compressed_time;
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glDeleteTextures(1, &texture);
+	GLState::instance().forgetTexture(texture);
+
+	std::cout << "Total: " << total_raw / (1024 * 1024) << " MB -> " << total_compressed / (1024 * 1024) << " MB, load "
+		<< total_raw_time << " ms -> " << total_compressed_time << " ms\n";
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <condition_variable>
+#include <glad/glad.h>
+#include "stb_image.h"
+#include "texture_compression.h"
+
+#define TEXTURE_LOADER_PBO_COUNT 4
+#define TEXTURE_LOADER_PBO_SIZE (4 * 1024 * 1024)
+#define TEXTURE_LOADER_FRAME_BUDGET (16 * 1024 * 1024)
+
+struct TextureImage
+{
+	GLint width, height, nr_channels;
+	size_t memory_size;
+};
+
+// Single-channel images are sampled as grey instead of red
+void setGrayscaleSwizzle(GLenum bind_target)
+{
+	GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	glTexParameteriv(bind_target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+}
+
+// Decode request for a single texture image (or a single cube map face).
+// on_complete is always called on the GL thread once the last row is uploaded
+struct TextureJob
+{
+	std::string path;
+	bool flip;
+	GLuint texture;
+	GLenum bind_target, target;
+	bool gen_mipmap, allow_s3tc;
+	std::function <void(bool, const TextureImage &)> on_complete;
+
+	GLubyte *data;
+	KtxImage compressed;
+	TextureImage image;
+	GLint uploaded_rows;
+	bool cancelled;
+};
+
+// Decodes images on a pool of worker threads and streams the results into
+// GL textures through a ring of pixel buffer objects
+class TextureLoader
+{
+	std::vector <std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque <std::shared_ptr <TextureJob>> pending, decoded;
+	std::shared_ptr <TextureJob> uploading;
+	GLuint jobs_in_flight;
+	bool stopping;
+
+	GLuint pixel_buffers[TEXTURE_LOADER_PBO_COUNT];
+	GLsync fences[TEXTURE_LOADER_PBO_COUNT];
+	GLuint next_buffer;
+	bool buffers_created;
+
+	TextureLoader();
+	~TextureLoader();
+	void start();
+	void workerLoop();
+	bool uploadRows(TextureJob &job, size_t &budget);
+	void completeJob(TextureJob &job, bool success);
+public:
+	static TextureLoader &instance();
+	void request(const std::string &path, bool flip, GLuint texture, GLenum bind_target, GLenum target, bool gen_mipmap,
+		std::function <void(bool, const TextureImage &)> on_complete);
+	void cancel(GLuint texture);
+	void update(size_t budget = TEXTURE_LOADER_FRAME_BUDGET);
+	void finish();
+	bool isIdle();
+	void shutdown();
+};
+
+TextureLoader::TextureLoader() : jobs_in_flight(0), stopping(false), next_buffer(0), buffers_created(false) {}
+TextureLoader::~TextureLoader()
+{
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	for (std::deque <std::shared_ptr <TextureJob>>::iterator it = decoded.begin(); it != decoded.end(); ++it)
+		stbi_image_free((*it)->data);
+}
+TextureLoader &TextureLoader::instance()
+{
+	static TextureLoader loader;
+	return loader;
+}
+void TextureLoader::start()
+{
+	GLuint thread_count = std::thread::hardware_concurrency();
+	thread_count = thread_count > 2 ? thread_count - 1 : 1;
+	for (GLuint i = 0; i < thread_count; ++i)
+		workers.push_back(std::thread(&TextureLoader::workerLoop, this));
+}
+void TextureLoader::workerLoop()
+{
+	while (true)
+	{
+		std::shared_ptr <TextureJob> job;
+		{
+			std::unique_lock <std::mutex> lock(mutex);
+			condition.wait(lock, [this] { return stopping || !pending.empty(); });
+			if (stopping)
+				return;
+			job = pending.front();
+			pending.pop_front();
+			if (job->cancelled)
+			{
+				decoded.push_back(job);
+				continue;
+			}
+		}
+
+		// Block-compressed version produced by compressTextures() takes precedence over the source image
+		KtxImage &compressed = job->compressed;
+		if (readKtx(getKtxPath(job->path), compressed) && compressed.flipped == job->flip &&
+			(job->allow_s3tc || compressed.internal_format == GL_COMPRESSED_RED_RGTC1 || compressed.internal_format == GL_COMPRESSED_RG_RGTC2))
+		{
+			job->image.width = compressed.width;
+			job->image.height = compressed.height;
+			job->image.nr_channels = compressed.base_format == GL_RED ? 1 : (compressed.base_format == GL_RG ? 2 : (compressed.base_format == GL_RGB ? 3 : 4));
+			job->image.memory_size = compressed.data.size();
+		}
+		else
+		{
+			compressed.levels.clear();
+			compressed.data.clear();
+			stbi_set_flip_vertically_on_load_thread(job->flip);
+			job->data = stbi_load(job->path.c_str(), &job->image.width, &job->image.height, &job->image.nr_channels, 0);
+			job->image.memory_size = (size_t)job->image.width * job->image.height * job->image.nr_channels * (job->gen_mipmap ? 4 : 3) / 3;
+		}
+
+		std::lock_guard <std::mutex> lock(mutex);
+		decoded.push_back(job);
+	}
+}
+void TextureLoader::request(const std::string &path, bool flip, GLuint texture, GLenum bind_target, GLenum target, bool gen_mipmap,
+	std::function <void(bool, const TextureImage &)> on_complete)
+{
+	std::shared_ptr <TextureJob> job(new TextureJob());
+	job->path = path;
+	job->flip = flip;
+	job->texture = texture;
+	job->bind_target = bind_target;
+	job->target = target;
+	job->gen_mipmap = gen_mipmap;
+	job->allow_s3tc = isCompressedFormatSupported(GL_COMPRESSED_RGB_S3TC_DXT1_EXT);
+	job->on_complete = on_complete;
+	job->data = nullptr;
+	job->image.width = job->image.height = job->image.nr_channels = 0;
+	job->image.memory_size = 0;
+	job->uploaded_rows = 0;
+	job->cancelled = false;
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		if (workers.empty())
+			start();
+		pending.push_back(job);
+		++jobs_in_flight;
+	}
+	condition.notify_one();
+}
+void TextureLoader::cancel(GLuint texture)
+{
+	std::lock_guard <std::mutex> lock(mutex);
+	for (std::deque <std::shared_ptr <TextureJob>>::iterator it = pending.begin(); it != pending.end(); ++it)
+		if ((*it)->texture == texture)
+			(*it)->cancelled = true;
+	for (std::deque <std::shared_ptr <TextureJob>>::iterator it = decoded.begin(); it != decoded.end(); ++it)
+		if ((*it)->texture == texture)
+			(*it)->cancelled = true;
+	if (uploading && uploading->texture == texture)
+		uploading->cancelled = true;
+}
+void TextureLoader::completeJob(TextureJob &job, bool success)
+{
+	stbi_image_free(job.data);
+	job.data = nullptr;
+	job.compressed.data.clear();
+	if (!job.cancelled)
+	{
+		if (success && job.gen_mipmap)
+		{
+			GLState::instance().bindTexture(job.bind_target, job.texture);
+			glGenerateMipmap(job.bind_target);
+			GLState::instance().bindTexture(job.bind_target, 0);
+		}
+		job.on_complete(success, job.image);
+	}
+	std::lock_guard <std::mutex> lock(mutex);
+	--jobs_in_flight;
+}
+bool TextureLoader::uploadRows(TextureJob &job, size_t &budget)
+{
+	GLenum format = GL_RED;
+	if (job.image.nr_channels == 2)
+		format = GL_RG;
+	else if (job.image.nr_channels == 3)
+		format = GL_RGB;
+	else if (job.image.nr_channels == 4)
+		format = GL_RGBA;
+	size_t row_size = (size_t)job.image.width * job.image.nr_channels;
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	GLState::instance().bindTexture(job.bind_target, job.texture);
+	if (job.uploaded_rows == 0)
+	{
+		glTexImage2D(job.target, 0, format, job.image.width, job.image.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+		if (format == GL_RED)
+			setGrayscaleSwizzle(job.bind_target);
+	}
+
+	GLint rows_per_buffer = (GLint)(TEXTURE_LOADER_PBO_SIZE / row_size);
+	if (rows_per_buffer == 0)
+	{
+		// A single row does not fit into a staging buffer, upload it directly
+		glTexSubImage2D(job.target, 0, 0, 0, job.image.width, job.image.height, format, GL_UNSIGNED_BYTE, job.data);
+		job.uploaded_rows = job.image.height;
+	}
+	while (job.uploaded_rows < job.image.height && budget > 0)
+	{
+		GLuint buffer = next_buffer;
+		if (fences[buffer] != 0)
+		{
+			// Every staging buffer is still read by the GPU, continue next frame
+			if (glClientWaitSync(fences[buffer], 0, 0) == GL_TIMEOUT_EXPIRED)
+				break;
+			glDeleteSync(fences[buffer]);
+			fences[buffer] = 0;
+		}
+
+		GLint rows = job.image.height - job.uploaded_rows;
+		if (rows > rows_per_buffer)
+			rows = rows_per_buffer;
+		size_t size = rows * row_size;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[buffer]);
+		void *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (staging != nullptr)
+		{
+			memcpy(staging, job.data + job.uploaded_rows * row_size, size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glTexSubImage2D(job.target, 0, 0, job.uploaded_rows, job.image.width, rows, format, GL_UNSIGNED_BYTE, (void *)0);
+			fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		else
+			glTexSubImage2D(job.target, 0, 0, job.uploaded_rows, job.image.width, rows, format, GL_UNSIGNED_BYTE, job.data + job.uploaded_rows * row_size);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		job.uploaded_rows += rows;
+		budget = budget > size ? budget - size : 0;
+		next_buffer = (next_buffer + 1) % TEXTURE_LOADER_PBO_COUNT;
+	}
+	GLState::instance().bindTexture(job.bind_target, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	return job.uploaded_rows == job.image.height;
+}
+void TextureLoader::update(size_t budget)
+{
+	if (!buffers_created)
+	{
+		glGenBuffers(TEXTURE_LOADER_PBO_COUNT, pixel_buffers);
+		for (int i = 0; i < TEXTURE_LOADER_PBO_COUNT; ++i)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[i]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_LOADER_PBO_SIZE, NULL, GL_STREAM_DRAW);
+			fences[i] = 0;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		buffers_created = true;
+	}
+
+	while (budget > 0)
+	{
+		if (!uploading)
+		{
+			std::lock_guard <std::mutex> lock(mutex);
+			if (decoded.empty())
+				return;
+			uploading = decoded.front();
+			decoded.pop_front();
+		}
+
+		TextureJob &job = *uploading;
+		if (!job.compressed.levels.empty() && !job.cancelled)
+		{
+			// Mip chain is stored in the file, compressed images are small enough to go in one call
+			GLState::instance().bindTexture(job.bind_target, job.texture);
+			uploadKtx(job.target, job.compressed);
+			if (job.compressed.base_format == GL_RED)
+				setGrayscaleSwizzle(job.bind_target);
+			GLState::instance().bindTexture(job.bind_target, 0);
+			budget = budget > job.compressed.data.size() ? budget - job.compressed.data.size() : 0;
+			job.gen_mipmap = false;
+			completeJob(job, true);
+			uploading.reset();
+			continue;
+		}
+		if (job.data == nullptr || job.cancelled)
+		{
+			if (job.data == nullptr && !job.cancelled)
+				std::cout << "Texture loading error. Path: " << job.path << std::endl;
+			completeJob(job, false);
+			uploading.reset();
+			continue;
+		}
+		if (!uploadRows(job, budget))
+			return;
+		completeJob(job, true);
+		uploading.reset();
+	}
+}
+void TextureLoader::finish()
+{
+	while (!isIdle())
+	{
+		update(SIZE_MAX);
+		std::this_thread::yield();
+	}
+}
+bool TextureLoader::isIdle()
+{
+	std::lock_guard <std::mutex> lock(mutex);
+	return jobs_in_flight == 0;
+}
+void TextureLoader::shutdown()
+{
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+
+	if (buffers_created)
+	{
+		for (int i = 0; i < TEXTURE_LOADER_PBO_COUNT; ++i)
+			if (fences[i] != 0)
+				glDeleteSync(fences[i]);
+		glDeleteBuffers(TEXTURE_LOADER_PBO_COUNT, pixel_buffers);
+		buffers_created = false;
+	}
+}
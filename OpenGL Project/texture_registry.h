@@ -0,0 +1,156 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <glad/glad.h>
+#include "texture.h"
+
+#ifndef _WIN32
+#include <climits>
+#endif
+
+typedef std::shared_ptr <Texture2D> TextureHandle;
+
+struct TextureKey
+{
+	std::string path;
+	GLint wrap_s, wrap_t, min_filter, mag_filter;
+	bool gen_mipmap;
+	bool operator<(const TextureKey &other) const;
+};
+
+bool TextureKey::operator<(const TextureKey &other) const
+{
+	if (path != other.path)
+		return path < other.path;
+	if (wrap_s != other.wrap_s)
+		return wrap_s < other.wrap_s;
+	if (wrap_t != other.wrap_t)
+		return wrap_t < other.wrap_t;
+	if (min_filter != other.min_filter)
+		return min_filter < other.min_filter;
+	if (mag_filter != other.mag_filter)
+		return mag_filter < other.mag_filter;
+	return gen_mipmap < other.gen_mipmap;
+}
+
+// Process-wide cache of loaded textures. Handles are reference counted, the
+// GL texture is deleted when the last mesh holding it goes away
+class TextureRegistry
+{
+	struct Entry
+	{
+		std::weak_ptr <Texture2D> texture;
+		GLuint hits;
+	};
+	std::map <TextureKey, Entry> textures;
+	GLuint hits, misses;
+	TextureRegistry();
+public:
+	static TextureRegistry &instance();
+	static std::string canonicalPath(const std::string &path);
+	TextureHandle load(const std::string &filename, const std::string &type, const std::string &directory = ".",
+		GLint par1 = GL_REPEAT, GLint par2 = GL_REPEAT, GLint par3 = GL_LINEAR_MIPMAP_LINEAR, GLint par4 = GL_LINEAR, bool gen_mipmap = true, bool async = false);
+	GLuint getHits();
+	GLuint getMisses();
+	size_t getBytesSaved();
+	void printStats();
+};
+
+TextureRegistry::TextureRegistry() : hits(0), misses(0) {}
+TextureRegistry &TextureRegistry::instance()
+{
+	static TextureRegistry registry;
+	return registry;
+}
+std::string TextureRegistry::canonicalPath(const std::string &path)
+{
+	std::string result;
+#ifdef _WIN32
+	char full_path[_MAX_PATH];
+	if (_fullpath(full_path, path.c_str(), _MAX_PATH) != nullptr)
+		result = full_path;
+#else
+	char full_path[PATH_MAX];
+	if (realpath(path.c_str(), full_path) != nullptr)
+		result = full_path;
+#endif
+	if (result.empty())
+		result = path;
+
+	// Lexical clean-up for the case the system call above is unavailable or failed
+	std::vector <std::string> parts;
+	std::string part;
+	bool absolute = !result.empty() && (result[0] == '/' || result[0] == '\\');
+	for (size_t i = 0; i <= result.size(); ++i)
+	{
+		if (i == result.size() || result[i] == '/' || result[i] == '\\')
+		{
+			if (part == ".." && !parts.empty() && parts.back() != "..")
+				parts.pop_back();
+			else if (!part.empty() && part != ".")
+				parts.push_back(part);
+			part.clear();
+		}
+		else
+			part += result[i];
+	}
+	result = absolute ? "/" : "";
+	for (size_t i = 0; i < parts.size(); ++i)
+		result += (i ? "/" : "") + parts[i];
+#ifdef _WIN32
+	for (size_t i = 0; i < result.size(); ++i)
+		result[i] = tolower((unsigned char)result[i]);
+#endif
+	return result;
+}
+TextureHandle TextureRegistry::load(const std::string &filename, const std::string &type, const std::string &directory,
+	GLint par1, GLint par2, GLint par3, GLint par4, bool gen_mipmap, bool async)
+{
+	TextureKey key = { canonicalPath(directory + "/" + filename), par1, par2, par3, par4, gen_mipmap };
+	std::map <TextureKey, Entry>::iterator it = textures.find(key);
+	if (it != textures.end())
+	{
+		TextureHandle texture = it->second.texture.lock();
+		if (texture)
+		{
+			++hits;
+			++it->second.hits;
+			return texture;
+		}
+	}
+
+	++misses;
+	TextureHandle texture(new Texture2D(filename, type, directory, par1, par2, par3, par4, gen_mipmap, async), [](Texture2D *texture)
+	{
+		texture->release();
+		delete texture;
+	});
+	Entry entry = { texture, 0 };
+	textures[key] = entry;
+	return texture;
+}
+GLuint TextureRegistry::getHits() { return hits; }
+GLuint TextureRegistry::getMisses() { return misses; }
+size_t TextureRegistry::getBytesSaved() 
+{
+	// Texture size is only known once an asynchronous load has finished, so savings are summed on demand
+	size_t bytes_saved = 0;
+	for (std::map <TextureKey, Entry>::iterator it = textures.begin(); it != textures.end(); ++it)
+	{
+		TextureHandle texture = it->second.texture.lock();
+		if (texture)
+			bytes_saved += it->second.hits * texture->getMemorySize();
+	}
+	return bytes_saved;
+}
+void TextureRegistry::printStats()
+{
+	std::cout << "Texture registry: " << hits << " hits, " << misses << " misses, "
+		<< getBytesSaved() / (1024 * 1024) << " MB saved\n";
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Binding points shared by every program, blocks are attached by name after linking
+#define FRAME_UNIFORMS_BINDING 0
+#define LIGHT_UNIFORMS_BINDING 1
+#define SHADOW_UNIFORMS_BINDING 2
+#define MAX_POINT_LIGHTS 5
+#define SHADOW_MAX_CASCADES 4
+
+// C++ mirrors of the std140 blocks declared in the shaders. A vec3 takes 16
+// bytes unless a scalar follows it, which then fills the fourth component
+struct FrameUniforms
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 view_projection;
+	glm::vec4 camera_pos;
+};
+struct DirectedLightUniforms
+{
+	glm::vec3 dir;			// view space
+	GLfloat padding0;
+	glm::vec3 ambient_intensity;
+	GLfloat padding1;
+	glm::vec3 diffuse_intensity;
+	GLfloat padding2;
+	glm::vec3 specular_intensity;
+	GLfloat padding3;
+};
+struct PointLightUniforms
+{
+	glm::vec3 pos;			// view space
+	GLfloat padding0;
+	glm::vec3 ambient_intensity;
+	GLfloat padding1;
+	glm::vec3 diffuse_intensity;
+	GLfloat padding2;
+	glm::vec3 specular_intensity;
+	GLfloat constant;
+	GLfloat linear;
+	GLfloat quadratic;
+	GLfloat padding3[2];
+};
+struct LightUniforms
+{
+	DirectedLightUniforms dir_light;
+	PointLightUniforms point_light[MAX_POINT_LIGHTS];
+	GLint point_light_count;
+	GLint padding[3];
+	glm::vec4 cluster_params;		// depth slice scale and bias, tile width and height in pixels
+	glm::ivec4 cluster_count;		// grid size in x, y and z
+};
+struct ShadowUniforms
+{
+	glm::mat4 cascade_space[SHADOW_MAX_CASCADES];		// world to the light's clip space, as each cascade was rendered
+	glm::mat4 view_to_cascade[SHADOW_MAX_CASCADES];		// the same from view space, for shading
+	GLint cascade_count;
+	GLint padding[3];
+	glm::mat4 view_to_world;		// point shadow tiles are rendered along the world axes
+};
+
+static_assert(sizeof(FrameUniforms) == 208, "FrameUniforms must follow std140");
+static_assert(sizeof(DirectedLightUniforms) == 64, "DirectedLightUniforms must follow std140");
+static_assert(offsetof(PointLightUniforms, constant) == 60 && sizeof(PointLightUniforms) == 80, "PointLightUniforms must follow std140");
+static_assert(offsetof(LightUniforms, point_light_count) == 464 && offsetof(LightUniforms, cluster_count) == 496, "LightUniforms must follow std140");
+static_assert(offsetof(ShadowUniforms, cascade_count) == 128 * SHADOW_MAX_CASCADES && offsetof(ShadowUniforms, view_to_world) == 128 * SHADOW_MAX_CASCADES + 16,
+	"ShadowUniforms must follow std140");
+
+GLint getUniformBlockBinding(const char *name);
+
+GLint getUniformBlockBinding(const char *name)
+{
+	if (strcmp(name, "Frame") == 0)
+		return FRAME_UNIFORMS_BINDING;
+	if (strcmp(name, "Lights") == 0)
+		return LIGHT_UNIFORMS_BINDING;
+	if (strcmp(name, "Shadows") == 0)
+		return SHADOW_UNIFORMS_BINDING;
+	return -1;
+}
+
+class UniformBuffer
+{
+	GLuint buffer;
+	GLsizeiptr size;
+public:
+	UniformBuffer(GLuint binding, GLsizeiptr size);
+	UniformBuffer(const UniformBuffer &) = delete;
+	UniformBuffer &operator=(const UniformBuffer &) = delete;
+	template <class T> void update(const T &data);
+	void release();
+};
+
+UniformBuffer::UniformBuffer(GLuint binding, GLsizeiptr size) : size(size)
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+}
+template <class T> void UniformBuffer::update(const T &data)
+{
+	// Orphaned first so the driver doesn't wait for last frame's draws
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, (GLsizeiptr)sizeof(T) < size ? (GLsizeiptr)sizeof(T) : size, &data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+void UniformBuffer::release()
+{
+	glDeleteBuffers(1, &buffer);
+	buffer = 0;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+// Per-instance model matrix, one column per attribute
+#define INSTANCE_ATTRIBUTE_LOCATION 5
+
+enum VertexFormat
+{
+	VERTEX_FORMAT_FULL,			// 56 bytes, everything in floats
+	VERTEX_FORMAT_PACKED,		// 24 bytes, float position
+	VERTEX_FORMAT_QUANTIZED,	// 20 bytes, position quantized to the mesh bounds
+	VERTEX_FORMAT_COUNT
+};
+
+struct Vertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 tangent;
+	glm::vec3 bitangent;
+	glm::vec2 tex_coords;
+};
+
+// Shading attributes shared by both packed layouts. The normal is octahedral
+// encoded into two snorm16, the tangent is snorm 10_10_10 with the bitangent
+// sign in the 2-bit w, texture coordinates are half floats
+struct PackedAttributes
+{
+	GLshort normal[2];
+	GLuint tangent;
+	GLushort tex_coords[2];
+};
+struct PackedVertex
+{
+	glm::vec3 position;
+	PackedAttributes attributes;
+};
+struct QuantizedVertex
+{
+	GLshort position[4];
+	PackedAttributes attributes;
+};
+
+// Maps stored positions back to object space: position = offset + scale * stored
+struct VertexQuantization
+{
+	glm::vec3 offset;
+	glm::vec3 scale;
+};
+
+GLuint getVertexStride(VertexFormat format);
+const char *getVertexFormatName(VertexFormat format);
+void setVertexAttributes(VertexFormat format);
+void setInstanceAttributes();
+glm::vec2 encodeOctahedral(glm::vec3 normal);
+PackedAttributes packAttributes(const Vertex &vertex);
+VertexQuantization packVertices(const std::vector <Vertex> &vertices, VertexFormat format, std::vector <GLubyte> &packed);
+
+GLuint getVertexStride(VertexFormat format)
+{
+	switch (format)
+	{
+	case VERTEX_FORMAT_PACKED: return sizeof(PackedVertex);
+	case VERTEX_FORMAT_QUANTIZED: return sizeof(QuantizedVertex);
+	default: return sizeof(Vertex);
+	}
+}
+const char *getVertexFormatName(VertexFormat format)
+{
+	switch (format)
+	{
+	case VERTEX_FORMAT_PACKED: return "packed";
+	case VERTEX_FORMAT_QUANTIZED: return "quantized";
+	default: return "full";
+	}
+}
+void setVertexAttributes(VertexFormat format)
+{
+	GLsizei stride = getVertexStride(format);
+	for (GLuint i = 0; i < 5; ++i)
+		glEnableVertexAttribArray(i);
+
+	if (format == VERTEX_FORMAT_FULL)
+	{
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, position));
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, normal));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, tangent));
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, bitangent));
+		glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, tex_coords));
+		return;
+	}
+
+	size_t attributes;
+	if (format == VERTEX_FORMAT_PACKED)
+	{
+		attributes = offsetof(PackedVertex, attributes);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+	}
+	else
+	{
+		// Not normalized: the shader scales the raw integers with the quantization uniforms
+		attributes = offsetof(QuantizedVertex, attributes);
+		glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, stride, (void*)0);
+	}
+	glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride, (void*)(attributes + offsetof(PackedAttributes, normal)));
+	glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)(attributes + offsetof(PackedAttributes, tangent)));
+	glVertexAttribPointer(4, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)(attributes + offsetof(PackedAttributes, tex_coords)));
+	// Bitangent is rebuilt in the vertex shader
+	glDisableVertexAttribArray(3);
+}
+void setInstanceAttributes()
+{
+	for (GLuint i = 0; i < 4; ++i)
+	{
+		glEnableVertexAttribArray(INSTANCE_ATTRIBUTE_LOCATION + i);
+		glVertexAttribPointer(INSTANCE_ATTRIBUTE_LOCATION + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * i));
+		glVertexAttribDivisor(INSTANCE_ATTRIBUTE_LOCATION + i, 1);
+	}
+}
+glm::vec2 encodeOctahedral(glm::vec3 normal)
+{
+	GLfloat l1_norm = fabs(normal.x) + fabs(normal.y) + fabs(normal.z);
+	if (l1_norm == 0.0f)
+		return glm::vec2(0.0f, 0.0f);
+	normal /= l1_norm;
+	glm::vec2 result(normal.x, normal.y);
+	if (normal.z < 0.0f)
+	{
+		// Lower hemisphere is folded over the diagonals
+		result.x = (1.0f - fabs(normal.y)) * (normal.x >= 0.0f ? 1.0f : -1.0f);
+		result.y = (1.0f - fabs(normal.x)) * (normal.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return result;
+}
+PackedAttributes packAttributes(const Vertex &vertex)
+{
+	PackedAttributes attributes;
+	glm::vec2 normal = encodeOctahedral(vertex.normal);
+	attributes.normal[0] = (GLshort)glm::packSnorm1x16(normal.x);
+	attributes.normal[1] = (GLshort)glm::packSnorm1x16(normal.y);
+
+	glm::vec3 tangent = vertex.tangent;
+	GLfloat length = glm::length(tangent);
+	if (length > 0.0f)
+		tangent /= length;
+	GLfloat handedness = glm::dot(glm::cross(vertex.normal, vertex.tangent), vertex.bitangent) < 0.0f ? -1.0f : 1.0f;
+	attributes.tangent = glm::packSnorm3x10_1x2(glm::vec4(tangent, handedness));
+
+	attributes.tex_coords[0] = glm::packHalf1x16(vertex.tex_coords.x);
+	attributes.tex_coords[1] = glm::packHalf1x16(vertex.tex_coords.y);
+	return attributes;
+}
+VertexQuantization packVertices(const std::vector <Vertex> &vertices, VertexFormat format, std::vector <GLubyte> &packed)
+{
+	VertexQuantization quantization = { glm::vec3(0.0f), glm::vec3(1.0f) };
+	packed.resize(vertices.size() * getVertexStride(format));
+	if (format == VERTEX_FORMAT_FULL)
+	{
+		if (!vertices.empty())
+			memcpy(packed.data(), vertices.data(), packed.size());
+		return quantization;
+	}
+
+	if (format == VERTEX_FORMAT_PACKED)
+	{
+		PackedVertex *packed_vertices = (PackedVertex *)packed.data();
+		for (size_t i = 0; i < vertices.size(); ++i)
+		{
+			packed_vertices[i].position = vertices[i].position;
+			packed_vertices[i].attributes = packAttributes(vertices[i]);
+		}
+		return quantization;
+	}
+
+	glm::vec3 bounds_min(0.0f), bounds_max(0.0f);
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		bounds_min = i ? glm::min(bounds_min, vertices[i].position) : vertices[i].position;
+		bounds_max = i ? glm::max(bounds_max, vertices[i].position) : vertices[i].position;
+	}
+	quantization.offset = (bounds_min + bounds_max) * 0.5f;
+	for (int i = 0; i < 3; ++i)
+	{
+		GLfloat extent = (bounds_max[i] - bounds_min[i]) * 0.5f;
+		quantization.scale[i] = extent > 0.0f ? extent / 32767.0f : 1.0f;
+	}
+
+	QuantizedVertex *quantized_vertices = (QuantizedVertex *)packed.data();
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		glm::vec3 position = (vertices[i].position - quantization.offset) / quantization.scale;
+		for (int j = 0; j < 3; ++j)
+			quantized_vertices[i].position[j] = (GLshort)glm::clamp(floor(position[j] + 0.5f), -32767.0f, 32767.0f);
+		quantized_vertices[i].position[3] = 0;
+		quantized_vertices[i].attributes = packAttributes(vertices[i]);
+	}
+	return quantization;
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <cstring>
+#include <utility>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "gl_state.h"
+#include "shader.h"
+#include "shader_permutations.h"
+#include "geometry_arena.h"
+#include "instancing.h"
+#include "model.h"
+
+#define VISIBILITY_TEXTURE_UNIT 24		// visibility target, draw records, indexes and the vertex buffers of each format on 24-29
+#define VISIBILITY_MAX_MATERIALS 1024	// slot k is drawn at depth (k + 1) / 1024, as in fragment_material_depth.fsh
+
+struct VisibilityStats
+{
+	GLuint draws, records;
+	GLuint materials;
+	GLuint triangles;
+};
+
+// Visibility buffer rendering. The geometry pass writes nothing but the draw
+// record and the triangle of each pixel into an RG32UI target, so overdraw
+// costs no texture samples. Resolving first writes every pixel's material slot
+// into the depth buffer, then draws one full screen triangle per material at
+// the depth of its slot with GL_EQUAL: each pixel passes for exactly one
+// material and is shaded once, with the usual bindings of the mesh. The
+// resolve shader rebuilds the triangle through texture buffers over the
+// geometry arena and interpolates its attributes itself
+class VisibilityBuffer
+{
+	struct Draw
+	{
+		const Mesh *mesh;
+		GLuint lod;
+		GLuint transform;					// first of its matrices in transforms
+		const InstanceBuffer *instances;	// null for a single draw
+		GLuint material;
+	};
+	struct MaterialSlot
+	{
+		const Mesh *mesh;					// any mesh of the material, binds the maps
+		ShaderFeatures features;
+	};
+	std::vector <Draw> draws;
+	std::vector <glm::mat4> transforms;
+	std::vector <MaterialSlot> materials;
+	std::map <std::pair <ShaderFeatures, GLuint>, GLuint> material_slots;
+	std::vector <glm::vec4> records;
+	GLuint framebuffer, target, depth, vertex_array;
+	GLuint record_buffer, buffer_textures[2 + VERTEX_FORMAT_COUNT];	// records, indexes, then one per vertex format
+	GLsizeiptr record_capacity;
+	GLuint width, height;
+	VisibilityStats stats, frame_stats;
+	static GLfloat packBits(GLuint value);
+	GLuint getMaterial(const Mesh &mesh);
+	void writeRecord(const Draw &draw, const glm::mat4 &transform);
+	void bindTextures();
+	void drawFullscreen();
+public:
+	VisibilityBuffer(GLuint width, GLuint height);
+	VisibilityBuffer(const VisibilityBuffer &) = delete;
+	VisibilityBuffer &operator=(const VisibilityBuffer &) = delete;
+	static void setSamplers(Shader &shader);
+	void add(const Mesh &mesh, const glm::mat4 &transform, GLuint lod);
+	void addInstanced(const Mesh &mesh, const InstanceBuffer &instances, const std::vector <glm::mat4> &instance_transforms, GLuint lod);
+	void renderGeometry(Shader &shader, Shader &instanced_shader);
+	void resolve(Shader &material_depth_shader, ShaderVariants &variants, ShaderFeatures scene_features, GLuint target_framebuffer);
+	const VisibilityStats &getFrameStats() const;
+	void printStats() const;
+	void release();
+};
+
+VisibilityBuffer::VisibilityBuffer(GLuint width, GLuint height) : record_capacity(0), width(width), height(height), stats(), frame_stats()
+{
+	glGenFramebuffers(1, &framebuffer);
+	glGenTextures(1, &target);
+	glGenTextures(1, &depth);
+	GLState::instance().bindFramebuffer(framebuffer);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, target);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+	GLState::instance().bindTexture(GL_TEXTURE_2D, depth);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Visibility buffer is incomplete\n";
+	GLState::instance().bindFramebuffer(0);
+
+	glGenBuffers(1, &record_buffer);
+	glGenTextures(2 + VERTEX_FORMAT_COUNT, buffer_textures);
+	glGenVertexArrays(1, &vertex_array);
+}
+// Integers travel in the float records bit for bit, the shaders read them with floatBitsToUint
+GLfloat VisibilityBuffer::packBits(GLuint value)
+{
+	GLfloat result;
+	memcpy(&result, &value, sizeof(result));
+	return result;
+}
+void VisibilityBuffer::setSamplers(Shader &shader)
+{
+	static const char *samplers[2 + VERTEX_FORMAT_COUNT] = { "draws", "indexes", "full_vertices", "packed_vertices", "quantized_vertices" };
+	shader.setUniform("visibility", VISIBILITY_TEXTURE_UNIT);
+	for (int i = 0; i < 2 + VERTEX_FORMAT_COUNT; ++i)
+		shader.setUniform(samplers[i], VISIBILITY_TEXTURE_UNIT + 1 + i);
+}
+// Meshes with the same maps share a slot. With texture arrays that covers every
+// mesh in the same arrays, the layers differ per record. Depth 1.0 is the
+// background, so there is one slot fewer than depth values; returns
+// VISIBILITY_MAX_MATERIALS when they are used up
+GLuint VisibilityBuffer::getMaterial(const Mesh &mesh)
+{
+	ShaderFeatures features = mesh.getFeatures() & ~SHADER_PACKED_VERTEX;
+	std::pair <ShaderFeatures, GLuint> key(features, mesh.getMaterialKey());
+	std::map <std::pair <ShaderFeatures, GLuint>, GLuint>::iterator slot = material_slots.find(key);
+	if (slot != material_slots.end())
+		return slot->second;
+	if (materials.size() == VISIBILITY_MAX_MATERIALS - 1)
+		return VISIBILITY_MAX_MATERIALS;
+	MaterialSlot material = { &mesh, features };
+	materials.push_back(material);
+	material_slots[key] = (GLuint)materials.size() - 1;
+	return (GLuint)materials.size() - 1;
+}
+void VisibilityBuffer::add(const Mesh &mesh, const glm::mat4 &transform, GLuint lod)
+{
+	GLuint material = getMaterial(mesh);
+	if (material == VISIBILITY_MAX_MATERIALS)
+		return;
+	Draw draw = { &mesh, lod, (GLuint)transforms.size(), nullptr, material };
+	draws.push_back(draw);
+	transforms.push_back(transform);
+}
+// Every instance gets a record of its own, the matrices have to be the ones in the buffer
+void VisibilityBuffer::addInstanced(const Mesh &mesh, const InstanceBuffer &instances, const std::vector <glm::mat4> &instance_transforms, GLuint lod)
+{
+	GLuint material = instances.getCount() && instance_transforms.size() >= instances.getCount() ? getMaterial(mesh) : VISIBILITY_MAX_MATERIALS;
+	if (material == VISIBILITY_MAX_MATERIALS)
+		return;
+	Draw draw = { &mesh, lod, (GLuint)transforms.size(), &instances, material };
+	draws.push_back(draw);
+	transforms.insert(transforms.end(), instance_transforms.begin(), instance_transforms.begin() + instances.getCount());
+}
+// Eight texels, laid out as fragment_visibility_resolve.fsh reads them. Offsets
+// are read when the frame is drawn, uploads in between may have moved the geometry
+void VisibilityBuffer::writeRecord(const Draw &draw, const glm::mat4 &transform)
+{
+	const GeometryAllocation &allocation = GeometryArena::instance().getAllocation(draw.mesh->getGeometry());
+	const VertexQuantization &quantization = draw.mesh->getQuantization();
+	for (int i = 0; i < 4; ++i)
+		records.push_back(transform[i]);
+	records.push_back(glm::vec4(quantization.offset, packBits(allocation.vertex_offset)));
+	records.push_back(glm::vec4(quantization.scale, packBits(allocation.index_offset + draw.mesh->getLod(draw.lod).index_offset)));
+	records.push_back(draw.mesh->getArrayLayers());
+	records.push_back(glm::vec4(packBits(allocation.format), packBits(draw.material), 0.0f, 0.0f));
+}
+// The arena replaces its buffers when it grows or compacts and a freed name may
+// come back for another buffer, so the views are attached again every frame
+void VisibilityBuffer::bindTextures()
+{
+	GLuint buffers[2 + VERTEX_FORMAT_COUNT] = { record_buffer, GeometryArena::instance().getIndexBuffer() };
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+		buffers[2 + i] = GeometryArena::instance().getVertexBuffer((VertexFormat)i);
+	GLState::instance().bindTexture(GL_TEXTURE0 + VISIBILITY_TEXTURE_UNIT, GL_TEXTURE_2D, target);
+	for (int i = 0; i < 2 + VERTEX_FORMAT_COUNT; ++i)
+	{
+		GLState::instance().activeTexture(GL_TEXTURE0 + VISIBILITY_TEXTURE_UNIT + 1 + i);
+		GLState::instance().bindTexture(GL_TEXTURE_BUFFER, buffer_textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, i ? GL_R32UI : GL_RGBA32F, buffers[i]);
+	}
+}
+void VisibilityBuffer::drawFullscreen()
+{
+	GLState::instance().bindVertexArray(vertex_array);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+// Clears the target, uploads the records and draws the geometry with the
+// record index as draw_id. Instanced draws add gl_InstanceID to it
+void VisibilityBuffer::renderGeometry(Shader &shader, Shader &instanced_shader)
+{
+	GLState::instance().bindFramebuffer(framebuffer);
+	glViewport(0, 0, width, height);
+	GLuint background[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, background);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	records.clear();
+	for (size_t i = 0; i < draws.size(); ++i)
+	{
+		GLuint count = draws[i].instances ? draws[i].instances->getCount() : 1;
+		for (GLuint j = 0; j < count; ++j)
+			writeRecord(draws[i], transforms[draws[i].transform + j]);
+	}
+	GLsizeiptr size = (GLsizeiptr)(records.size() * sizeof(glm::vec4));
+	if (size > record_capacity)
+		record_capacity = size;
+	glBindBuffer(GL_TEXTURE_BUFFER, record_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, record_capacity, nullptr, GL_STREAM_DRAW);
+	if (size)
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size, records.data());
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	GLuint record = 0;
+	for (size_t i = 0; i < draws.size(); ++i)
+	{
+		const Draw &draw = draws[i];
+		const MeshLod &lod = draw.mesh->getLod(draw.lod);
+		const VertexQuantization &quantization = draw.mesh->getQuantization();
+		Shader &current = draw.instances ? instanced_shader : shader;
+		current.use();
+		current.setUniform("draw_id"_uniform, (GLint)record);
+		current.setUniform("position_offset"_uniform, quantization.offset);
+		current.setUniform("position_scale"_uniform, quantization.scale);
+		if (draw.instances)
+		{
+			GeometryArena::instance().drawInstanced(draw.mesh->getGeometry(), lod.index_offset, lod.index_count, draw.instances->getBuffer(), draw.instances->getCount());
+			record += draw.instances->getCount();
+			stats.triangles += lod.index_count / 3 * draw.instances->getCount();
+		}
+		else
+		{
+			current.setUniform("model"_uniform, transforms[draw.transform]);
+			GeometryArena::instance().draw(draw.mesh->getGeometry(), lod.index_offset, lod.index_count);
+			++record;
+			stats.triangles += lod.index_count / 3;
+		}
+	}
+	stats.draws = (GLuint)draws.size();
+	stats.records = record;
+	stats.materials = (GLuint)materials.size();
+}
+// Shades into target_framebuffer, whose depth has to be cleared. Afterwards
+// its depth holds the scene's again, for the passes that follow
+void VisibilityBuffer::resolve(Shader &material_depth_shader, ShaderVariants &variants, ShaderFeatures scene_features, GLuint target_framebuffer)
+{
+	GLState::instance().bindFramebuffer(target_framebuffer);
+	bindTextures();
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	GLState::instance().depthFunc(GL_ALWAYS);
+	material_depth_shader.use();
+	drawFullscreen();
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	glDepthMask(GL_FALSE);
+	GLState::instance().depthFunc(GL_EQUAL);
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		Shader &shader = variants.get(scene_features | materials[i].features);
+		shader.use();
+		materials[i].mesh->bindMaterial(shader);
+		shader.setUniform("ndc_depth"_uniform, (GLfloat)(i + 1) / VISIBILITY_MAX_MATERIALS * 2.0f - 1.0f);
+		drawFullscreen();
+	}
+	glDepthMask(GL_TRUE);
+	GLState::instance().depthFunc(GL_LESS);
+
+	// Blits can't change the sample count, the target must not be multisampled
+	GLState::instance().bindReadFramebuffer(framebuffer);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+	draws.clear();
+	transforms.clear();
+	materials.clear();
+	material_slots.clear();
+	frame_stats = stats;
+	stats = VisibilityStats();
+}
+const VisibilityStats &VisibilityBuffer::getFrameStats() const { return frame_stats; }
+void VisibilityBuffer::printStats() const
+{
+	std::cout << "Visibility buffer, last frame: " << frame_stats.draws << " draws, " << frame_stats.records << " records, "
+		<< frame_stats.materials << " materials, " << frame_stats.triangles << " triangles, target " << width * height * 12 / 1024 << " KB\n";
+}
+void VisibilityBuffer::release()
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	GLState::instance().forgetFramebuffer(framebuffer);
+	glDeleteTextures(1, &target);
+	glDeleteTextures(1, &depth);
+	glDeleteTextures(2 + VERTEX_FORMAT_COUNT, buffer_textures);
+	GLState::instance().forgetTexture(target);
+	GLState::instance().forgetTexture(depth);
+	for (int i = 0; i < 2 + VERTEX_FORMAT_COUNT; ++i)
+		GLState::instance().forgetTexture(buffer_textures[i]);
+	glDeleteBuffers(1, &record_buffer);
+	glDeleteVertexArrays(1, &vertex_array);
+	GLState::instance().forgetVertexArray(vertex_array);
+}
+
+// Model methods that need the complete visibility buffer type
+void Model::render(VisibilityBuffer &visibility, const glm::mat4 &transform, const LodSelector *selector = nullptr)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		visibility.add(meshes[i], transform, selector ? meshes[i].selectLod(*selector) : 0);
+}
+void Model::renderInstanced(VisibilityBuffer &visibility, const InstanceBuffer &instances, const vector <glm::mat4> &transforms, GLuint lod = 0)
+{
+	upload(1);
+	for (size_t i = 0; i < meshes.size(); i++)
+		visibility.addInstanced(meshes[i], instances, transforms, lod);
+}